@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "batch.h"
+#include "protocol.h"
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int batch_init(Batch *b, size_t max_count, size_t max_bytes, long linger_us) {
+    b->cap = max_bytes;
+    b->buf = malloc(b->cap);
+    if (!b->buf) return -1;
+    pthread_mutex_init(&b->lock, NULL);
+    b->fd = -1;
+    b->broken = 0;
+    b->blocked = 0;
+    b->len = 0;
+    b->count = 0;
+    b->oldest_us = 0;
+    b->max_count = max_count;
+    b->max_bytes = max_bytes;
+    b->linger_us = linger_us;
+    return 0;
+}
+
+// Write the pending frames in one go; caller holds b->lock
+static int flush_locked(Batch *b) {
+    if (b->fd < 0 || b->broken) return b->len == 0 ? 1 : 0;
+
+    size_t off = 0;
+    while (off < b->len) {
+        ssize_t sent = send(b->fd, b->buf + off, b->len - off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            // Where the stream stopped is unknown, so nothing can be resent
+            perror("[ERROR] Publish failed");
+            fprintf(stderr, "[ERROR] Dropped %zu unsent frame(s).\n", b->count);
+            b->broken = 1;
+            b->blocked = 0;
+            b->len = 0;
+            b->count = 0;
+            return -1;
+        }
+        off += sent;
+    }
+
+    if (off < b->len) {
+        // Socket full: keep the rest for the next flush
+        memmove(b->buf, b->buf + off, b->len - off);
+        b->len -= off;
+        b->blocked = 1;
+        return 0;
+    }
+    b->blocked = 0;
+    b->len = 0;
+    b->count = 0;
+    return 1;
+}
+
+void batch_destroy(Batch *b) {
+    pthread_mutex_lock(&b->lock);
+    flush_locked(b);
+    if (b->fd >= 0) close(b->fd);
+    b->fd = -1;
+    pthread_mutex_unlock(&b->lock);
+
+    free(b->buf);
+    pthread_mutex_destroy(&b->lock);
+}
+
+void batch_attach(Batch *b, int fd) {
+    pthread_mutex_lock(&b->lock);
+    if (b->fd >= 0) close(b->fd);
+    b->fd = fd;
+    b->broken = 0;
+    b->blocked = 0;
+    pthread_mutex_unlock(&b->lock);
+}
+
+int batch_attached(Batch *b) {
+    pthread_mutex_lock(&b->lock);
+    int attached = b->fd >= 0 && !b->broken;
+    pthread_mutex_unlock(&b->lock);
+    return attached;
+}
+
+int batch_pending(Batch *b) {
+    pthread_mutex_lock(&b->lock);
+    int pending = b->len > 0;
+    pthread_mutex_unlock(&b->lock);
+    return pending;
+}
+
+int batch_blocked(Batch *b) {
+    pthread_mutex_lock(&b->lock);
+    int blocked = b->blocked;
+    pthread_mutex_unlock(&b->lock);
+    return blocked;
+}
+
+int batch_frame(Batch *b, uint8_t opcode, const char *topic, const void *payload, size_t payload_len) {
+    Payload p;
+    payload_init(&p, payload, payload_len);
+    return batch_payload_frame(b, opcode, topic, &p);
+}
+
+int batch_payload_frame(Batch *b, uint8_t opcode, const char *topic, const Payload *p) {
+    size_t topic_len = strlen(topic);
+    if (topic_len > MAX_TOPIC_LEN || p->len > MAX_PAYLOAD_SIZE || (p->group && p->group_len > MAX_GROUP_LEN) ||
+        (p->key && p->key_len > MAX_KEY_LEN)) {
+        fprintf(stderr, "[ERROR] Topic or payload exceeds protocol limits.\n");
+        errno = EINVAL;
+        return -1;
+    }
+    size_t size = payload_frame_size(topic_len, p);
+
+    pthread_mutex_lock(&b->lock);
+    int was_blocked = b->blocked;
+    if (b->len > 0 && b->len + size > b->max_bytes) {
+        flush_locked(b);
+    }
+
+    if (b->len + size > b->cap) {
+        // The socket is behind (or a frame is bigger than a whole batch)
+        if (b->len > 0 && b->len + size > b->max_bytes * BATCH_PENDING_FACTOR) {
+            pthread_mutex_unlock(&b->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t cap = b->cap * 2 > b->len + size ? b->cap * 2 : b->len + size;
+        char *buf = realloc(b->buf, cap);
+        if (!buf) {
+            pthread_mutex_unlock(&b->lock);
+            fprintf(stderr, "[ERROR] Out of memory batching a %zu byte message.\n", p->len);
+            errno = ENOMEM;
+            return -1;
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+
+    int started = b->len == 0;
+    if (started) b->oldest_us = now_us();
+    encode_payload_frame(b->buf + b->len, b->cap - b->len, opcode, 0, topic, topic_len, p);
+    b->len += size;
+    b->count++;
+
+    int result = started && b->linger_us > 0;
+    if (b->count >= b->max_count || b->len >= b->max_bytes || b->linger_us == 0) {
+        if (flush_locked(b) < 0) result = -1;
+    }
+    if (result == 0 && b->blocked && !was_blocked) result = 1;
+    pthread_mutex_unlock(&b->lock);
+    return result;
+}
+
+int batch_publish(Batch *b, const char *topic, const void *payload, size_t payload_len) {
+    return batch_frame(b, OP_PUBLISH, topic, payload, payload_len);
+}
+
+int batch_flush(Batch *b) {
+    pthread_mutex_lock(&b->lock);
+    int result = flush_locked(b);
+    pthread_mutex_unlock(&b->lock);
+    return result;
+}
+
+long batch_flush_due(Batch *b) {
+    pthread_mutex_lock(&b->lock);
+    long wait = b->linger_us;
+    if (b->len > 0) {
+        long long waited = now_us() - b->oldest_us;
+        if (waited >= b->linger_us || b->blocked) {
+            flush_locked(b);
+        } else {
+            wait = (long)(b->linger_us - waited);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return wait;
+}
@@ -0,0 +1,74 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+#define DEFAULT_BATCH_COUNT 256
+#define DEFAULT_BATCH_BYTES 65536
+#define DEFAULT_LINGER_US 1000
+#define BATCH_PENDING_FACTOR 16  // buffered bytes allowed while the socket is full, in batches
+
+// Frames bound for one broker connection, coalesced into a single write.
+// The batch goes out when it holds max_count frames or max_bytes, or once
+// its oldest frame has waited linger_us (see batch_flush_due). Frames are
+// kept while no socket is attached or the socket is full, up to
+// BATCH_PENDING_FACTOR batches. All calls are thread safe, so a background
+// thread can drive the linger.
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;              // -1 until batch_attach
+    int broken;          // a write failed; fd stays open until the next attach
+    int blocked;         // the last write left bytes unsent: the socket is full
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t count;
+    long long oldest_us; // when the first pending frame was added
+    size_t max_count;
+    size_t max_bytes;
+    long linger_us;
+} Batch;
+
+int batch_init(Batch *b, size_t max_count, size_t max_bytes, long linger_us);
+
+// Flush anything pending and close the connection
+void batch_destroy(Batch *b);
+
+// Hand the batch a connected socket, closing the previous one. Pass -1 to
+// detach. Pending frames go out on the next flush.
+void batch_attach(Batch *b, int fd);
+
+// Whether a socket is attached and no write on it has failed
+int batch_attached(Batch *b);
+
+// Whether frames are waiting to be written
+int batch_pending(Batch *b);
+
+// Whether the last write left frames unsent because the socket was full,
+// so they go out once it is writable rather than after the linger
+int batch_blocked(Batch *b);
+
+// Append a frame, writing the batch out if it is full. Returns 1 if the
+// flushing thread has something new to wait for (the frame started a
+// lingering batch, or writing found the socket full), 0 if not and -1 if
+// the frame is
+// invalid, too much is buffered already (errno EAGAIN) or a write failed
+// (the pending frames are dropped and batch_attached turns false).
+int batch_frame(Batch *b, uint8_t opcode, const char *topic, const void *payload, size_t payload_len);
+int batch_payload_frame(Batch *b, uint8_t opcode, const char *topic, const Payload *p);
+int batch_publish(Batch *b, const char *topic, const void *payload, size_t payload_len);
+
+// Write out as much as the socket takes. Returns 1 when nothing is left,
+// 0 when frames are still pending and -1 on a write error.
+int batch_flush(Batch *b);
+
+// Flush if the oldest pending frame has lingered long enough, or the socket
+// was full last time. Returns the microseconds until the next flush is due,
+// or linger_us if none is pending or the socket is still full.
+long batch_flush_due(Batch *b);
+
+#endif
@@ -1,183 +1,356 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-
-#define BUFFER_SIZE 1024
-#define MAX_TOPICS 10
-#define MAX_SUBSCRIBERS 10
-
-typedef struct {
-    char topic[50];
-    int subscribers[MAX_SUBSCRIBERS];
-    int sub_count;
-} Topic;
-
-Topic topics[MAX_TOPICS];
-int topic_count = 0;
-
-pthread_mutex_t lock;
-
-// Remove a subscriber socket from all topics
-void remove_subscriber(int sock) {
-    pthread_mutex_lock(&lock);
-
-    for (int i = 0; i < topic_count; i++) {
-        int index = -1;
-        for (int j = 0; j < topics[i].sub_count; j++) {
-            if (topics[i].subscribers[j] == sock) {
-                index = j;
-                break;
-            }
-        }
-
-        if (index != -1) {
-            // Shift remaining subscribers to fill the gap
-            for (int j = index; j < topics[i].sub_count - 1; j++) {
-                topics[i].subscribers[j] = topics[i].subscribers[j + 1];
-            }
-            topics[i].sub_count--;
-        }
-    }
-
-    pthread_mutex_unlock(&lock);
-}
-
-// Add a new subscription for a subscriber
-void add_subscription(int sock, const char *topic_name) {
-    pthread_mutex_lock(&lock);
-
-    int topic_found = 0;
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].topic, topic_name) == 0) {
-            topic_found = 1;
-
-            // Check if the subscriber is already added
-            int already_subscribed = 0;
-            for (int j = 0; j < topics[i].sub_count; j++) {
-                if (topics[i].subscribers[j] == sock) {
-                    already_subscribed = 1;
-                    break;
-                }
-            }
-
-            if (!already_subscribed) {
-                topics[i].subscribers[topics[i].sub_count++] = sock;
-            }
-            break;
-        }
-    }
-
-    // If topic not found, create it
-    if (!topic_found && topic_count < MAX_TOPICS) {
-        strcpy(topics[topic_count].topic, topic_name);
-        topics[topic_count].subscribers[0] = sock;
-        topics[topic_count].sub_count = 1;
-        topic_count++;
-    }
-
-    pthread_mutex_unlock(&lock);
-}
-
-// Function to handle client communication
-void *handle_client(void *client_sock) {
-    int sock = *(int *)client_sock;
-    free(client_sock);
-
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-
-    while (1) {
-        int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            printf("Subscriber disconnected (socket: %d)\n", sock);
-            remove_subscriber(sock);
-            close(sock);
-            pthread_exit(NULL);
-        }
-
-        char *command = strtok(buffer, " ");
-        if (strcmp(command, "PUBLISH") == 0) {
-            char *topic_name = strtok(NULL, " ");
-            char *message = strtok(NULL, "\n");
-
-            pthread_mutex_lock(&lock);
-
-            // Match topic and deliver message only to its subscribers
-            for (int i = 0; i < topic_count; i++) {
-                if (strcmp(topics[i].topic, topic_name) == 0) {
-                    for (int j = 0; j < topics[i].sub_count; j++) {
-                        int sub_sock = topics[i].subscribers[j];
-                        send(sub_sock, message, strlen(message), 0);
-                    }
-                    break;
-                }
-            }
-
-            pthread_mutex_unlock(&lock);
-        } else if (strcmp(command, "SUBSCRIBE") == 0) {
-            char *topic_name = strtok(NULL, "\n");
-            add_subscription(sock, topic_name);
-        }
-
-        memset(buffer, 0, BUFFER_SIZE);
-    }
-
-    close(sock);
-    pthread_exit(NULL);
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    int port = atoi(argv[1]);
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
-    }
-
-    if (listen(server_fd, 3) < 0) {
-        perror("listen failed");
-        exit(EXIT_FAILURE);
-    }
-
-    pthread_mutex_init(&lock, NULL);
-
-    printf("Broker is running on port %d...\n", port);
-
-    while (1) {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0) {
-            perror("accept failed");
-            exit(EXIT_FAILURE);
-        }
-
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = new_socket;
-
-        pthread_t tid;
-        pthread_create(&tid, NULL, handle_client, client_sock);
-        pthread_detach(tid);
-    }
-
-    pthread_mutex_destroy(&lock);
-    close(server_fd);
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "protocol.h"
+#include "outq.h"
+#include "topic_table.h"
+#include "topic_trie.h"
+
+#define DEFAULT_QUEUE_LEN 1024
+#define DEFAULT_QUEUE_MB 64
+
+// A connected client. Its thread is the only writer of sock; publishers
+// enqueue frames and poke wake_fd. Topics holding it take a reference.
+typedef struct {
+    int sock;
+    int wake_fd;
+    OutQueue outq;
+    TopicEntry **subscriptions;  // topics this client is subscribed to (under lock)
+    size_t sub_count;
+    size_t sub_cap;
+    int refcount;
+    int close_requested;
+    unsigned long last_publish;  // the last publish queued for it (under lock)
+} Client;
+
+TopicTable topic_table;    // topics and wildcard patterns alike
+TopicTrie pattern_trie;    // pattern -> its entry in topic_table
+TrieMatches pattern_matches;
+unsigned long publish_count = 0;
+
+pthread_mutex_t lock;
+size_t queue_len = DEFAULT_QUEUE_LEN;
+size_t queue_bytes = (size_t)DEFAULT_QUEUE_MB * 1024 * 1024;  // 0 for no limit
+OverflowPolicy overflow_policy = OVERFLOW_DROP_OLDEST;
+
+void client_retain(Client *client) {
+    __atomic_add_fetch(&client->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void client_release(Client *client) {
+    if (__atomic_sub_fetch(&client->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        outq_destroy(&client->outq);
+        close(client->wake_fd);
+        free(client);
+    }
+}
+
+void wake_client(Client *client) {
+    uint64_t one = 1;
+    if (write(client->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("[ERROR] eventfd write failed");
+    }
+}
+
+// Remove a subscriber from all topics
+void remove_subscriber(Client *client) {
+    pthread_mutex_lock(&lock);
+
+    for (size_t i = 0; i < client->sub_count; i++) {
+        TopicEntry *entry = client->subscriptions[i];
+        if (topic_remove_subscriber(entry, client)) {
+            client_release(client);
+        }
+        if (entry->sub_count == 0) {
+            topic_trie_remove(&pattern_trie, entry->name, entry->name_len);
+            topic_table_remove(&topic_table, entry);
+        }
+    }
+    free(client->subscriptions);
+    client->subscriptions = NULL;
+    client->sub_count = 0;
+    client->sub_cap = 0;
+
+    pthread_mutex_unlock(&lock);
+}
+
+// Make room for one more entry in a client's subscription list
+int reserve_subscription_slot(Client *client) {
+    if (client->sub_count < client->sub_cap) return 0;
+
+    size_t cap = client->sub_cap ? client->sub_cap * 2 : 4;
+    TopicEntry **subs = realloc(client->subscriptions, cap * sizeof(TopicEntry *));
+    if (!subs) return -1;
+    client->subscriptions = subs;
+    client->sub_cap = cap;
+    return 0;
+}
+
+// Add a new subscription for a subscriber, to a topic or a wildcard pattern
+void add_subscription(Client *client, const char *topic_name, size_t topic_len) {
+    int pattern = topic_is_pattern(topic_name, topic_len);
+    if (pattern && !topic_pattern_valid(topic_name, topic_len)) {
+        fprintf(stderr, "[ERROR] Invalid topic pattern '%s'\n", topic_name);
+        return;
+    }
+
+    uint64_t hash = topic_hash(topic_name, topic_len);
+    pthread_mutex_lock(&lock);
+
+    // Find the topic or create it
+    TopicEntry *entry = topic_table_get_or_create(&topic_table, topic_name, topic_len, hash);
+    if (!entry) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    // Check if the subscriber is already added
+    for (size_t i = 0; i < client->sub_count; i++) {
+        if (client->subscriptions[i] == entry) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+    }
+
+    // A new pattern goes into the trie as well
+    if (reserve_subscription_slot(client) < 0 ||
+        (pattern && entry->sub_count == 0 && topic_trie_insert(&pattern_trie, topic_name, topic_len, entry) < 0) ||
+        topic_add_subscriber(entry, client) < 0) {
+        fprintf(stderr, "[ERROR] Out of memory subscribing to topic '%s'\n", topic_name);
+        if (entry->sub_count == 0) {
+            topic_trie_remove(&pattern_trie, topic_name, topic_len);
+            topic_table_remove(&topic_table, entry);
+        }
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    client->subscriptions[client->sub_count++] = entry;
+    client_retain(client);
+    pthread_mutex_unlock(&lock);
+}
+
+// Queue a frame for a client, once per publish however many of its
+// subscriptions match. Caller holds lock.
+void queue_for_client(Client *sub, MessageBuffer *frame) {
+    if (sub->last_publish == publish_count) return;
+    sub->last_publish = publish_count;
+
+    int rc = outq_push_buffer(&sub->outq, frame);
+    if (rc < 0) {
+        sub->close_requested = 1;
+        wake_client(sub);
+    } else if (rc > 0) {
+        wake_client(sub);
+    }
+}
+
+// Queue a message for every subscriber of a topic, and of every pattern
+// matching it, without touching their sockets. They all share one copy.
+void publish_message(const char *topic_name, size_t topic_len, const char *payload, size_t payload_len) {
+    if (topic_is_pattern(topic_name, topic_len)) {
+        fprintf(stderr, "[ERROR] Cannot publish to a topic pattern '%s'\n", topic_name);
+        return;
+    }
+
+    uint64_t hash = topic_hash(topic_name, topic_len);
+    MessageBuffer *frame = msgbuf_alloc(frame_size(topic_len, payload_len));
+    if (!frame) return;
+    encode_frame(frame->data, frame->len, OP_MESSAGE, 0, topic_name, payload, payload_len);
+
+    pthread_mutex_lock(&lock);
+    publish_count++;
+
+    // Match topic and deliver message only to its subscribers
+    TopicEntry *entry = topic_table_find(&topic_table, topic_name, topic_len, hash);
+    if (entry) {
+        for (size_t i = 0; i < entry->sub_count; i++) {
+            queue_for_client(entry->subscribers[i], frame);
+        }
+    }
+    size_t count;
+    void *const *patterns = topic_trie_match(&pattern_trie, topic_name, topic_len, &pattern_matches, &count);
+    for (size_t i = 0; i < count; i++) {
+        TopicEntry *matched = patterns[i];
+        for (size_t j = 0; j < matched->sub_count; j++) {
+            queue_for_client(matched->subscribers[j], frame);
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+    msgbuf_release(frame);
+}
+
+// Read whatever is available and execute complete frames.
+// Returns -1 when the connection should be closed.
+int read_frames(Client *client, FrameDecoder *decoder) {
+    while (1) {
+        size_t avail;
+        char *space = frame_decoder_space(decoder, &avail);
+        if (!space) return -1;
+
+        ssize_t bytes_received = recv(client->sock, space, avail, MSG_DONTWAIT);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (bytes_received == 0) return -1;
+        frame_decoder_commit(decoder, bytes_received);
+
+        Frame frame;
+        int rc;
+        while ((rc = decode_frame(decoder, &frame)) == 1) {
+            if (frame.opcode == OP_PUBLISH) {
+                publish_message(frame.topic, frame.topic_len, frame.payload, frame.payload_len);
+            } else if (frame.opcode == OP_SUBSCRIBE) {
+                add_subscription(client, frame.topic, frame.topic_len);
+            }
+        }
+        if (rc < 0) {
+            fprintf(stderr, "[ERROR] Protocol error (socket: %d)\n", client->sock);
+            return -1;
+        }
+    }
+}
+
+// Function to handle client communication: one thread per client reads
+// commands and drains the client's outbound queue when the socket is writable
+void *handle_client(void *arg) {
+    Client *client = arg;
+
+    FrameDecoder decoder;
+    frame_decoder_init(&decoder);
+    int want_write = 0;
+
+    while (1) {
+        struct pollfd pfds[2] = {
+            { client->sock, POLLIN | (want_write ? POLLOUT : 0), 0 },
+            { client->wake_fd, POLLIN, 0 },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            while (read(client->wake_fd, &count, sizeof(count)) > 0);
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (read_frames(client, &decoder) < 0) break;
+        }
+        if (client->close_requested) {
+            fprintf(stderr, "[ERROR] Outbound queue overflow (socket: %d), disconnecting\n", client->sock);
+            break;
+        }
+
+        int rc = outq_flush(&client->outq, client->sock);
+        if (rc < 0) break;
+        want_write = rc == 0;
+    }
+
+    printf("Subscriber disconnected (socket: %d)\n", client->sock);
+    remove_subscriber(client);
+    outq_close(&client->outq);
+    frame_decoder_free(&decoder);
+    close(client->sock);
+    client_release(client);
+    return NULL;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-q queue_len] [-Q queue_mb] [-o drop-oldest|drop-newest|disconnect] <port>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "q:Q:o:")) != -1) {
+        if (opt == 'q') {
+            queue_len = strtoul(optarg, NULL, 10);
+        } else if (opt == 'Q') {
+            queue_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+        } else if (opt == 'o') {
+            if (parse_overflow_policy(optarg, &overflow_policy) < 0) exit(EXIT_FAILURE);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1 || queue_len < 1) {
+        usage(argv[0]);
+    }
+
+    int port = atoi(argv[optind]);
+    int server_fd, new_socket;
+    struct sockaddr_in address;
+    int addrlen = sizeof(address);
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(server_fd, 3) < 0) {
+        perror("listen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    if (topic_table_init(&topic_table) < 0 || topic_trie_init(&pattern_trie) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Broker is running on port %d...\n", port);
+
+    while (1) {
+        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0) {
+            perror("accept failed");
+            exit(EXIT_FAILURE);
+        }
+
+        Client *client = calloc(1, sizeof(Client));
+        if (!client || outq_init(&client->outq, queue_len, queue_bytes, overflow_policy) < 0) {
+            fprintf(stderr, "[ERROR] Out of memory accepting client.\n");
+            free(client);
+            close(new_socket);
+            continue;
+        }
+        client->sock = new_socket;
+        client->refcount = 1;
+        client->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (client->wake_fd < 0) {
+            perror("eventfd failed");
+            outq_destroy(&client->outq);
+            free(client);
+            close(new_socket);
+            continue;
+        }
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, handle_client, client);
+        pthread_detach(tid);
+    }
+
+    pthread_mutex_destroy(&lock);
+    close(server_fd);
+    return 0;
+}
@@ -1,274 +1,3250 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-#include <netdb.h>
-
-#define BUFFER_SIZE 1024
-#define MAX_TOPICS 10
-#define MAX_SUBSCRIBERS 10
-#define MAX_BROKERS 5
-
-typedef struct {
-    char topic[50];
-    int subscribers[MAX_SUBSCRIBERS];
-    int sub_count;
-} Topic;
-
-typedef struct {
-    char ip[50];
-    int port;
-} Broker;
-
-Topic topics[MAX_TOPICS];
-int topic_count = 0;
-Broker brokers[MAX_BROKERS];
-int broker_count = 0;
-int my_broker_id = 0; // Unique ID for this broker
-pthread_mutex_t lock;
-
-// Function to calculate the responsible broker for a topic
-int get_broker_for_topic(const char *topic_name) {
-    unsigned long hash = 0;
-    for (int i = 0; topic_name[i] != '\0'; i++) {
-        hash = (hash * 31 + topic_name[i]) % broker_count;
-    }
-    return hash % broker_count;
-}
-
-// Add a new broker to the list
-void add_broker(const char *ip, int port) {
-    if (broker_count >= MAX_BROKERS) {
-        fprintf(stderr, "[ERROR] Maximum number of brokers reached.\n");
-        return;
-    }
-    strncpy(brokers[broker_count].ip, ip, sizeof(brokers[broker_count].ip) - 1);
-    brokers[broker_count].port = port;
-    printf("[DEBUG] Broker added: %s:%d\n", ip, port);
-    broker_count++;
-}
-
-// Forward a message to another broker
-void forward_message_to_broker(const char *ip, int port, const char *message) {
-    int sock;
-    struct sockaddr_in broker_address;
-
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return;
-    }
-
-    broker_address.sin_family = AF_INET;
-    broker_address.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip, &broker_address.sin_addr) <= 0) {
-        perror("Invalid broker IP address");
-        close(sock);
-        return;
-    }
-
-    if (connect(sock, (struct sockaddr *)&broker_address, sizeof(broker_address)) < 0) {
-        perror("Connection to broker failed");
-        close(sock);
-        return;
-    }
-
-    send(sock, message, strlen(message), 0);
-    close(sock);
-}
-
-// Handle client connections
-void *handle_client(void *client_sock) {
-    int sock = *(int *)client_sock;
-    free(client_sock);
-
-    printf("[DEBUG] Handling client connection on socket %d...\n", sock);
-
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-
-    while (1) {
-        int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
-
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                printf("[DEBUG] Client disconnected (socket %d).\n", sock);
-            } else {
-                perror("[ERROR] recv failed");
-            }
-            close(sock);
-            pthread_exit(NULL);
-        }
-
-        buffer[bytes_received] = '\0';
-        printf("[DEBUG] Received: %s\n", buffer);
-
-        char *command = strtok(buffer, " ");
-        if (!command) {
-            fprintf(stderr, "[ERROR] Invalid command received.\n");
-            continue;
-        }
-
-        if (strcmp(command, "PUBLISH") == 0) {
-            char *topic_name = strtok(NULL, " ");
-            char *message = strtok(NULL, "\n");
-
-            if (!topic_name || !message) {
-                fprintf(stderr, "[ERROR] Invalid PUBLISH format.\n");
-                continue;
-            }
-
-            int broker_id = get_broker_for_topic(topic_name);
-            if (broker_id != my_broker_id) {
-                char forward_msg[BUFFER_SIZE];
-                snprintf(forward_msg, BUFFER_SIZE, "FORWARD PUBLISH %s %s", topic_name, message);
-                forward_message_to_broker(brokers[broker_id].ip, brokers[broker_id].port, forward_msg);
-            } else {
-                pthread_mutex_lock(&lock);
-                for (int i = 0; i < topic_count; i++) {
-                    if (strcmp(topics[i].topic, topic_name) == 0) {
-                        for (int j = 0; j < topics[i].sub_count; j++) {
-                            send(topics[i].subscribers[j], message, strlen(message), 0);
-                        }
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&lock);
-            }
-
-        } else if (strcmp(command, "SUBSCRIBE") == 0) {
-            char *topic_name = strtok(NULL, "\n");
-            if (!topic_name) {
-                fprintf(stderr, "[ERROR] Invalid SUBSCRIBE format.\n");
-                continue;
-            }
-
-            int broker_id = get_broker_for_topic(topic_name);
-            if (broker_id != my_broker_id) {
-                char forward_msg[BUFFER_SIZE];
-                snprintf(forward_msg, BUFFER_SIZE, "FORWARD SUBSCRIBE %s", topic_name);
-                forward_message_to_broker(brokers[broker_id].ip, brokers[broker_id].port, forward_msg);
-            } else {
-                pthread_mutex_lock(&lock);
-                int topic_found = 0;
-                for (int i = 0; i < topic_count; i++) {
-                    if (strcmp(topics[i].topic, topic_name) == 0) {
-                        topics[i].subscribers[topics[i].sub_count++] = sock;
-                        topic_found = 1;
-                        break;
-                    }
-                }
-                if (!topic_found && topic_count < MAX_TOPICS) {
-                    strncpy(topics[topic_count].topic, topic_name, sizeof(topics[topic_count].topic) - 1);
-                    topics[topic_count].subscribers[0] = sock;
-                    topics[topic_count].sub_count = 1;
-                    topic_count++;
-                }
-                pthread_mutex_unlock(&lock);
-            }
-
-        } else if (strcmp(command, "FORWARD") == 0) {
-            char *forward_type = strtok(NULL, " ");
-            if (strcmp(forward_type, "PUBLISH") == 0) {
-                char *topic_name = strtok(NULL, " ");
-                char *message = strtok(NULL, "\n");
-
-                if (!topic_name || !message) {
-                    fprintf(stderr, "[ERROR] Invalid FORWARD PUBLISH format.\n");
-                    continue;
-                }
-
-                int broker_id = get_broker_for_topic(topic_name);
-                if (broker_id == my_broker_id) {
-                    pthread_mutex_lock(&lock);
-                    for (int i = 0; i < topic_count; i++) {
-                        if (strcmp(topics[i].topic, topic_name) == 0) {
-                            for (int j = 0; j < topics[i].sub_count; j++) {
-                                send(topics[i].subscribers[j], message, strlen(message), 0);
-                            }
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&lock);
-                }
-
-            } else if (strcmp(forward_type, "SUBSCRIBE") == 0) {
-                char *topic_name = strtok(NULL, "\n");
-
-                if (!topic_name) {
-                    fprintf(stderr, "[ERROR] Invalid FORWARD SUBSCRIBE format.\n");
-                    continue;
-                }
-
-                int broker_id = get_broker_for_topic(topic_name);
-                if (broker_id == my_broker_id) {
-                    pthread_mutex_lock(&lock);
-                    int topic_found = 0;
-                    for (int i = 0; i < topic_count; i++) {
-                        if (strcmp(topics[i].topic, topic_name) == 0) {
-                            topics[i].subscribers[topics[i].sub_count++] = sock;
-                            topic_found = 1;
-                            break;
-                        }
-                    }
-                    if (!topic_found && topic_count < MAX_TOPICS) {
-                        strncpy(topics[topic_count].topic, topic_name, sizeof(topics[topic_count].topic) - 1);
-                        topics[topic_count].subscribers[0] = sock;
-                        topics[topic_count].sub_count = 1;
-                        topic_count++;
-                    }
-                    pthread_mutex_unlock(&lock);
-                }
-            }
-
-        } else {
-            fprintf(stderr, "[ERROR] Unknown command: %s\n", command);
-        }
-    }
-
-    close(sock);
-    pthread_exit(NULL);
-}
-
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <port> <peer_ip:peer_port>...\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    int port = atoi(argv[1]);
-    for (int i = 2; i < argc; i++) {
-        char *colon = strchr(argv[i], ':');
-        if (colon) {
-            *colon = '\0';
-            add_broker(argv[i], atoi(colon + 1));
-        }
-    }
-
-    printf("[DEBUG] Broker running on port %d...\n", port);
-
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    bind(server_fd, (struct sockaddr *)&address, sizeof(address));
-    listen(server_fd, 3);
-
-    pthread_mutex_init(&lock, NULL);
-
-    while (1) {
-        int new_socket = accept(server_fd, NULL, NULL);
-        pthread_t thread;
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = new_socket;
-        pthread_create(&thread, NULL, handle_client, client_sock);
-        pthread_detach(thread);
-    }
-
-    pthread_mutex_destroy(&lock);
-    close(server_fd);
-    return 0;
-}
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "hashring.h"
+#include "outq.h"
+#include "slab.h"
+#include "topic_table.h"
+#include "topic_trie.h"
+#include "msglog.h"
+#include "partition.h"
+#include "uring.h"
+
+#define MAX_BROKERS 64
+#define MAX_EVENTS 256
+#define MAX_REACTORS 64
+#define DEFAULT_QUEUE_LEN 1024
+#define DEFAULT_QUEUE_MB 64
+#define TOPIC_STRIPES 64
+#define PEER_QUEUE_LEN 65536
+#define PEER_BACKOFF_MIN_MS 100
+#define PEER_BACKOFF_MAX_MS 5000
+#define HEARTBEAT_MS 1000
+#define FAILURE_TIMEOUT_MS 3000   // silence before a broker is dropped from the ring
+#define REBALANCE_DRAIN_MS 2000   // how long a topic's previous owner stays subscribed
+#define LEAVE_GRACE_MS 1000       // how long a leaving broker keeps relaying
+#define MEMBERSHIP_TICK_MS 250
+#define BROKER_KEY_LEN 64
+#define DEFAULT_HISTORY_MB 0        // in-memory history per topic without -d; off unless asked for
+#define CATCHUP_CHUNK_BYTES (256 * 1024)  // history queued per read
+#define CATCHUP_CHUNKS_PER_TURN 4   // before other connections get a turn
+#define MAX_GROUP_SHARES 1024       // members another broker may claim in one group
+#define DEFAULT_ACK_WINDOW 256      // unacknowledged messages per subscriber, unless it asks otherwise
+#define MAX_ACK_WINDOW 65536
+#define DEFAULT_REDELIVERY_MS 1000
+#define REDELIVERY_TICK_MS 100
+#define MAX_WRITE_IOV 64
+#define DEFAULT_LOW_WATER_PCT 50    // of the high watermark, unless -W gives one
+#define THROTTLE_TICK_MS 10         // how often held-back publishers are checked
+#define THROTTLE_HOLD_MS 100        // how long another broker's THROTTLE holds a topic back
+#define THROTTLE_REMIND_MS 50       // how often we repeat ours
+#define THROTTLE_SLOTS 4096
+#define READ_BUDGET_BYTES (64 * 1024)  // per connection and turn, so a busy publisher cannot starve the rest
+#define DEFAULT_ZEROCOPY_KB 64      // frames at least this big are sent with MSG_ZEROCOPY
+#define URING_ENTRIES 1024          // submission slots per reactor with -b io_uring
+#define URING_BUFFERS 256           // provided receive buffers per reactor
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_SEND_IOV 256          // frames per send
+#define DEFAULT_BATCH_KB 64         // a lingering queue this full is written without waiting
+#define MAX_LINGER_US 1000000
+#define MAX_LINGER_TOPICS 64
+
+// io_uring request tags: the connection pointer, what the request does in
+// the low bits and the connection's io_gen in the top ones
+enum { IO_ACCEPT = 1, IO_WAKE, IO_RECV, IO_SEND, IO_POLL };
+#define IO_OP_MASK 0xfULL
+#define IO_GEN_SHIFT 48
+#define IO_PTR_MASK (((1ULL << IO_GEN_SHIFT) - 1) & ~IO_OP_MASK)
+
+typedef struct Connection Connection;
+typedef struct PeerLink PeerLink;
+typedef struct CatchUp CatchUp;
+typedef struct FlowState FlowState;
+typedef struct Throttle Throttle;
+typedef struct UringSend UringSend;
+
+// One membership of a connection in a topic's consumer group
+typedef struct {
+    TopicEntry *entry;
+    ConsumerGroup *group;
+} GroupMembership;
+
+// One lock stripe of the topic registry. Publishes only take the read lock,
+// so publishers on different topics (or the same topic) run in parallel.
+typedef struct {
+    pthread_rwlock_t lock;
+    TopicTable table;
+} TopicStripe;
+
+// A topic whose deliveries linger for longer or shorter than -L says
+typedef struct {
+    char name[MAX_TOPIC_LEN + 1];
+    size_t len;
+    long long linger_us;
+} LingerTopic;
+
+typedef struct {
+    char ip[50];
+    int port;
+    char key[BROKER_KEY_LEN];  // "ip:port", the broker's name on the ring
+    int alive;                 // placed on the ring (membership_lock)
+    long long last_heard_ms;   // last heartbeat received (membership_lock)
+} Broker;
+
+// One edge-triggered epoll loop, or io_uring loop, with its own
+// SO_REUSEPORT listen socket. Other threads hand it connections to flush
+// through the pending list.
+typedef struct {
+    int id;
+    int epoll_fd;
+    Uring *ring;  // the io_uring backend, or NULL for epoll
+    int listen_fd;
+    int event_fd;
+    pthread_mutex_t pending_lock;
+    Connection *pending;
+    Connection *metered;  // connections with acknowledgements or credit (owning reactor only)
+    Connection *paused;   // publishers held back (owning reactor only)
+    Throttle *throttles;  // brokers asked to hold topics back (owning reactor only)
+    Connection *unread;   // connections with more to read after their turn (owning reactor only)
+    Connection *lingering;  // connections waiting for more deliveries to batch (owning reactor only)
+    pthread_t thread;
+} Reactor;
+
+// Per-connection state owned by one reactor thread. The owning reactor,
+// each topic subscription and a pending flush each hold a reference.
+struct Connection {
+    int fd;
+    Reactor *reactor;
+    FrameDecoder decoder;
+    OutQueue outq;
+    TopicEntry **subscriptions;  // topics this connection joined (owning reactor only)
+    size_t sub_count;
+    size_t sub_cap;
+    int refcount;
+    int closed;
+    int flush_scheduled;
+    int close_requested;
+    Connection *next_pending;
+    PeerLink *peer;  // set on outbound links to other brokers
+    int from_broker; // set on inbound links from other brokers
+    CatchUp *catchups;  // topics whose history is being replayed, in order (owning reactor only)
+    GroupMembership *groups;  // consumer groups joined (owning reactor only)
+    size_t group_count;
+    size_t group_cap;
+    TopicEntry **patterns;  // wildcard subscriptions (owning reactor only)
+    size_t pattern_count;
+    size_t pattern_cap;
+    unsigned long long last_delivery;  // the last publish queued for it, with patterns around
+    FlowState *flow;  // set once the client asked for acknowledgements or credit (owning reactor only)
+    // Backpressure (owning reactor only). A paused publisher is not read from
+    // until the queue it filled drains, or the topic it hit is released.
+    int paused;
+    Connection *blocker;  // the congested queue's connection, or NULL for a throttled topic
+    uint64_t paused_hash;
+    Connection *next_paused;
+    int read_deferred;  // on the reactor's unread list
+    Connection *next_unread;
+    // Batching. Deliveries may wait in the outq for others to join them,
+    // until flush_by_us at the latest (0 when none is waiting); any thread
+    // brings it forward, the owning reactor clears it when it writes.
+    long long flush_by_us;
+    int lingering;  // on the reactor's lingering list
+    Connection *next_lingering;
+    // io_uring backend (owning reactor only). Every request in flight holds
+    // a reference; io_gen changes when the socket goes, so completions
+    // for an old socket are told apart.
+    UringSend *send;
+    unsigned io_gen;
+    int recv_armed;
+    int recv_cancelled;
+    int poll_armed;
+    int hung_up;  // the client closed while held back, with data left to read
+};
+
+// A subscription replaying a topic's history. It joins the topic's live
+// subscribers once it reaches the end of the log.
+struct CatchUp {
+    CatchUp *next;
+    TopicLog *log;
+    uint64_t hash;
+    unsigned long long offset;  // next record to send
+    size_t topic_len;
+    char topic[MAX_TOPIC_LEN + 1];
+};
+
+// Delivery paced by the subscriber. Frames move from the outq into the
+// in-flight list only while the ack window and the credit allow, and the
+// rest wait on the outq. With acknowledgements, frames are numbered on the
+// way and stay in flight until acknowledged; when the oldest has waited
+// too long, everything in flight is written again. Without, they leave the
+// list once written.
+struct FlowState {
+    MessageBuffer **frames;  // in flight, oldest first, from frames[start]
+    size_t start;
+    size_t count;
+    size_t cap;
+    size_t sent;         // frames written since the last (re)delivery began
+    size_t sent_offset;  // bytes of the next one written
+    int acked;           // acknowledged delivery
+    int ack_pending;     // asked for, once the unnumbered frames in flight are written
+    unsigned long long first_seq;  // of frames[start]
+    size_t window;
+    long long resend_at_ms;
+    long long credit_messages;  // each only enforced once some were granted
+    long long credit_bytes;
+    int messages_granted;
+    int bytes_granted;
+    int blocked;       // the last write found the socket full
+    Connection *next;  // in the reactor's metered list
+};
+
+// Frames taken off a connection's outq for one io_uring send, referenced
+// until the kernel has written them
+struct UringSend {
+    MessageBuffer *frames[URING_SEND_IOV];
+    size_t count;
+    size_t offset;  // bytes of frames[0] already written
+    struct iovec iov[URING_SEND_IOV];
+    struct msghdr msg;
+    int in_flight;
+};
+
+// A topic another broker was asked to hold back, reminded before its hold
+// runs out until what held it back clears, then released with a RESUME
+struct Throttle {
+    Throttle *next;
+    Connection *conn;     // the broker's link, with a reference
+    Connection *blocker;  // the congested queue's connection, or NULL for a throttled topic
+    uint64_t hash;
+    long long remind_at_ms;
+    char topic[MAX_TOPIC_LEN + 1];
+};
+
+// Persistent outbound link to another broker. Frames forwarded from any
+// reactor queue up on conn->outq and are written in batches by the owning
+// reactor; while the link is down they wait there until a reconnect.
+struct PeerLink {
+    int broker_id;
+    Connection *conn;  // conn->fd is -1 while disconnected
+    int connected;
+    int backoff_ms;
+    long long retry_at_ms;
+    long long heartbeat_at_ms;
+};
+
+TopicStripe topic_stripes[TOPIC_STRIPES];
+Broker brokers[MAX_BROKERS];
+int broker_count = 0;  // only grows; written under membership_lock
+pthread_mutex_t membership_lock = PTHREAD_MUTEX_INITIALIZER;
+HashRing ring;                // live brokers only, guarded by ring_lock
+int ring_ids[MAX_BROKERS];    // ring node -> brokers[] index
+pthread_rwlock_t ring_lock;
+int vnodes = DEFAULT_VNODES;
+int my_broker_id = -1; // Our index in brokers[]; indexes are local to each node
+long long drain_deadline_ms = 0;  // retire previous topic owners after this (membership_lock)
+int leave_requested = 0;  // set from the signal handler
+int stats_requested = 0;  // likewise, by SIGUSR1
+long long leave_deadline_ms = 0;  // reactor 0 only
+PeerLink peer_links[MAX_BROKERS];
+Reactor reactors[MAX_REACTORS];
+int reactor_count = 1;
+size_t queue_len = DEFAULT_QUEUE_LEN;
+size_t queue_bytes = (size_t)DEFAULT_QUEUE_MB * 1024 * 1024;  // 0 for no limit
+OverflowPolicy overflow_policy = OVERFLOW_DROP_OLDEST;
+size_t ack_window = DEFAULT_ACK_WINDOW;        // -w, for subscribers that leave it to us
+long long redelivery_ms = DEFAULT_REDELIVERY_MS;  // -r
+int high_water_pct = 0;  // -W, queue fill that holds publishers back; 0 for never
+int low_water_pct = 0;
+size_t zerocopy_min = (size_t)DEFAULT_ZEROCOPY_KB * 1024;  // -Z, 0 for never
+int use_uring = 0;  // -b io_uring
+long long linger_us = 0;  // -L, how long deliveries may wait for others to share their write
+LingerTopic linger_topics[MAX_LINGER_TOPICS];  // -L topic=us
+int linger_topic_count = 0;
+size_t batch_bytes = (size_t)DEFAULT_BATCH_KB * 1024;  // -B
+int batching = 0;  // whether any topic lingers
+int verbose = 0;   // -V, log per-frame and per-connection events
+long long throttled_until_ms[THROTTLE_SLOTS];  // by topic hash, from other brokers' THROTTLEs
+MsgLog *message_log = NULL;  // history of owned topics, on disk with -d; NULL with -H 0
+PartitionMap partitioned_topics;  // -p, read-only once the reactors run
+__thread Reactor *current_reactor;
+__thread unsigned next_partition;  // round-robin for keyless publishes
+
+// Wildcard subscriptions. A publish on any topic may match one, so every
+// broker holds every pattern: for its own clients, and for each broker
+// whose clients hold it, which it serves like a remote interest.
+pthread_rwlock_t pattern_lock;
+TopicTable pattern_table;  // pattern -> subscribers (pattern_lock)
+TopicTrie pattern_trie;    // pattern -> its pattern_table entry (pattern_lock)
+int pattern_count = 0;     // patterns in the trie, read without the lock
+unsigned long long delivery_count = 0;
+__thread TrieMatches pattern_matches;
+__thread TrieCache pattern_cache;  // each reactor's matches, so publishes share pattern_lock
+__thread int watch_congestion;  // while delivering a publish, remember the first congested queue
+__thread Connection *congested_queue;
+
+// Place every live broker on the consistent-hash ring, keyed by "ip:port".
+// Caller holds membership_lock (or runs before the reactors start).
+int build_ring() {
+    const char *key_ptrs[MAX_BROKERS];
+    int ids[MAX_BROKERS];
+    int live = 0;
+    for (int i = 0; i < broker_count; i++) {
+        if (!brokers[i].alive) continue;
+        key_ptrs[live] = brokers[i].key;
+        ids[live++] = i;
+    }
+
+    HashRing next;
+    if (hashring_build(&next, key_ptrs, live, vnodes) < 0) {
+        fprintf(stderr, "[ERROR] Out of memory building the hash ring.\n");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&ring_lock);
+    hashring_free(&ring);
+    ring = next;
+    memcpy(ring_ids, ids, live * sizeof(int));
+    pthread_rwlock_unlock(&ring_lock);
+    return 0;
+}
+
+// Function to calculate the responsible broker for a topic
+int get_broker_for_topic(const char *topic_name) {
+    pthread_rwlock_rdlock(&ring_lock);
+    int node = hashring_lookup(&ring, topic_name, strlen(topic_name));
+    // An empty ring only happens while the last broker leaves
+    int broker_id = node < 0 ? my_broker_id : ring_ids[node];
+    pthread_rwlock_unlock(&ring_lock);
+    return broker_id;
+}
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Add a new broker to the list. Returns its index or -1 when full.
+// Caller holds membership_lock (or runs before the reactors start).
+int add_broker(const char *ip, int port) {
+    int id = broker_count;
+    if (id >= MAX_BROKERS) {
+        fprintf(stderr, "[ERROR] Maximum number of brokers reached.\n");
+        return -1;
+    }
+    Broker *broker = &brokers[id];
+    strncpy(broker->ip, ip, sizeof(broker->ip) - 1);
+    broker->port = port;
+    snprintf(broker->key, sizeof(broker->key), "%.49s:%d", ip, port);
+    broker->alive = 1;
+    broker->last_heard_ms = now_ms();
+    printf("[DEBUG] Broker added: %s:%d\n", ip, port);
+
+    // Reactors scan brokers[] without the lock, so publish the slot last
+    __atomic_store_n(&broker_count, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+// Look up a broker by its "ip:port" key; caller holds membership_lock
+int find_broker(const char *key, size_t len) {
+    for (int i = 0; i < broker_count; i++) {
+        if (strlen(brokers[i].key) == len && memcmp(brokers[i].key, key, len) == 0) return i;
+    }
+    return -1;
+}
+
+void connection_retain(Connection *conn) {
+    __atomic_add_fetch(&conn->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void connection_release(Connection *conn) {
+    if (__atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (conn->send) {
+            for (size_t i = 0; i < conn->send->count; i++) msgbuf_release(conn->send->frames[i]);
+            slab_free(conn->send);
+        }
+        outq_destroy(&conn->outq);
+        frame_decoder_free(&conn->decoder);
+        slab_free(conn);
+    }
+}
+
+// Interrupt a reactor's epoll_wait
+void wake_reactor(Reactor *reactor) {
+    uint64_t one = 1;
+    if (write(reactor->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("[ERROR] eventfd write failed");
+    }
+}
+
+// Hand a connection to its owning reactor to be flushed (or closed)
+void schedule_flush(Connection *conn) {
+    if (__atomic_exchange_n(&conn->flush_scheduled, 1, __ATOMIC_ACQ_REL)) return;
+
+    Reactor *reactor = conn->reactor;
+    connection_retain(conn);
+    pthread_mutex_lock(&reactor->pending_lock);
+    conn->next_pending = reactor->pending;
+    reactor->pending = conn;
+    pthread_mutex_unlock(&reactor->pending_lock);
+
+    // The owner drains its pending list after every loop iteration anyway
+    if (reactor != current_reactor) wake_reactor(reactor);
+}
+
+// Remember a congested queue the current publish landed on, so its
+// sender can be held back
+void note_congestion(Connection *conn) {
+    if (watch_congestion && !congested_queue && outq_congested(&conn->outq)) {
+        connection_retain(conn);
+        congested_queue = conn;
+    }
+}
+
+// The table uses the low hash bits for slots, so stripe on the high ones
+TopicStripe *stripe_for(uint64_t hash) {
+    return &topic_stripes[(hash >> 32) % TOPIC_STRIPES];
+}
+
+int init_topic_stripes() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // Keep a steady publish stream from starving subscribe/unsubscribe
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    for (int i = 0; i < TOPIC_STRIPES; i++) {
+        pthread_rwlock_init(&topic_stripes[i].lock, &attr);
+        if (topic_table_init(&topic_stripes[i].table) < 0) return -1;
+    }
+    // Rebuilt only on membership changes but read on every publish
+    pthread_rwlock_init(&ring_lock, &attr);
+    pthread_rwlock_init(&pattern_lock, &attr);
+    if (topic_table_init(&pattern_table) < 0 || topic_trie_init(&pattern_trie) < 0) return -1;
+
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+// Forward a frame to another broker over its persistent link
+void forward_frame_to_broker(int broker_id, uint8_t opcode, uint16_t flags, const char *topic_name,
+                             size_t topic_len, const char *payload, size_t payload_len) {
+    Connection *link = __atomic_load_n(&peer_links[broker_id].conn, __ATOMIC_ACQUIRE);
+    if (!link) return;
+    // Payloads may carry a group or key prefix on top of MAX_PAYLOAD_SIZE
+    if (topic_len > MAX_TOPIC_LEN || payload_len > max_payload(flags)) {
+        fprintf(stderr, "[ERROR] Frame too large to forward to broker %d (topic '%.*s').\n", broker_id,
+                (int)topic_len, topic_name);
+        return;
+    }
+
+    MessageBuffer *frame = msgbuf_alloc(frame_size(topic_len, payload_len));
+    if (!frame) {
+        fprintf(stderr, "[ERROR] Out of memory forwarding to broker %d.\n", broker_id);
+        return;
+    }
+    encode_frame_header(frame->data, opcode, flags | FLAG_FORWARDED, topic_len, payload_len);
+    memcpy(frame->data + FRAME_HEADER_SIZE, topic_name, topic_len);
+    if (payload_len) memcpy(frame->data + FRAME_HEADER_SIZE + topic_len, payload, payload_len);
+
+    if (outq_push_buffer(&link->outq, frame) > 0) {
+        schedule_flush(link);
+    }
+    note_congestion(link);
+    msgbuf_release(frame);
+}
+
+// Whether any subscriber of a topic is a client rather than another broker.
+// Caller holds the topic's stripe lock.
+int has_local_subscribers(TopicEntry *entry) {
+    for (size_t i = 0; i < entry->sub_count; i++) {
+        if (!((Connection *)entry->subscribers[i])->from_broker) return 1;
+    }
+    return 0;
+}
+
+// How many members of a group are clients rather than other brokers
+size_t local_members(ConsumerGroup *group) {
+    size_t count = 0;
+    for (size_t i = 0; i < group->member_count; i++) {
+        if (!((Connection *)group->members[i])->from_broker) count++;
+    }
+    return count;
+}
+
+// Whether any client subscribes to a topic or belongs to one of its groups.
+// Caller holds the topic's stripe lock.
+int has_local_interest(TopicEntry *entry) {
+    if (has_local_subscribers(entry)) return 1;
+    for (size_t i = 0; i < entry->group_count; i++) {
+        if (local_members(entry->groups[i]) > 0) return 1;
+    }
+    return 0;
+}
+
+// Tell the broker owning a topic how many of our clients are in one of its
+// groups; it hands us that many shares of the group's messages
+void forward_group_count(int broker_id, TopicEntry *entry, const char *group_name, size_t group_len,
+                         size_t count) {
+    char payload[1 + MAX_GROUP_LEN + 24];
+    payload[0] = (char)group_len;
+    memcpy(payload + 1, group_name, group_len);
+    size_t len = 1 + group_len + snprintf(payload + 1 + group_len, 24, "%zu", count);
+    forward_frame_to_broker(broker_id, OP_SUBSCRIBE, FLAG_GROUP, entry->name, entry->name_len, payload, len);
+}
+
+// Register everything our clients want from a topic with a broker that
+// relays it to us. Caller holds the topic's stripe lock.
+void register_interest(TopicEntry *entry, int broker_id) {
+    if (has_local_subscribers(entry)) {
+        forward_frame_to_broker(broker_id, OP_SUBSCRIBE, 0, entry->name, entry->name_len, NULL, 0);
+    }
+    for (size_t i = 0; i < entry->group_count; i++) {
+        ConsumerGroup *group = entry->groups[i];
+        size_t count = local_members(group);
+        if (count > 0) forward_group_count(broker_id, entry, group->name, group->name_len, count);
+    }
+}
+
+// Take all of it back. Caller holds the topic's stripe lock.
+void unregister_interest(TopicEntry *entry, int broker_id) {
+    forward_frame_to_broker(broker_id, OP_UNSUBSCRIBE, 0, entry->name, entry->name_len, NULL, 0);
+    for (size_t i = 0; i < entry->group_count; i++) {
+        forward_group_count(broker_id, entry, entry->groups[i]->name, entry->groups[i]->name_len, 0);
+    }
+}
+
+// Forget the brokers relaying a topic once no client needs it any more.
+// Caller holds the topic's stripe write lock.
+void release_holders(TopicEntry *entry) {
+    if (!has_local_interest(entry)) {
+        entry->remote_owner = -1;
+        entry->prev_owner = -1;
+    }
+}
+
+// Withdraw our subscription from whichever brokers relay a topic to us;
+// group memberships are withdrawn one by one as they end.
+// Caller holds the topic's stripe write lock.
+void withdraw_interest(TopicEntry *entry) {
+    if (entry->remote_owner >= 0) {
+        forward_frame_to_broker(entry->remote_owner, OP_UNSUBSCRIBE, 0, entry->name, entry->name_len, NULL, 0);
+    }
+    if (entry->prev_owner >= 0) {
+        forward_frame_to_broker(entry->prev_owner, OP_UNSUBSCRIBE, 0, entry->name, entry->name_len, NULL, 0);
+    }
+    release_holders(entry);
+}
+
+// Drop conn->subscriptions[index]. A topic owned by another broker keeps a
+// remote interest there only while it has local subscribers, so the last
+// one leaving withdraws it.
+void drop_subscription(Connection *conn, size_t index) {
+    TopicEntry *entry = conn->subscriptions[index];
+    TopicStripe *stripe = stripe_for(entry->hash);
+
+    pthread_rwlock_wrlock(&stripe->lock);
+    if (topic_remove_subscriber(entry, conn)) {
+        connection_release(conn);
+    }
+    if (!has_local_subscribers(entry)) {
+        withdraw_interest(entry);
+    }
+    if (!topic_in_use(entry)) {
+        topic_table_remove(&stripe->table, entry);
+    }
+    pthread_rwlock_unlock(&stripe->lock);
+
+    conn->subscriptions[index] = conn->subscriptions[--conn->sub_count];
+}
+
+// Drop conn->groups[index]. A client leaving updates its member count at
+// the brokers relaying the topic.
+void drop_membership(Connection *conn, size_t index) {
+    GroupMembership m = conn->groups[index];
+    conn->groups[index] = conn->groups[--conn->group_count];
+    TopicEntry *entry = m.entry;
+    TopicStripe *stripe = stripe_for(entry->hash);
+
+    pthread_rwlock_wrlock(&stripe->lock);
+    char name[MAX_GROUP_LEN + 1];
+    size_t len = m.group->name_len;
+    memcpy(name, m.group->name, len);
+    if (topic_leave_group(entry, m.group, conn)) {
+        connection_release(conn);
+    }
+    if (!conn->from_broker) {
+        ConsumerGroup *group = topic_find_group(entry, name, len);
+        size_t count = group ? local_members(group) : 0;
+        if (entry->remote_owner >= 0) forward_group_count(entry->remote_owner, entry, name, len, count);
+        if (entry->prev_owner >= 0) forward_group_count(entry->prev_owner, entry, name, len, count);
+        release_holders(entry);
+    }
+    if (!topic_in_use(entry)) {
+        topic_table_remove(&stripe->table, entry);
+    }
+    pthread_rwlock_unlock(&stripe->lock);
+}
+
+// Tell every other broker that our clients (no longer) hold a pattern.
+// Caller holds pattern_lock.
+void broadcast_pattern(uint8_t opcode, TopicEntry *entry) {
+    int count = __atomic_load_n(&broker_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (i != my_broker_id) forward_frame_to_broker(i, opcode, 0, entry->name, entry->name_len, NULL, 0);
+    }
+}
+
+// Drop conn->patterns[index], and the pattern with its last subscriber
+void drop_pattern(Connection *conn, size_t index) {
+    TopicEntry *entry = conn->patterns[index];
+    conn->patterns[index] = conn->patterns[--conn->pattern_count];
+
+    pthread_rwlock_wrlock(&pattern_lock);
+    if (topic_remove_subscriber(entry, conn)) {
+        connection_release(conn);
+    }
+    if (!conn->from_broker && !has_local_subscribers(entry)) {
+        broadcast_pattern(OP_UNSUBSCRIBE, entry);
+    }
+    if (entry->sub_count == 0) {
+        topic_trie_remove(&pattern_trie, entry->name, entry->name_len);
+        __atomic_store_n(&pattern_count, (int)pattern_trie.count, __ATOMIC_RELAXED);
+        topic_table_remove(&pattern_table, entry);
+    }
+    pthread_rwlock_unlock(&pattern_lock);
+}
+
+// Remove a subscriber from all topics and groups, dropping topics nobody
+// listens to
+void remove_subscriber(Connection *conn) {
+    while (conn->sub_count > 0) {
+        drop_subscription(conn, conn->sub_count - 1);
+    }
+    free(conn->subscriptions);
+    conn->subscriptions = NULL;
+    conn->sub_cap = 0;
+
+    while (conn->group_count > 0) {
+        drop_membership(conn, conn->group_count - 1);
+    }
+    free(conn->groups);
+    conn->groups = NULL;
+    conn->group_cap = 0;
+
+    while (conn->pattern_count > 0) {
+        drop_pattern(conn, conn->pattern_count - 1);
+    }
+    free(conn->patterns);
+    conn->patterns = NULL;
+    conn->pattern_cap = 0;
+}
+
+// Remove one subscription of a connection
+void remove_subscription(Connection *conn, const char *topic_name, size_t topic_len, uint64_t hash) {
+    for (size_t i = 0; i < conn->sub_count; i++) {
+        TopicEntry *entry = conn->subscriptions[i];
+        if (entry->hash == hash && entry->name_len == topic_len && memcmp(entry->name, topic_name, topic_len) == 0) {
+            drop_subscription(conn, i);
+            return;
+        }
+    }
+}
+
+// Queue a shared frame on a connection, which keeps its own reference;
+// its owning reactor writes it out
+void queue_buffer(Connection *conn, MessageBuffer *frame) {
+    int rc = outq_push_buffer(&conn->outq, frame);
+    if (rc < 0) {
+        conn->close_requested = 1;
+        schedule_flush(conn);
+    } else if (rc > 0) {
+        schedule_flush(conn);
+    }
+    note_congestion(conn);
+}
+
+// Queue a copy of a frame on a connection
+void queue_frame(Connection *conn, const char *frame, size_t len) {
+    MessageBuffer *copy = msgbuf_copy(frame, len);
+    if (!copy) {
+        fprintf(stderr, "[ERROR] Out of memory queueing on socket %d.\n", conn->fd);
+        return;
+    }
+    queue_buffer(conn, copy);
+    msgbuf_release(copy);
+}
+
+// Queue a message to be written by flush_by_us at the latest, so the
+// deliveries queued meanwhile share its write; 0 for as soon as the owner
+// can. Links to other brokers never wait.
+void queue_delivery(Connection *conn, MessageBuffer *frame, long long flush_by_us) {
+    if (flush_by_us == 0 || conn->peer || conn->from_broker) {
+        queue_buffer(conn, frame);
+        return;
+    }
+    int earlier = 0;
+    long long by = __atomic_load_n(&conn->flush_by_us, __ATOMIC_RELAXED);
+    while (by == 0 || flush_by_us < by) {
+        if (__atomic_compare_exchange_n(&conn->flush_by_us, &by, flush_by_us, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            earlier = 1;
+            break;
+        }
+    }
+    int rc = outq_push_buffer(&conn->outq, frame);
+    if (rc < 0) conn->close_requested = 1;
+    // The owner learns of the new deadline the same way as of new frames
+    if (rc != 0 || earlier) schedule_flush(conn);
+    note_congestion(conn);
+}
+
+// Queue a publish on a connection once, however many of its subscriptions
+// match it; delivery numbers the publish, 0 when only one can match.
+// Publishes delivered at the same time on other threads may still send it
+// a duplicate, never miss it.
+void queue_once(Connection *conn, MessageBuffer *frame, unsigned long long delivery, long long flush_by_us) {
+    if (delivery) {
+        if (__atomic_load_n(&conn->last_delivery, __ATOMIC_RELAXED) == delivery) return;
+        __atomic_store_n(&conn->last_delivery, delivery, __ATOMIC_RELAXED);
+    }
+    queue_delivery(conn, frame, flush_by_us);
+}
+
+// How long deliveries on a topic may linger; a partition goes by its topic
+long long topic_linger(const char *topic_name, size_t topic_len) {
+    for (int i = 0; i < linger_topic_count; i++) {
+        LingerTopic *t = &linger_topics[i];
+        if (topic_len >= t->len && memcmp(topic_name, t->name, t->len) == 0 &&
+            (topic_len == t->len || topic_name[t->len] == PARTITION_SEPARATOR)) {
+            return t->linger_us;
+        }
+    }
+    return linger_us;
+}
+
+// Parse -L: a linger for every topic, or "topic=us" for one
+int parse_linger(const char *spec) {
+    const char *eq = strrchr(spec, '=');
+    const char *value = eq ? eq + 1 : spec;
+    char *end;
+    long long us = strtoll(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || us < 0 || us > MAX_LINGER_US ||
+        (eq && (eq == spec || eq - spec > MAX_TOPIC_LEN || linger_topic_count == MAX_LINGER_TOPICS))) {
+        fprintf(stderr, "[ERROR] Invalid linger '%s' (us or topic=us, up to %d us, %d topics).\n", spec,
+                MAX_LINGER_US, MAX_LINGER_TOPICS);
+        return -1;
+    }
+    if (!eq) {
+        linger_us = us;
+        return 0;
+    }
+    LingerTopic *t = &linger_topics[linger_topic_count++];
+    t->len = eq - spec;
+    memcpy(t->name, spec, t->len);
+    t->name[t->len] = '\0';
+    t->linger_us = us;
+    return 0;
+}
+
+// Choose the member of a group that gets a message: the same one for
+// every message with the same key, round-robin for messages without one.
+// local_only skips members that are other brokers.
+Connection *pick_member(ConsumerGroup *group, const Payload *msg, int local_only) {
+    size_t n = group->member_count;
+    size_t start = msg->key ? topic_hash(msg->key, msg->key_len)
+                            : __atomic_fetch_add(&group->next, 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < n; i++) {
+        Connection *member = group->members[(start + i) % n];
+        if (!local_only || !member->from_broker) return member;
+    }
+    return NULL;
+}
+
+// Hand a group's message to the broker whose member was picked, which
+// passes it on to one of its clients in the group
+void relay_to_group(Connection *link, const char *topic_name, size_t topic_len, ConsumerGroup *group,
+                    const Payload *msg) {
+    Payload relay = *msg;
+    relay.group = group->name;
+    relay.group_len = group->name_len;
+    MessageBuffer *frame = msgbuf_alloc(payload_frame_size(topic_len, &relay));
+    if (!frame) {
+        fprintf(stderr, "[ERROR] Out of memory delivering to topic '%s'.\n", topic_name);
+        return;
+    }
+    encode_payload_frame(frame->data, frame->len, OP_MESSAGE, 0, topic_name, topic_len, &relay);
+    queue_buffer(link, frame);
+    msgbuf_release(frame);
+}
+
+// Queue a message for the subscribers of every pattern matching its topic.
+// Like a topic's owner, whoever delivers a publish serves the patterns
+// other brokers hold; a relayed message only reaches our own clients.
+void deliver_to_patterns(const char *topic_name, size_t topic_len, MessageBuffer *frame,
+                         int relayed_from, unsigned long long delivery, long long flush_by_us) {
+    pthread_rwlock_rdlock(&pattern_lock);
+    size_t count;
+    void *const *matches = topic_trie_match_cached(&pattern_trie, &pattern_cache, topic_name, topic_len,
+                                                   &pattern_matches, &count);
+
+    // The cached matches stay put until the trie changes under the write lock
+    for (size_t i = 0; i < count; i++) {
+        TopicEntry *entry = matches[i];
+        for (size_t j = 0; j < entry->sub_count; j++) {
+            Connection *sub = entry->subscribers[j];
+            if (relayed_from >= 0 && sub->from_broker) continue;
+            queue_once(sub, frame, delivery, flush_by_us);
+        }
+    }
+    pthread_rwlock_unlock(&pattern_lock);
+}
+
+// Queue a message for every local subscriber of a topic and one member of
+// each of its consumer groups. Sockets are only written by their owning
+// reactor, so a slow subscriber never blocks here.
+// relayed_from is -1 when we own the topic, so interests held by other
+// brokers are served too. Otherwise only local clients get the message:
+// relayed_from is then the broker that relayed it (taken only from brokers
+// we registered an interest with), or our own id for a last-resort delivery.
+// msg->offset is the message's place in the owner's history, or -1 if it
+// has none. msg->group is set when the owner relays a message for one of
+// our members of that group.
+// The message is encoded once, and every connection queues the same buffer.
+// With batching, it may wait there for the topic's linger.
+void deliver_to_subscribers(const char *topic_name, size_t topic_len, uint64_t hash, const Payload *msg,
+                            int relayed_from) {
+    Payload out;
+    payload_init(&out, msg->data, msg->len);
+    out.offset = msg->offset;
+    MessageBuffer *frame = msgbuf_alloc(payload_frame_size(topic_len, &out));
+    if (!frame) {
+        fprintf(stderr, "[ERROR] Out of memory delivering to topic '%s'.\n", topic_name);
+        return;
+    }
+    encode_payload_frame(frame->data, frame->len, OP_MESSAGE, 0, topic_name, topic_len, &out);
+
+    long long linger = batching ? topic_linger(topic_name, topic_len) : 0;
+    long long flush_by = linger > 0 ? now_us() + linger : 0;
+
+    // With patterns around, a connection may be reached more than once
+    unsigned long long delivery = 0;
+    if (!msg->group && __atomic_load_n(&pattern_count, __ATOMIC_RELAXED) > 0) {
+        delivery = __atomic_add_fetch(&delivery_count, 1, __ATOMIC_RELAXED);
+    }
+
+    TopicStripe *stripe = stripe_for(hash);
+    pthread_rwlock_rdlock(&stripe->lock);
+    TopicEntry *entry = topic_table_find(&stripe->table, topic_name, topic_len, hash);
+    if (entry && relayed_from >= 0 && relayed_from != my_broker_id &&
+        entry->remote_owner != relayed_from && entry->prev_owner != relayed_from) {
+        entry = NULL;
+    }
+    if (entry && msg->group) {
+        ConsumerGroup *group = topic_find_group(entry, msg->group, msg->group_len);
+        Connection *member = group ? pick_member(group, msg, 1) : NULL;
+        if (member) queue_delivery(member, frame, flush_by);
+    } else if (entry) {
+        for (size_t i = 0; i < entry->sub_count; i++) {
+            Connection *sub = entry->subscribers[i];
+            if (relayed_from >= 0 && sub->from_broker) continue;
+            // Already sent while it caught up on the history
+            if (msg->offset >= 0 && (unsigned long long)msg->offset < entry->sub_from[i]) continue;
+            queue_once(sub, frame, delivery, flush_by);
+        }
+        // Groups are served by the owner, which relays to members elsewhere
+        int serve_groups = relayed_from < 0 || relayed_from == my_broker_id;
+        for (size_t i = 0; serve_groups && i < entry->group_count; i++) {
+            ConsumerGroup *group = entry->groups[i];
+            Connection *member = pick_member(group, msg, relayed_from >= 0);
+            if (!member) continue;
+            if (member->from_broker) {
+                relay_to_group(member, topic_name, topic_len, group, msg);
+            } else {
+                queue_delivery(member, frame, flush_by);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&stripe->lock);
+
+    if (delivery) {
+        deliver_to_patterns(topic_name, topic_len, frame, relayed_from, delivery, flush_by);
+    }
+    msgbuf_release(frame);
+}
+
+// Make room for one more entry in a connection's subscription list
+int reserve_subscription_slot(Connection *conn) {
+    if (conn->sub_count < conn->sub_cap) return 0;
+
+    size_t cap = conn->sub_cap ? conn->sub_cap * 2 : 4;
+    TopicEntry **subs = realloc(conn->subscriptions, cap * sizeof(TopicEntry *));
+    if (!subs) return -1;
+    conn->subscriptions = subs;
+    conn->sub_cap = cap;
+    return 0;
+}
+
+// The broker our clients' interest in a topic is registered with, or -1
+// while we own it. Looks up the owner if there is none yet.
+// Caller holds the topic's stripe write lock.
+int interest_holder(TopicEntry *entry) {
+    if (entry->remote_owner < 0) {
+        int owner = get_broker_for_topic(entry->name);
+        if (owner != my_broker_id) {
+            entry->remote_owner = owner;
+            if (entry->prev_owner == owner) entry->prev_owner = -1;
+        }
+    }
+    return entry->remote_owner;
+}
+
+// Register a connection as a subscriber of a topic, receiving messages from
+// offset from on (0 for everything)
+void add_subscription(Connection *conn, const char *topic_name, size_t topic_len, uint64_t hash,
+                      unsigned long long from) {
+    TopicStripe *stripe = stripe_for(hash);
+    pthread_rwlock_wrlock(&stripe->lock);
+
+    TopicEntry *entry = topic_table_get_or_create(&stripe->table, topic_name, topic_len, hash);
+    if (!entry) {
+        fprintf(stderr, "[ERROR] Out of memory creating topic '%s'.\n", topic_name);
+        pthread_rwlock_unlock(&stripe->lock);
+        return;
+    }
+
+    for (size_t i = 0; i < conn->sub_count; i++) {
+        if (conn->subscriptions[i] == entry) {
+            pthread_rwlock_unlock(&stripe->lock);
+            return;
+        }
+    }
+
+    int first_local = !conn->from_broker && !has_local_subscribers(entry);
+    if (reserve_subscription_slot(conn) < 0 || topic_add_subscriber_from(entry, conn, from) < 0) {
+        fprintf(stderr, "[ERROR] Out of memory subscribing to topic '%s'.\n", topic_name);
+        if (!topic_in_use(entry)) topic_table_remove(&stripe->table, entry);
+        pthread_rwlock_unlock(&stripe->lock);
+        return;
+    }
+
+    // First local subscriber of a topic owned elsewhere: register our
+    // interest with the owner, which relays messages back over the link.
+    // Done under the stripe lock so it cannot overtake an UNSUBSCRIBE.
+    int holder = first_local ? interest_holder(entry) : -1;
+    if (holder >= 0) {
+        forward_frame_to_broker(holder, OP_SUBSCRIBE, 0, topic_name, topic_len, NULL, 0);
+    }
+
+    conn->subscriptions[conn->sub_count++] = entry;
+    connection_retain(conn);
+    pthread_rwlock_unlock(&stripe->lock);
+}
+
+// Make room for one more entry in a connection's group list
+int reserve_membership_slot(Connection *conn) {
+    if (conn->group_count < conn->group_cap) return 0;
+
+    size_t cap = conn->group_cap ? conn->group_cap * 2 : 4;
+    GroupMembership *groups = realloc(conn->groups, cap * sizeof(GroupMembership));
+    if (!groups) return -1;
+    conn->groups = groups;
+    conn->group_cap = cap;
+    return 0;
+}
+
+// Index of a connection's membership in a topic's group, or -1
+long find_membership(Connection *conn, const char *topic_name, size_t topic_len, const char *group_name,
+                     size_t group_len) {
+    for (size_t i = 0; i < conn->group_count; i++) {
+        TopicEntry *entry = conn->groups[i].entry;
+        ConsumerGroup *group = conn->groups[i].group;
+        if (entry->name_len == topic_len && memcmp(entry->name, topic_name, topic_len) == 0 &&
+            group->name_len == group_len && memcmp(group->name, group_name, group_len) == 0) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+// Add shares memberships of conn to a topic's group. A client joins with
+// one share; another broker claims one per member it has. Returns the
+// group or NULL on OOM.
+ConsumerGroup *join_group(Connection *conn, const char *topic_name, size_t topic_len, uint64_t hash,
+                          const char *group_name, size_t group_len, size_t shares) {
+    TopicStripe *stripe = stripe_for(hash);
+    pthread_rwlock_wrlock(&stripe->lock);
+
+    ConsumerGroup *group = NULL;
+    TopicEntry *entry = topic_table_get_or_create(&stripe->table, topic_name, topic_len, hash);
+    for (size_t i = 0; entry && i < shares; i++) {
+        if (reserve_membership_slot(conn) < 0 ||
+            !(group = topic_join_group(entry, group_name, group_len, conn))) {
+            group = NULL;
+            break;
+        }
+        conn->groups[conn->group_count++] = (GroupMembership){ entry, group };
+        connection_retain(conn);
+    }
+    if (!group) {
+        fprintf(stderr, "[ERROR] Out of memory joining group '%.*s' on topic '%s'.\n",
+                (int)group_len, group_name, topic_name);
+        if (entry && !topic_in_use(entry)) topic_table_remove(&stripe->table, entry);
+        pthread_rwlock_unlock(&stripe->lock);
+        return NULL;
+    }
+
+    // A client's group lives on the topic's owner: tell it how many
+    // members we have now
+    int holder = conn->from_broker ? -1 : interest_holder(entry);
+    if (holder >= 0) {
+        forward_group_count(holder, entry, group_name, group_len, local_members(group));
+    }
+    pthread_rwlock_unlock(&stripe->lock);
+    return group;
+}
+
+// SUBSCRIBE or UNSUBSCRIBE with a group: clients join or leave it, and
+// another broker sets how many of its clients are members
+void handle_group_frame(Connection *conn, Frame *frame, uint64_t hash, int forwarded) {
+    Payload p;
+    if (decode_payload(frame, &p) < 0 || p.group_len == 0) {
+        fprintf(stderr, "[ERROR] Malformed group request on topic '%s'.\n", frame->topic);
+        return;
+    }
+
+    if (forwarded) {
+        size_t shares = 0;
+        for (size_t i = 0; i < p.len && p.data[i] >= '0' && p.data[i] <= '9'; i++) {
+            shares = shares * 10 + (p.data[i] - '0');
+            if (shares > MAX_GROUP_SHARES) shares = MAX_GROUP_SHARES;
+        }
+        if (frame->opcode != OP_SUBSCRIBE || get_broker_for_topic(frame->topic) != my_broker_id) shares = 0;
+
+        long i;
+        while ((i = find_membership(conn, frame->topic, frame->topic_len, p.group, p.group_len)) >= 0) {
+            drop_membership(conn, i);
+        }
+        if (shares > 0) join_group(conn, frame->topic, frame->topic_len, hash, p.group, p.group_len, shares);
+
+    } else if (frame->opcode == OP_SUBSCRIBE) {
+        if (p.len > 0) {
+            fprintf(stderr, "[ERROR] Groups start at new messages; ignoring the start position.\n");
+        }
+        if (find_membership(conn, frame->topic, frame->topic_len, p.group, p.group_len) < 0 &&
+            join_group(conn, frame->topic, frame->topic_len, hash, p.group, p.group_len, 1)) {
+            printf("[DEBUG] Socket %d joined group '%.*s' on topic '%s'.\n",
+                   conn->fd, (int)p.group_len, p.group, frame->topic);
+        }
+
+    } else {
+        long i = find_membership(conn, frame->topic, frame->topic_len, p.group, p.group_len);
+        if (i >= 0) drop_membership(conn, i);
+    }
+}
+
+// Make room for one more entry in a connection's pattern list
+int reserve_pattern_slot(Connection *conn) {
+    if (conn->pattern_count < conn->pattern_cap) return 0;
+
+    size_t cap = conn->pattern_cap ? conn->pattern_cap * 2 : 4;
+    TopicEntry **patterns = realloc(conn->patterns, cap * sizeof(TopicEntry *));
+    if (!patterns) return -1;
+    conn->patterns = patterns;
+    conn->pattern_cap = cap;
+    return 0;
+}
+
+// Subscribe a connection to a wildcard pattern. The first client holding
+// it here has every other broker serve it to us.
+void add_pattern(Connection *conn, const char *pattern, size_t len) {
+    pthread_rwlock_wrlock(&pattern_lock);
+    TopicEntry *entry = topic_table_get_or_create(&pattern_table, pattern, len, topic_hash(pattern, len));
+    for (size_t i = 0; entry && i < conn->pattern_count; i++) {
+        if (conn->patterns[i] == entry) {
+            pthread_rwlock_unlock(&pattern_lock);
+            return;
+        }
+    }
+
+    int first_local = entry && !conn->from_broker && !has_local_subscribers(entry);
+    if (!entry || reserve_pattern_slot(conn) < 0 ||
+        (entry->sub_count == 0 && topic_trie_insert(&pattern_trie, pattern, len, entry) < 0) ||
+        topic_add_subscriber(entry, conn) < 0) {
+        fprintf(stderr, "[ERROR] Out of memory subscribing to pattern '%s'.\n", pattern);
+        if (entry && entry->sub_count == 0) {
+            topic_trie_remove(&pattern_trie, pattern, len);
+            topic_table_remove(&pattern_table, entry);
+        }
+        pthread_rwlock_unlock(&pattern_lock);
+        return;
+    }
+    __atomic_store_n(&pattern_count, (int)pattern_trie.count, __ATOMIC_RELAXED);
+
+    // Under the lock so it cannot overtake an UNSUBSCRIBE
+    if (first_local) broadcast_pattern(OP_SUBSCRIBE, entry);
+
+    conn->patterns[conn->pattern_count++] = entry;
+    connection_retain(conn);
+    pthread_rwlock_unlock(&pattern_lock);
+}
+
+// SUBSCRIBE or UNSUBSCRIBE with a wildcard pattern, from a client or from
+// a broker whose clients hold it
+void handle_pattern_frame(Connection *conn, Frame *frame) {
+    if (!topic_pattern_valid(frame->topic, frame->topic_len) || (frame->flags & FLAG_GROUP)) {
+        fprintf(stderr, "[ERROR] Invalid topic pattern '%s' (groups need a plain topic).\n", frame->topic);
+        return;
+    }
+
+    if (frame->opcode == OP_SUBSCRIBE) {
+        if (frame->payload_len > 0) {
+            fprintf(stderr, "[ERROR] Patterns start at new messages; ignoring the start position.\n");
+        }
+        add_pattern(conn, frame->topic, frame->topic_len);
+        return;
+    }
+    for (size_t i = 0; i < conn->pattern_count; i++) {
+        TopicEntry *entry = conn->patterns[i];
+        if (entry->name_len == frame->topic_len && memcmp(entry->name, frame->topic, frame->topic_len) == 0) {
+            drop_pattern(conn, i);
+            return;
+        }
+    }
+}
+
+// After a link to a broker comes back, re-register interest in every topic
+// it relays to us (the broker forgot them when the old connection dropped)
+// and in every pattern our clients hold
+void resubscribe_peer(int broker_id) {
+    for (int i = 0; i < TOPIC_STRIPES; i++) {
+        TopicStripe *stripe = &topic_stripes[i];
+        pthread_rwlock_rdlock(&stripe->lock);
+        for (size_t j = 0; j < stripe->table.cap; j++) {
+            TopicEntry *entry = stripe->table.slots[j];
+            if (entry && (entry->remote_owner == broker_id || entry->prev_owner == broker_id)) {
+                register_interest(entry, broker_id);
+            }
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+    }
+
+    pthread_rwlock_rdlock(&pattern_lock);
+    for (size_t i = 0; i < pattern_table.cap; i++) {
+        TopicEntry *entry = pattern_table.slots[i];
+        if (entry && has_local_subscribers(entry)) {
+            forward_frame_to_broker(broker_id, OP_SUBSCRIBE, 0, entry->name, entry->name_len, NULL, 0);
+        }
+    }
+    pthread_rwlock_unlock(&pattern_lock);
+}
+
+// Hand an interest the owner no longer holds to prev_owner, which keeps
+// relaying until the drain deadline. Caller holds the stripe write lock.
+void retire_owner(TopicEntry *entry, int broker_id) {
+    if (entry->prev_owner >= 0 && entry->prev_owner != broker_id) {
+        unregister_interest(entry, entry->prev_owner);
+    }
+    entry->prev_owner = broker_id;
+}
+
+// Move our interest in every topic with local subscribers to its owner on
+// the new ring. The new owner is subscribed before the old one is let go,
+// so messages either of them relays during the handover still arrive.
+// Caller holds membership_lock.
+void rebalance_topics() {
+    int moved = 0;
+    for (int i = 0; i < TOPIC_STRIPES; i++) {
+        TopicStripe *stripe = &topic_stripes[i];
+        pthread_rwlock_wrlock(&stripe->lock);
+        for (size_t j = 0; j < stripe->table.cap; j++) {
+            TopicEntry *entry = stripe->table.slots[j];
+            if (!entry || !has_local_interest(entry)) continue;
+
+            int owner = get_broker_for_topic(entry->name);
+            int holder = entry->remote_owner;  // -1 while we own it
+            if (owner == my_broker_id) {
+                if (holder < 0) continue;
+                retire_owner(entry, holder);
+                entry->remote_owner = -1;
+            } else if (owner != holder) {
+                register_interest(entry, owner);
+                if (entry->prev_owner == owner) entry->prev_owner = -1;  // moved straight back
+                if (holder >= 0) retire_owner(entry, holder);
+                entry->remote_owner = owner;
+            } else {
+                continue;
+            }
+            moved++;
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+    }
+
+    printf("[DEBUG] Rebalanced %d topic(s).\n", moved);
+    drain_deadline_ms = now_ms() + REBALANCE_DRAIN_MS;
+}
+
+// The drain deadline passed: stop taking relays from previous owners.
+// Caller holds membership_lock.
+void retire_prev_owners() {
+    for (int i = 0; i < TOPIC_STRIPES; i++) {
+        TopicStripe *stripe = &topic_stripes[i];
+        pthread_rwlock_wrlock(&stripe->lock);
+        for (size_t j = 0; j < stripe->table.cap; j++) {
+            TopicEntry *entry = stripe->table.slots[j];
+            if (entry && entry->prev_owner >= 0) {
+                unregister_interest(entry, entry->prev_owner);
+                entry->prev_owner = -1;
+            }
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+    }
+}
+
+// Append a publish to its topic's history. Returns its offset or -1.
+long long append_to_log(Frame *frame, uint64_t hash, const Payload *msg) {
+    TopicLog *tl = msglog_topic(message_log, frame->topic, frame->topic_len, hash);
+    long long offset = tl ? msglog_append(tl, msg->data, msg->len) : -1;
+    if (offset < 0) {
+        fprintf(stderr, "[ERROR] Could not log a message on topic '%s'.\n", frame->topic);
+    }
+    return offset;
+}
+
+// Deliver a publish if we own its topic, otherwise pass it to the owner.
+// A publish is forwarded at most twice: once by the broker that received
+// it, and once more by a broker that lost the topic before the sender's
+// ring caught up. After that it is delivered (and logged) wherever it lands.
+void route_publish(Frame *frame, uint64_t hash) {
+    int owner = get_broker_for_topic(frame->topic);
+    if (owner == my_broker_id || (frame->flags & FLAG_REROUTED)) {
+        Payload msg;
+        if (decode_payload(frame, &msg) < 0) {
+            fprintf(stderr, "[ERROR] Malformed publish on topic '%s'.\n", frame->topic);
+            return;
+        }
+        msg.group = NULL;
+        msg.offset = message_log ? append_to_log(frame, hash, &msg) : -1;
+        deliver_to_subscribers(frame->topic, frame->topic_len, hash, &msg, owner == my_broker_id ? -1 : my_broker_id);
+    } else {
+        // The key and other payload prefixes travel with the payload
+        uint16_t flags = frame->flags & ~(FLAG_FORWARDED | FLAG_REROUTED);
+        if (frame->flags & FLAG_FORWARDED) flags |= FLAG_REROUTED;
+        forward_frame_to_broker(owner, OP_PUBLISH, flags, frame->topic, frame->topic_len,
+                                frame->payload, frame->payload_len);
+    }
+}
+
+// Re-route a publish that was still queued for a broker that is gone
+void reroute_queued_frame(const char *data, size_t len, void *arg) {
+    (void)arg;
+    FrameDecoder dec = { (char *)data, len, 0, len };
+    Frame frame;
+    if (decode_frame(&dec, &frame) == 1 && frame.opcode == OP_PUBLISH) {
+        frame.flags &= ~(FLAG_FORWARDED | FLAG_REROUTED);
+        route_publish(&frame, topic_hash(frame.topic, frame.topic_len));
+    }
+}
+
+void init_peer_link(int broker_id);
+
+// Rebuild the ring after brokers joined or left and move topics to match.
+// Caller holds membership_lock.
+void membership_changed() {
+    int live = 0;
+    for (int i = 0; i < broker_count; i++) live += brokers[i].alive;
+    printf("[DEBUG] Cluster membership changed: %d live broker(s).\n", live);
+
+    if (build_ring() < 0) return;
+    rebalance_topics();
+}
+
+// Add a broker we just heard of, given its "ip:port" key. Returns its
+// index or -1 if the key is malformed. Caller holds membership_lock.
+int join_broker(const char *key, size_t len) {
+    char buf[BROKER_KEY_LEN];
+    if (len == 0 || len >= sizeof(buf)) return -1;
+    memcpy(buf, key, len);
+    buf[len] = '\0';
+
+    char *colon = strrchr(buf, ':');
+    if (!colon || colon - buf >= (long)sizeof(brokers[0].ip)) return -1;
+    *colon = '\0';
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) return -1;
+
+    // The link must exist before the slot is published to the reactors
+    if (broker_count >= MAX_BROKERS) {
+        fprintf(stderr, "[ERROR] Maximum number of brokers reached.\n");
+        return -1;
+    }
+    init_peer_link(broker_count);
+    return add_broker(buf, port);
+}
+
+// Apply a heartbeat or leave notice sent by another broker
+void update_membership(Frame *frame) {
+    int changed = 0;
+    pthread_mutex_lock(&membership_lock);
+
+    int sender = find_broker(frame->topic, frame->topic_len);
+    if (sender < 0 && frame->opcode == OP_MEMBERS) {
+        sender = join_broker(frame->topic, frame->topic_len);
+        changed = sender >= 0;
+    }
+
+    int departed = -1;
+    if (sender >= 0 && sender != my_broker_id) {
+        Broker *broker = &brokers[sender];
+        if (frame->opcode == OP_LEAVE) {
+            if (broker->alive) {
+                printf("[DEBUG] Broker %s left the cluster.\n", broker->key);
+                __atomic_store_n(&broker->alive, 0, __ATOMIC_RELAXED);
+                departed = sender;
+                changed = 1;
+            }
+        } else {
+            broker->last_heard_ms = now_ms();
+            if (!broker->alive) {
+                printf("[DEBUG] Broker %s rejoined the cluster.\n", broker->key);
+                __atomic_store_n(&broker->alive, 1, __ATOMIC_RELAXED);
+                changed = 1;
+            }
+        }
+    }
+
+    // Gossip only introduces brokers we have never heard of; one we think
+    // is dead comes back by sending us a heartbeat itself
+    if (frame->opcode == OP_MEMBERS) {
+        const char *p = frame->payload;
+        const char *end = p + frame->payload_len;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            if (!nl) nl = end;
+            if (find_broker(p, nl - p) < 0 && join_broker(p, nl - p) >= 0) changed = 1;
+            p = nl + 1;
+        }
+    }
+
+    if (changed) membership_changed();
+    if (departed >= 0) {
+        outq_discard(&peer_links[departed].conn->outq, reroute_queued_frame, NULL);
+    }
+    pthread_mutex_unlock(&membership_lock);
+}
+
+// Send our view of the cluster to a peer; this doubles as our heartbeat
+void send_heartbeat(PeerLink *link) {
+    char payload[MAX_BROKERS * BROKER_KEY_LEN];
+    size_t len = 0;
+
+    pthread_mutex_lock(&membership_lock);
+    for (int i = 0; i < broker_count; i++) {
+        if (brokers[i].alive) {
+            len += snprintf(payload + len, sizeof(payload) - len, "%s\n", brokers[i].key);
+        }
+    }
+    pthread_mutex_unlock(&membership_lock);
+
+    const char *key = brokers[my_broker_id].key;
+    forward_frame_to_broker(link->broker_id, OP_MEMBERS, 0, key, strlen(key), payload, len);
+}
+
+// The history replay of a topic on a connection, if one is running
+CatchUp *find_catch_up(Connection *conn, const char *topic_name, size_t topic_len) {
+    for (CatchUp *cu = conn->catchups; cu; cu = cu->next) {
+        if (cu->topic_len == topic_len && memcmp(cu->topic, topic_name, topic_len) == 0) return cu;
+    }
+    return NULL;
+}
+
+void cancel_catch_up(Connection *conn, const char *topic_name, size_t topic_len) {
+    for (CatchUp **p = &conn->catchups; *p; p = &(*p)->next) {
+        CatchUp *cu = *p;
+        if (cu->topic_len == topic_len && memcmp(cu->topic, topic_name, topic_len) == 0) {
+            *p = cu->next;
+            slab_free(cu);
+            return;
+        }
+    }
+}
+
+// SUBSCRIBE with a start position: replay the topic's history from there,
+// then join its live subscribers. flush_connection does the replaying.
+void start_catch_up(Connection *conn, Frame *frame, uint64_t hash) {
+    StartKind kind;
+    unsigned long long value;
+    if (parse_start_position(frame->payload, frame->payload_len, &kind, &value) < 0) {
+        fprintf(stderr, "[ERROR] Invalid start position for topic '%s'.\n", frame->topic);
+        return;
+    }
+
+    // Only the owner keeps a topic's history
+    if (!message_log || get_broker_for_topic(frame->topic) != my_broker_id) {
+        fprintf(stderr, "[ERROR] No history for topic '%s' here, subscribing to new messages only.\n",
+                frame->topic);
+        if (!find_catch_up(conn, frame->topic, frame->topic_len)) {
+            add_subscription(conn, frame->topic, frame->topic_len, hash, 0);
+        }
+        return;
+    }
+    TopicLog *tl = msglog_topic(message_log, frame->topic, frame->topic_len, hash);
+    if (!tl) {
+        fprintf(stderr, "[ERROR] Out of memory subscribing to topic '%s'.\n", frame->topic);
+        return;
+    }
+
+    unsigned long long offset = msglog_next_offset(tl);
+    if (kind == START_EARLIEST) {
+        offset = msglog_first_offset(tl);
+    } else if (kind == START_OFFSET && value < offset) {
+        offset = value;
+    } else if (kind == START_TIME) {
+        offset = msglog_offset_at(tl, (long long)value);
+    }
+
+    // Live messages wait until the replay reaches them
+    remove_subscription(conn, frame->topic, frame->topic_len, hash);
+    CatchUp *cu = find_catch_up(conn, frame->topic, frame->topic_len);
+    if (!cu) {
+        cu = slab_calloc(sizeof(CatchUp));
+        if (!cu) {
+            fprintf(stderr, "[ERROR] Out of memory subscribing to topic '%s'.\n", frame->topic);
+            return;
+        }
+        cu->log = tl;
+        cu->hash = hash;
+        cu->topic_len = frame->topic_len;
+        memcpy(cu->topic, frame->topic, frame->topic_len);
+        CatchUp **tail = &conn->catchups;
+        while (*tail) tail = &(*tail)->next;
+        *tail = cu;
+    }
+    cu->offset = offset;
+
+    if (verbose) {
+        printf("[DEBUG] Replaying topic '%s' from offset %llu on socket %d.\n", frame->topic, offset, conn->fd);
+    }
+    schedule_flush(conn);
+}
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    const CatchUp *cu;
+    int failed;
+} HistoryChunk;
+
+// msglog_read callback: encode one record as a MESSAGE
+void add_history_frame(unsigned long long offset, const char *payload, size_t len, void *arg) {
+    HistoryChunk *chunk = arg;
+    if (chunk->failed) return;
+
+    size_t need = message_size(chunk->cu->topic_len, len);
+    if (chunk->len + need > chunk->cap) {
+        size_t cap = chunk->cap * 2 > chunk->len + need ? chunk->cap * 2 : chunk->len + need;
+        char *buf = realloc(chunk->buf, cap);
+        if (!buf) {
+            chunk->failed = 1;
+            return;
+        }
+        chunk->buf = buf;
+        chunk->cap = cap;
+    }
+    chunk->len += encode_message(chunk->buf + chunk->len, chunk->cap - chunk->len, chunk->cu->topic,
+                                 chunk->cu->topic_len, offset, payload, len);
+}
+
+// Runs under the topic's append lock once the replay has caught up
+void go_live(void *arg) {
+    Connection *conn = arg;
+    CatchUp *cu = conn->catchups;
+    add_subscription(conn, cu->topic, cu->topic_len, cu->hash, cu->offset);
+}
+
+// Queue the next chunk of the first running replay, or switch it to live
+// delivery when there is nothing left to read
+void serve_catch_up(Connection *conn) {
+    CatchUp *cu = conn->catchups;
+    HistoryChunk chunk = { NULL, 0, 0, cu, 0 };
+    unsigned long long from = cu->offset;
+
+    if (msglog_read(cu->log, &cu->offset, CATCHUP_CHUNK_BYTES, add_history_frame, &chunk) > 0) {
+        if (chunk.failed || outq_push(&conn->outq, chunk.buf, chunk.len) < 0) {
+            // Rather than leave a gap in the replay
+            fprintf(stderr, "[ERROR] Could not queue history on socket %d.\n", conn->fd);
+            conn->close_requested = 1;
+            schedule_flush(conn);
+            cu->offset = from;
+        }
+    } else if (msglog_if_caught_up(cu->log, cu->offset, go_live, conn)) {
+        if (verbose) {
+            printf("[DEBUG] Topic '%s' caught up at offset %llu on socket %d.\n", cu->topic, cu->offset, conn->fd);
+        }
+        conn->catchups = cu->next;
+        slab_free(cu);
+    }
+    free(chunk.buf);
+}
+
+// The connection's flow state, set up on the first acknowledgement or
+// credit grant. Returns NULL when out of memory.
+FlowState *flow_state(Connection *conn) {
+    if (conn->flow) return conn->flow;
+    FlowState *flow = slab_calloc(sizeof(FlowState));
+    if (!flow) {
+        fprintf(stderr, "[ERROR] Out of memory for flow control on socket %d.\n", conn->fd);
+        return NULL;
+    }
+    flow->first_seq = 1;
+    flow->window = ack_window;
+    // Paced writes are small and wait on the subscriber, which would
+    // otherwise delay its TCP acknowledgements for Nagle to hold them back
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    flow->next = conn->reactor->metered;
+    conn->reactor->metered = conn;
+    conn->flow = flow;
+    return flow;
+}
+
+// An acknowledgement from a subscriber. The first one switches the
+// connection to acknowledged delivery; each one retires what it covers
+// and may resize the window.
+void handle_ack(Connection *conn, Frame *frame) {
+    if (conn->peer || conn->from_broker || conn->closed) return;
+    if (frame->payload_len != ACK_SIZE) {
+        fprintf(stderr, "[ERROR] Malformed acknowledgement on socket %d.\n", conn->fd);
+        return;
+    }
+    unsigned long long seq;
+    uint32_t window;
+    decode_ack(frame->payload, &seq, &window);
+
+    FlowState *flow = flow_state(conn);
+    if (!flow) return;
+    // Frames already in flight go out unnumbered first
+    if (!flow->acked && flow->count > 0) flow->ack_pending = 1;
+    else flow->acked = 1;
+    if (window > 0) flow->window = window < MAX_ACK_WINDOW ? window : MAX_ACK_WINDOW;
+    if (verbose && seq == 0) {
+        printf("[DEBUG] Acknowledged delivery on socket %d, window %zu.\n", conn->fd, flow->window);
+    }
+
+    // A frame partly written (again) cannot be dropped mid-stream
+    size_t retired = 0;
+    while (flow->acked && flow->count > 0 && flow->first_seq <= seq && !(flow->sent == 0 && flow->sent_offset > 0)) {
+        msgbuf_release(flow->frames[flow->start]);
+        flow->start++;
+        flow->count--;
+        flow->first_seq++;
+        if (flow->sent > 0) flow->sent--;
+        retired++;
+    }
+    if (retired > 0) flow->resend_at_ms = now_ms() + redelivery_ms;
+    if (flow->count == 0) flow->start = 0;
+    schedule_flush(conn);
+}
+
+// A credit grant from a subscriber, added to what it has left. The first
+// one makes delivery wait for credit.
+void handle_credit(Connection *conn, Frame *frame) {
+    if (conn->peer || conn->from_broker || conn->closed) return;
+    if (frame->payload_len != CREDIT_SIZE) {
+        fprintf(stderr, "[ERROR] Malformed credit on socket %d.\n", conn->fd);
+        return;
+    }
+    uint32_t messages, bytes;
+    decode_credit(frame->payload, &messages, &bytes);
+
+    FlowState *flow = flow_state(conn);
+    if (!flow) return;
+    if (verbose && !flow->messages_granted && !flow->bytes_granted) {
+        printf("[DEBUG] Credit-based delivery on socket %d: %u message(s), %u byte(s).\n",
+               conn->fd, messages, bytes);
+    }
+    if (messages > 0) {
+        flow->credit_messages += messages;
+        flow->messages_granted = 1;
+    }
+    if (bytes > 0) {
+        flow->credit_bytes += bytes;
+        flow->bytes_granted = 1;
+    }
+    schedule_flush(conn);
+}
+
+// Whether another broker asked us to hold back publishes on a topic. Topics
+// sharing a slot are held back together.
+int topic_throttled(uint64_t hash) {
+    long long until = __atomic_load_n(&throttled_until_ms[hash % THROTTLE_SLOTS], __ATOMIC_RELAXED);
+    return until > 0 && now_ms() < until;
+}
+
+void throttle_topic(uint64_t hash, int held) {
+    __atomic_store_n(&throttled_until_ms[hash % THROTTLE_SLOTS], held ? now_ms() + THROTTLE_HOLD_MS : 0,
+                     __ATOMIC_RELAXED);
+}
+
+// Tell a publisher or broker to hold back publishes on a topic, or that it
+// may go on
+void send_throttle(Connection *conn, uint8_t opcode, const char *topic_name, uint16_t flags) {
+    char frame[FRAME_HEADER_SIZE + MAX_TOPIC_LEN];
+    size_t len = encode_frame(frame, sizeof(frame), opcode, flags, topic_name, NULL, 0);
+    queue_frame(conn, frame, len);
+}
+
+// Ask another broker to hold back a topic, unless it already is. blocker
+// comes with a reference. When the broker relayed it to us, our own
+// publishers on the topic are held back as well, without the round trip.
+void throttle_broker(Connection *conn, const char *topic_name, uint64_t hash, Connection *blocker) {
+    Reactor *reactor = conn->reactor;
+    for (Throttle *t = reactor->throttles; t; t = t->next) {
+        if (t->conn == conn && t->hash == hash && strcmp(t->topic, topic_name) == 0) {
+            if (blocker) connection_release(blocker);
+            return;
+        }
+    }
+    Throttle *t = slab_calloc(sizeof(Throttle));
+    if (!t) {
+        if (blocker) connection_release(blocker);
+        return;
+    }
+    connection_retain(conn);
+    t->conn = conn;
+    t->blocker = blocker;
+    t->hash = hash;
+    t->remind_at_ms = now_ms() + THROTTLE_REMIND_MS;
+    strcpy(t->topic, topic_name);
+    t->next = reactor->throttles;
+    reactor->throttles = t;
+    send_throttle(conn, OP_THROTTLE, topic_name, FLAG_FORWARDED);
+    if (conn->peer) throttle_topic(hash, 1);
+}
+
+// Whether what held a publisher or a broker back still does
+int still_held(Connection *blocker, uint64_t hash) {
+    return blocker ? outq_congested(&blocker->outq) : topic_throttled(hash);
+}
+
+// Push back on whoever sent a publish that landed on a congested queue or
+// on a topic another broker throttled. A client is no longer read from
+// until that clears; a broker is asked to throttle the topic itself. A
+// relayed message only pushes back on congestion here, so two brokers
+// cannot keep each other throttled.
+void push_back(Connection *conn, Frame *frame, uint64_t hash) {
+    Connection *blocker = congested_queue;
+    congested_queue = NULL;
+    if (blocker == conn && !conn->from_broker && !conn->peer) {
+        // Its own acknowledgements and credit must still get through
+        connection_release(blocker);
+        blocker = NULL;
+    }
+    if (!blocker && (conn->peer || !topic_throttled(hash))) return;
+
+    if (conn->peer || conn->from_broker) {
+        throttle_broker(conn, frame->topic, hash, blocker);
+        return;
+    }
+
+    if (verbose) printf("[DEBUG] Holding back the publisher on socket %d (topic '%s').\n", conn->fd, frame->topic);
+    conn->paused = 1;
+    conn->blocker = blocker;
+    conn->paused_hash = hash;
+    connection_retain(conn);
+    conn->next_paused = conn->reactor->paused;
+    conn->reactor->paused = conn;
+    send_throttle(conn, OP_THROTTLE, frame->topic, 0);
+}
+
+// Execute one decoded frame received on a client socket
+void handle_frame(Connection *conn, Frame *frame);
+
+// A client frame on a partitioned topic: a publish goes to the partition
+// of its key (or the next one round-robin), anything else to every
+// partition. Brokers only ever pass on partition topics.
+void handle_partitioned_frame(Connection *conn, Frame *frame, int partitions) {
+    Frame part = *frame;
+    if (frame->opcode == OP_PUBLISH) {
+        Payload msg;
+        if (decode_payload(frame, &msg) < 0) {
+            fprintf(stderr, "[ERROR] Malformed publish on topic '%s'.\n", frame->topic);
+            return;
+        }
+        int partition = msg.key ? partition_for_key(msg.key, msg.key_len, partitions)
+                                : (int)(next_partition++ % partitions);
+        part.topic_len = partition_topic(part.topic, frame->topic, frame->topic_len, partition);
+        handle_frame(conn, &part);
+        return;
+    }
+    for (int i = 0; i < partitions; i++) {
+        part.topic_len = partition_topic(part.topic, frame->topic, frame->topic_len, i);
+        handle_frame(conn, &part);
+    }
+}
+
+void handle_frame(Connection *conn, Frame *frame) {
+    if (verbose) {
+        printf("[DEBUG] Received opcode %d on topic '%s' (%u byte payload)\n",
+               frame->opcode, frame->topic, frame->payload_len);
+    }
+
+    if (frame->opcode == OP_ACK) {
+        handle_ack(conn, frame);
+        return;
+    }
+    if (frame->opcode == OP_CREDIT) {
+        handle_credit(conn, frame);
+        return;
+    }
+    if (frame->topic_len == 0) {
+        fprintf(stderr, "[ERROR] Frame without a topic.\n");
+        return;
+    }
+
+    // Only brokers forward; their interests are not ours to pass on
+    int forwarded = frame->flags & FLAG_FORWARDED;
+    if (forwarded && !conn->from_broker && !conn->peer) {
+        conn->from_broker = 1;
+    }
+
+    if (frame->opcode == OP_MEMBERS || frame->opcode == OP_LEAVE) {
+        update_membership(frame);
+        return;
+    }
+
+    if (frame->opcode == OP_THROTTLE || frame->opcode == OP_RESUME) {
+        // Another broker's queues for the topic are backing up, or drained
+        if (conn->from_broker || conn->peer) {
+            if (verbose) {
+                printf("[DEBUG] %s topic '%s'.\n", frame->opcode == OP_THROTTLE ? "Throttling" : "Releasing",
+                       frame->topic);
+            }
+            throttle_topic(topic_hash(frame->topic, frame->topic_len), frame->opcode == OP_THROTTLE);
+        }
+        return;
+    }
+
+    int partitions = forwarded ? 0 : partition_count(&partitioned_topics, frame->topic, frame->topic_len);
+    if (partitions > 0 && frame->opcode != OP_MESSAGE) {
+        handle_partitioned_frame(conn, frame, partitions);
+        return;
+    }
+
+    if (topic_is_pattern(frame->topic, frame->topic_len)) {
+        if (frame->opcode == OP_SUBSCRIBE || frame->opcode == OP_UNSUBSCRIBE) {
+            handle_pattern_frame(conn, frame);
+        } else {
+            fprintf(stderr, "[ERROR] Cannot publish to a topic pattern '%s'.\n", frame->topic);
+        }
+        return;
+    }
+
+    uint64_t hash = topic_hash(frame->topic, frame->topic_len);
+
+    if (frame->opcode == OP_PUBLISH) {
+        // The owner fans out to its local subscribers and to every broker
+        // holding an interest
+        watch_congestion = 1;
+        route_publish(frame, hash);
+        watch_congestion = 0;
+        push_back(conn, frame, hash);
+
+    } else if ((frame->opcode == OP_SUBSCRIBE || frame->opcode == OP_UNSUBSCRIBE) && (frame->flags & FLAG_GROUP)) {
+        handle_group_frame(conn, frame, hash, forwarded);
+
+    } else if (frame->opcode == OP_SUBSCRIBE) {
+        // Clients stay connected here whoever owns the topic; a forwarded
+        // SUBSCRIBE registers the peer broker's link as a remote interest
+        if (!forwarded || get_broker_for_topic(frame->topic) == my_broker_id) {
+            if (frame->payload_len > 0 && !forwarded) {
+                start_catch_up(conn, frame, hash);
+            } else if (!find_catch_up(conn, frame->topic, frame->topic_len)) {
+                add_subscription(conn, frame->topic, frame->topic_len, hash, 0);
+            }
+        }
+
+    } else if (frame->opcode == OP_UNSUBSCRIBE) {
+        remove_subscription(conn, frame->topic, frame->topic_len, hash);
+        cancel_catch_up(conn, frame->topic, frame->topic_len);
+
+    } else if (frame->opcode == OP_MESSAGE && conn->peer) {
+        // Relayed by the owner for topics our clients subscribed to here
+        Payload msg;
+        if (decode_payload(frame, &msg) < 0) {
+            fprintf(stderr, "[ERROR] Malformed message on topic '%s'.\n", frame->topic);
+            return;
+        }
+        watch_congestion = 1;
+        deliver_to_subscribers(frame->topic, frame->topic_len, hash, &msg, conn->peer->broker_id);
+        watch_congestion = 0;
+        push_back(conn, frame, hash);
+
+    } else {
+        fprintf(stderr, "[ERROR] Unknown opcode: %d\n", frame->opcode);
+    }
+}
+
+// Tag for a request on the connection's current socket
+uint64_t io_tag(Connection *conn, int op) {
+    return (uint64_t)(uintptr_t)conn | (uint64_t)op | (uint64_t)(conn->io_gen & 0xffff) << IO_GEN_SHIFT;
+}
+
+// Whether a completion is for the connection's current socket
+int io_live(Connection *conn, uint64_t tag) {
+    return !conn->closed && (tag >> IO_GEN_SHIFT) == (conn->io_gen & 0xffff);
+}
+
+// Wait for the socket to become writable, or connected
+int uring_poll_out(Reactor *reactor, Connection *conn) {
+    if (conn->poll_armed) return 0;
+    if (uring_prep_poll(reactor->ring, conn->fd, POLLOUT, 0, io_tag(conn, IO_POLL)) < 0) return -1;
+    connection_retain(conn);
+    conn->poll_armed = 1;
+    return 0;
+}
+
+// Cancel the requests on a socket about to be closed. Their completions
+// still come, to drop their references, but no longer count.
+void uring_forget(Reactor *reactor, Connection *conn) {
+    if (conn->recv_armed) uring_prep_cancel(reactor->ring, io_tag(conn, IO_RECV));
+    if (conn->send && conn->send->in_flight) uring_prep_cancel(reactor->ring, io_tag(conn, IO_SEND));
+    if (conn->poll_armed) uring_prep_cancel(reactor->ring, io_tag(conn, IO_POLL));
+    // Nothing queued may reach the kernel once the descriptor is reused
+    uring_submit(reactor->ring);
+    conn->io_gen++;
+    conn->recv_armed = 0;
+    conn->recv_cancelled = 0;
+    conn->poll_armed = 0;
+    conn->hung_up = 0;
+}
+
+// Schedule the next reconnect attempt with exponential backoff
+void peer_link_backoff(PeerLink *link) {
+    link->retry_at_ms = now_ms() + link->backoff_ms;
+    link->backoff_ms *= 2;
+    if (link->backoff_ms > PEER_BACKOFF_MAX_MS) link->backoff_ms = PEER_BACKOFF_MAX_MS;
+}
+
+// Tear down a broken link but keep its queue for the next connection
+void peer_link_down(Reactor *reactor, PeerLink *link) {
+    Connection *conn = link->conn;
+    if (link->connected) {
+        fprintf(stderr, "[ERROR] Lost link to broker %s:%d.\n",
+                brokers[link->broker_id].ip, brokers[link->broker_id].port);
+    }
+    if (conn->fd >= 0) {
+        if (reactor->ring) {
+            uring_forget(reactor, conn);
+        } else {
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        }
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->closed = 1;
+    link->connected = 0;
+    frame_decoder_free(&conn->decoder);
+    outq_rewind(&conn->outq);
+    peer_link_backoff(link);
+}
+
+// Start a non-blocking connect; completion is reported as EPOLLOUT, or
+// by a POLLOUT poll with io_uring
+void peer_link_connect(Reactor *reactor, PeerLink *link) {
+    Broker *broker = &brokers[link->broker_id];
+    Connection *conn = link->conn;
+
+    struct sockaddr_in broker_address;
+    memset(&broker_address, 0, sizeof(broker_address));
+    broker_address.sin_family = AF_INET;
+    broker_address.sin_port = htons(broker->port);
+    if (inet_pton(AF_INET, broker->ip, &broker_address.sin_addr) <= 0) {
+        fprintf(stderr, "[ERROR] Invalid broker IP address %s.\n", broker->ip);
+        peer_link_backoff(link);
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("[ERROR] Socket creation error");
+        peer_link_backoff(link);
+        return;
+    }
+
+    // Batching happens in the queue, so don't let Nagle add latency on top
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(sock, (struct sockaddr *)&broker_address, sizeof(broker_address)) < 0 && errno != EINPROGRESS) {
+        close(sock);
+        peer_link_backoff(link);
+        return;
+    }
+
+    if (reactor->ring) {
+        conn->fd = sock;
+        if (uring_poll_out(reactor, conn) < 0) {
+            fprintf(stderr, "[ERROR] io_uring submission queue full.\n");
+            close(sock);
+            conn->fd = -1;
+            peer_link_backoff(link);
+            return;
+        }
+        conn->closed = 0;
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        perror("[ERROR] epoll_ctl failed");
+        close(sock);
+        peer_link_backoff(link);
+        return;
+    }
+
+    conn->fd = sock;
+    conn->closed = 0;
+}
+
+// Called on EPOLLOUT (or POLLOUT) while a connect is in flight
+void peer_link_connected(Reactor *reactor, PeerLink *link) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(link->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        peer_link_down(reactor, link);
+        return;
+    }
+
+    link->connected = 1;
+    link->backoff_ms = PEER_BACKOFF_MIN_MS;
+    printf("[DEBUG] Linked to broker %s:%d.\n", brokers[link->broker_id].ip, brokers[link->broker_id].port);
+    if (!__atomic_load_n(&leave_requested, __ATOMIC_RELAXED)) {
+        send_heartbeat(link);
+        link->heartbeat_at_ms = now_ms() + HEARTBEAT_MS;
+    }
+    resubscribe_peer(link->broker_id);
+}
+
+// Reconnect links owned by this reactor whose backoff has expired and send
+// heartbeats on the connected ones. Returns the epoll timeout until the
+// next of those is due, or -1 if none is.
+int service_peer_links(Reactor *reactor) {
+    long long now = now_ms();
+    int timeout = -1;
+    int count = __atomic_load_n(&broker_count, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < count; i++) {
+        PeerLink *link = &peer_links[i];
+        Connection *conn = __atomic_load_n(&link->conn, __ATOMIC_ACQUIRE);
+        if (!conn || conn->reactor != reactor) continue;
+
+        long long due;
+        if (link->connected) {
+            if (__atomic_load_n(&leave_requested, __ATOMIC_RELAXED)) continue;
+            if (now >= link->heartbeat_at_ms) {
+                send_heartbeat(link);
+                link->heartbeat_at_ms = now + HEARTBEAT_MS;
+            }
+            due = link->heartbeat_at_ms;
+        } else if (conn->fd >= 0) {
+            continue;  // connect in flight
+        } else {
+            if (now >= link->retry_at_ms) {
+                peer_link_connect(reactor, link);
+                if (conn->fd >= 0) continue;
+            }
+            due = link->retry_at_ms;
+        }
+
+        int wait = (int)(due - now);
+        if (wait < 0) wait = 0;
+        if (timeout < 0 || wait < timeout) timeout = wait;
+    }
+
+    return timeout;
+}
+
+// Create the persistent link to another broker on one of the reactors.
+// Runs before the broker is published in broker_count.
+void init_peer_link(int broker_id) {
+    Connection *conn = slab_calloc(sizeof(Connection));
+    if (!conn || outq_init(&conn->outq, PEER_QUEUE_LEN, 0, OVERFLOW_DROP_OLDEST) < 0) {
+        fprintf(stderr, "[ERROR] Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    outq_set_watermarks(&conn->outq, high_water_pct, low_water_pct);
+    conn->fd = -1;
+    conn->closed = 1;
+    conn->refcount = 1;
+    conn->reactor = &reactors[broker_id % reactor_count];
+    conn->peer = &peer_links[broker_id];
+    frame_decoder_init(&conn->decoder);
+
+    PeerLink *link = &peer_links[broker_id];
+    link->broker_id = broker_id;
+    link->backoff_ms = PEER_BACKOFF_MIN_MS;
+    link->retry_at_ms = 0;
+    link->heartbeat_at_ms = 0;
+    __atomic_store_n(&link->conn, conn, __ATOMIC_RELEASE);
+
+    // The owning reactor may be asleep in epoll_wait with no timeout
+    wake_reactor(conn->reactor);
+}
+
+// Create the persistent links to every other broker, spread over the reactors
+void init_peer_links() {
+    for (int i = 0; i < broker_count; i++) {
+        if (i != my_broker_id) init_peer_link(i);
+    }
+}
+
+// Drop brokers we have not heard from in a while and, once a rebalance has
+// drained, stop taking relays from the previous topic owners.
+// Reactor 0 only.
+void check_membership() {
+    long long now = now_ms();
+    int dead[MAX_BROKERS];
+    int dead_count = 0;
+
+    pthread_mutex_lock(&membership_lock);
+    for (int i = 0; i < broker_count; i++) {
+        Broker *broker = &brokers[i];
+        if (i == my_broker_id || !broker->alive || now - broker->last_heard_ms <= FAILURE_TIMEOUT_MS) continue;
+        fprintf(stderr, "[ERROR] Broker %s stopped responding, removing it from the ring.\n", broker->key);
+        __atomic_store_n(&broker->alive, 0, __ATOMIC_RELAXED);
+        dead[dead_count++] = i;
+    }
+    if (dead_count > 0) membership_changed();
+
+    // Publishes still queued for a dead broker go to the topics' new owners
+    for (int i = 0; i < dead_count; i++) {
+        outq_discard(&peer_links[dead[i]].conn->outq, reroute_queued_frame, NULL);
+    }
+
+    if (drain_deadline_ms > 0 && now >= drain_deadline_ms) {
+        drain_deadline_ms = 0;
+        retire_prev_owners();
+    }
+    pthread_mutex_unlock(&membership_lock);
+}
+
+// Tell every peer we are going and hand our topics to the remaining
+// brokers. We keep relaying for LEAVE_GRACE_MS so in-flight messages get
+// through before the process exits.
+void leave_cluster() {
+    printf("[DEBUG] Leaving the cluster...\n");
+    pthread_mutex_lock(&membership_lock);
+    Broker *self = &brokers[my_broker_id];
+    __atomic_store_n(&self->alive, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < broker_count; i++) {
+        if (i != my_broker_id && brokers[i].alive) {
+            forward_frame_to_broker(i, OP_LEAVE, 0, self->key, strlen(self->key), NULL, 0);
+        }
+    }
+    membership_changed();
+    pthread_mutex_unlock(&membership_lock);
+    leave_deadline_ms = now_ms() + LEAVE_GRACE_MS;
+}
+
+// Reactor 0 housekeeping. Returns the epoll timeout until the next run.
+int service_membership() {
+    if (__atomic_exchange_n(&stats_requested, 0, __ATOMIC_RELAXED)) {
+        slab_print_stats(stdout);
+        fflush(stdout);
+    }
+    if (__atomic_load_n(&leave_requested, __ATOMIC_RELAXED) && leave_deadline_ms == 0) {
+        leave_cluster();
+    }
+    if (leave_deadline_ms > 0 && now_ms() >= leave_deadline_ms) {
+        printf("[DEBUG] Left the cluster.\n");
+        if (message_log) msglog_sync(message_log);
+        exit(EXIT_SUCCESS);
+    }
+    check_membership();
+    return MEMBERSHIP_TICK_MS;
+}
+
+// SIGINT/SIGTERM: leave the cluster gracefully from reactor 0
+void request_leave(int sig) {
+    (void)sig;
+    __atomic_store_n(&leave_requested, 1, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    ssize_t rc = write(reactors[0].event_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+// SIGUSR1: print the allocator's pool occupancy from reactor 0
+void request_stats(int sig) {
+    (void)sig;
+    __atomic_store_n(&stats_requested, 1, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    ssize_t rc = write(reactors[0].event_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+// Drop the connection's flow state and whatever is still in flight
+void free_flow(Reactor *reactor, Connection *conn) {
+    FlowState *flow = conn->flow;
+    for (Connection **p = &reactor->metered; *p; p = &(*p)->flow->next) {
+        if (*p == conn) {
+            *p = flow->next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < flow->count; i++) msgbuf_release(flow->frames[flow->start + i]);
+    free(flow->frames);
+    slab_free(flow);
+    conn->flow = NULL;
+}
+
+void close_connection(Reactor *reactor, Connection *conn) {
+    if (conn->peer) {
+        peer_link_down(reactor, conn->peer);
+        return;
+    }
+    if (conn->closed) return;
+    conn->closed = 1;
+
+    if (verbose) printf("[DEBUG] Client disconnected (socket %d).\n", conn->fd);
+    remove_subscriber(conn);
+    while (conn->catchups) {
+        CatchUp *cu = conn->catchups;
+        conn->catchups = cu->next;
+        slab_free(cu);
+    }
+    if (conn->flow) free_flow(reactor, conn);
+    outq_close(&conn->outq);
+    if (reactor->ring) {
+        uring_forget(reactor, conn);
+    } else {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    close(conn->fd);
+    connection_release(conn);
+}
+
+// Append a frame (or several, for a history chunk) to the in-flight
+// list, taking over the reference to buf. Returns -1 when out of memory.
+int add_in_flight(FlowState *flow, MessageBuffer *buf) {
+    if (flow->start + flow->count == flow->cap) {
+        if (flow->start > 0) {
+            memmove(flow->frames, flow->frames + flow->start, flow->count * sizeof(MessageBuffer *));
+            flow->start = 0;
+        } else {
+            size_t cap = flow->cap ? flow->cap * 2 : 64;
+            MessageBuffer **frames = realloc(flow->frames, cap * sizeof(MessageBuffer *));
+            if (!frames) {
+                msgbuf_release(buf);
+                return -1;
+            }
+            flow->frames = frames;
+            flow->cap = cap;
+        }
+    }
+    if (flow->acked && flow->count == 0) flow->resend_at_ms = now_ms() + redelivery_ms;
+    flow->frames[flow->start + flow->count] = buf;
+    flow->count++;
+    return 0;
+}
+
+// Move one queued item into flight, charging its frames to the credit.
+// With acknowledgements each frame goes separately, with its number.
+// Returns -1 when out of memory.
+int take_queued(FlowState *flow, MessageBuffer *queued) {
+    FrameDecoder frames;
+    frame_decoder_wrap(&frames, queued->data, queued->len);
+    Frame frame;
+    int rc = 0;
+    while (rc == 0 && decode_frame(&frames, &frame) == 1) {
+        flow->credit_messages--;
+        flow->credit_bytes -= frame_size(frame.topic_len, frame.payload_len);
+        if (!flow->acked) continue;
+
+        Payload msg;
+        if (decode_payload(&frame, &msg) < 0) continue;  // we encoded it, so never
+        msg.seq = (long long)(flow->first_seq + flow->count);
+        // Numbered per connection, so no longer shared
+        MessageBuffer *numbered = msgbuf_alloc(payload_frame_size(frame.topic_len, &msg));
+        if (!numbered) {
+            rc = -1;
+            break;
+        }
+        encode_payload_frame(numbered->data, numbered->len, frame.opcode, 0, frame.topic, frame.topic_len, &msg);
+        rc = add_in_flight(flow, numbered);
+    }
+    if (flow->acked || rc < 0) {
+        msgbuf_release(queued);
+        return rc;
+    }
+    return add_in_flight(flow, queued);
+}
+
+// Whether the window and the credit let another queued item go
+int flow_open(const FlowState *flow) {
+    if (flow->acked && flow->count >= flow->window) return 0;
+    return (!flow->messages_granted || flow->credit_messages > 0) && (!flow->bytes_granted || flow->credit_bytes > 0);
+}
+
+// Write the in-flight frames not yet (re)sent. Returns 1 when they all
+// went out, 0 when the socket is full and -1 on a socket error.
+int write_in_flight(Connection *conn) {
+    FlowState *flow = conn->flow;
+    flow->blocked = 0;
+    while (flow->sent < flow->count) {
+        struct iovec iov[MAX_WRITE_IOV];
+        int iovcnt = 0;
+        for (size_t i = flow->sent; i < flow->count && iovcnt < MAX_WRITE_IOV; i++) {
+            MessageBuffer *f = flow->frames[flow->start + i];
+            size_t skip = i == flow->sent ? flow->sent_offset : 0;
+            iov[iovcnt].iov_base = f->data + skip;
+            iov[iovcnt].iov_len = f->len - skip;
+            iovcnt++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            flow->blocked = errno == EAGAIN || errno == EWOULDBLOCK;
+            return flow->blocked ? 0 : -1;
+        }
+
+        while (written > 0) {
+            size_t remaining = flow->frames[flow->start + flow->sent]->len - flow->sent_offset;
+            if ((size_t)written < remaining) {
+                flow->sent_offset += written;
+                break;
+            }
+            written -= remaining;
+            flow->sent++;
+            flow->sent_offset = 0;
+        }
+    }
+    return 1;
+}
+
+// outq_flush for paced delivery: move what the window and the credit
+// allow into flight, then write it. Returns 1 once the outq is empty and
+// everything in flight is written, 0 when the socket, the window or the
+// credit is full and -1 on an error. A history chunk holds many frames,
+// so it may overshoot both.
+int flush_metered(Connection *conn) {
+    FlowState *flow = conn->flow;
+    MessageBuffer *queued;
+    int popped;
+    while (flow_open(flow) && (popped = outq_pop(&conn->outq, &queued)) != 0) {
+        if (popped < 0) {
+            // Queued before the subscriber paced us, and partly written
+            // already: it goes out as it is
+            int rc = outq_flush(&conn->outq, conn->fd);
+            if (rc <= 0) return rc;
+            continue;
+        }
+        if (take_queued(flow, queued) < 0) {
+            fprintf(stderr, "[ERROR] Out of memory for frames in flight on socket %d.\n", conn->fd);
+            return -1;
+        }
+    }
+
+    int rc = write_in_flight(conn);
+    if (!flow->acked) {
+        // Nothing to keep once written
+        for (size_t i = 0; i < flow->sent; i++) msgbuf_release(flow->frames[flow->start + i]);
+        flow->start += flow->sent;
+        flow->count -= flow->sent;
+        flow->sent = 0;
+        if (flow->count == 0) flow->start = 0;
+        if (flow->ack_pending && flow->count == 0) {
+            flow->ack_pending = 0;
+            flow->acked = 1;
+            return flush_metered(conn);
+        }
+    }
+    if (rc <= 0) return rc;
+    return outq_length(&conn->outq) == 0;
+}
+
+// Hand the connection's queued frames to the kernel in one send, which it
+// completes as the socket drains; its completion calls for the next. With
+// refill 0, only what an earlier send left unwritten goes. Returns 1 when
+// nothing is left to send, 0 while a send is in flight and -1 on an error.
+int uring_flush(Reactor *reactor, Connection *conn, int refill) {
+    UringSend *send = conn->send;
+    if (!send) {
+        send = conn->send = slab_calloc(sizeof(UringSend));
+        if (!send) {
+            fprintf(stderr, "[ERROR] Out of memory for sends on socket %d.\n", conn->fd);
+            return -1;
+        }
+    }
+    if (send->in_flight) return 0;
+
+    MessageBuffer *buf;
+    while (refill && send->count < URING_SEND_IOV && outq_pop(&conn->outq, &buf) > 0) {
+        send->frames[send->count++] = buf;
+    }
+    if (send->count == 0) return 1;
+
+    for (size_t i = 0; i < send->count; i++) {
+        size_t skip = i == 0 ? send->offset : 0;
+        send->iov[i].iov_base = send->frames[i]->data + skip;
+        send->iov[i].iov_len = send->frames[i]->len - skip;
+    }
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = send->count;
+    if (uring_prep_sendmsg(reactor->ring, conn->fd, &send->msg, MSG_NOSIGNAL, 0, io_tag(conn, IO_SEND)) < 0) {
+        fprintf(stderr, "[ERROR] io_uring submission queue full.\n");
+        return -1;
+    }
+    connection_retain(conn);
+    send->in_flight = 1;
+    return 0;
+}
+
+// One round of flush_connection. Paced delivery still writes directly,
+// once an earlier send is done, and polls for room when the socket is full.
+int flush_once(Reactor *reactor, Connection *conn) {
+    if (!reactor->ring) return conn->flow ? flush_metered(conn) : outq_flush(&conn->outq, conn->fd);
+    if (!conn->flow) return uring_flush(reactor, conn, 1);
+
+    int rc = uring_flush(reactor, conn, 0);
+    if (rc <= 0) return rc;
+    rc = flush_metered(conn);
+    if (rc == 0 && conn->flow && conn->flow->blocked && uring_poll_out(reactor, conn) < 0) return -1;
+    return rc;
+}
+
+// Write out whatever the connection has queued; EPOLLOUT resumes it later
+// (or the send's completion, with io_uring). A history replay refills the
+// queue each time it drains.
+void flush_connection(Reactor *reactor, Connection *conn) {
+    // Whatever lingers goes now
+    if (conn->flush_by_us) __atomic_store_n(&conn->flush_by_us, 0, __ATOMIC_RELEASE);
+    if (conn->closed || (conn->peer && !conn->peer->connected)) return;
+    for (int chunks = 0;; chunks++) {
+        int rc = flush_once(reactor, conn);
+        if (rc < 0) {
+            close_connection(reactor, conn);
+            return;
+        }
+        if (rc == 0 || !conn->catchups || conn->close_requested) return;
+        if (chunks == CATCHUP_CHUNKS_PER_TURN) {
+            // Let the reactor's other connections have a turn first
+            schedule_flush(conn);
+            wake_reactor(reactor);
+            return;
+        }
+        serve_catch_up(conn);
+    }
+}
+
+// Resend everything in flight on connections whose oldest frame has gone
+// unacknowledged for too long. Returns how soon to check again, or -1
+// when no connection uses acknowledgements.
+int service_redelivery(Reactor *reactor) {
+    int timeout = -1;
+    long long now = now_ms();
+    Connection *conn = reactor->metered;
+    while (conn) {
+        Connection *next = conn->flow->next;
+        FlowState *flow = conn->flow;
+        if (flow->acked) timeout = REDELIVERY_TICK_MS;
+        // Frames still going out for the first time get their chance first
+        if (flow->acked && flow->count > 0 && now >= flow->resend_at_ms && flow->sent == flow->count) {
+            if (verbose) {
+                printf("[DEBUG] Redelivering %zu message(s) from sequence %llu on socket %d.\n",
+                       flow->count, flow->first_seq, conn->fd);
+            }
+            flow->sent = 0;
+            flow->resend_at_ms = now + redelivery_ms;
+            flush_connection(reactor, conn);
+        } else if (flow->acked && flow->count > 0 && now >= flow->resend_at_ms) {
+            flow->resend_at_ms = now + redelivery_ms;
+        }
+        conn = next;
+    }
+    return timeout;
+}
+
+// Whether to leave a connection's deliveries waiting for more to join
+// them rather than write them now; a waiting connection goes on the
+// lingering list. Paced subscribers are written as the pacing allows.
+int linger(Reactor *reactor, Connection *conn) {
+    long long by = __atomic_load_n(&conn->flush_by_us, __ATOMIC_ACQUIRE);
+    if (by == 0 || conn->flow || conn->closed || now_us() >= by || outq_batch_full(&conn->outq)) return 0;
+    if (!conn->lingering) {
+        conn->lingering = 1;
+        connection_retain(conn);
+        conn->next_lingering = reactor->lingering;
+        reactor->lingering = conn;
+    }
+    return 1;
+}
+
+// Write the connections whose linger ran out or whose batch filled.
+// Returns the microseconds until the next linger runs out, or -1 when
+// nothing lingers.
+long long service_lingering(Reactor *reactor) {
+    long long now = now_us();
+    long long timeout = -1;
+    Connection **p = &reactor->lingering;
+    while (*p) {
+        Connection *conn = *p;
+        long long by = __atomic_load_n(&conn->flush_by_us, __ATOMIC_ACQUIRE);
+        if (by > now && !conn->closed && !outq_batch_full(&conn->outq)) {
+            if (timeout < 0 || by - now < timeout) timeout = by - now;
+            p = &conn->next_lingering;
+            continue;
+        }
+        *p = conn->next_lingering;
+        conn->lingering = 0;
+        if (by) flush_connection(reactor, conn);
+        connection_release(conn);
+    }
+    return timeout;
+}
+
+// Flush or close every connection other threads have queued work for
+void process_pending(Reactor *reactor) {
+    pthread_mutex_lock(&reactor->pending_lock);
+    Connection *conn = reactor->pending;
+    reactor->pending = NULL;
+    pthread_mutex_unlock(&reactor->pending_lock);
+
+    while (conn) {
+        Connection *next = conn->next_pending;
+        __atomic_store_n(&conn->flush_scheduled, 0, __ATOMIC_RELEASE);
+        if (conn->close_requested) {
+            fprintf(stderr, "[ERROR] Outbound queue overflow on socket %d, disconnecting.\n", conn->fd);
+            close_connection(reactor, conn);
+        } else if (!linger(reactor, conn)) {
+            flush_connection(reactor, conn);
+        }
+        connection_release(conn);
+        conn = next;
+    }
+}
+
+void uring_receive(Reactor *reactor, Connection *conn);
+
+// Take on a newly accepted client socket
+void add_client(Reactor *reactor, int new_socket) {
+    Connection *conn = slab_calloc(sizeof(Connection));
+    if (!conn || outq_init(&conn->outq, queue_len, queue_bytes, overflow_policy) < 0) {
+        fprintf(stderr, "[ERROR] Out of memory accepting socket %d.\n", new_socket);
+        slab_free(conn);
+        close(new_socket);
+        return;
+    }
+    outq_set_watermarks(&conn->outq, high_water_pct, low_water_pct);
+    if (batching) outq_set_batch(&conn->outq, batch_bytes);
+    if (zerocopy_min > 0 && !reactor->ring) outq_enable_zerocopy(&conn->outq, new_socket, zerocopy_min);
+    conn->fd = new_socket;
+    conn->reactor = reactor;
+    conn->refcount = 1;
+    frame_decoder_init(&conn->decoder);
+    if (verbose) {
+        printf("[DEBUG] Reactor %d handling client connection on socket %d...\n", reactor->id, new_socket);
+    }
+
+    if (reactor->ring) {
+        uring_receive(reactor, conn);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, new_socket, &ev) < 0) {
+        perror("[ERROR] epoll_ctl failed");
+        close(new_socket);
+        connection_release(conn);
+    }
+}
+
+// Accept every pending connection on the reactor's listen socket
+void accept_connections(Reactor *reactor) {
+    while (1) {
+        int new_socket = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("[ERROR] accept failed");
+            }
+            return;
+        }
+        add_client(reactor, new_socket);
+    }
+}
+
+// Come back to a connection whose socket still has data once the reactor's
+// other connections had a turn
+void defer_read(Reactor *reactor, Connection *conn) {
+    if (conn->read_deferred) return;
+    conn->read_deferred = 1;
+    connection_retain(conn);
+    conn->next_unread = reactor->unread;
+    reactor->unread = conn;
+}
+
+// Drain a readable socket and execute every complete frame in it, up to
+// the read budget. With io_uring the data is already in the decoder, and
+// this only executes it and keeps the receive going. Returns -1 once the
+// connection has been closed.
+int read_connection(Reactor *reactor, Connection *conn) {
+    // Deliveries flushed below may close this connection under us
+    connection_retain(conn);
+    int result = 0;
+    size_t read_bytes = 0;
+
+    while (!conn->closed) {
+        // Frames left over from a pause go first
+        Frame frame;
+        int rc = 0;
+        while (!conn->paused && !conn->closed && (rc = decode_frame(&conn->decoder, &frame)) == 1) {
+            handle_frame(conn, &frame);
+        }
+        if (rc < 0) {
+            fprintf(stderr, "[ERROR] Protocol error on socket %d.\n", conn->fd);
+            close_connection(reactor, conn);
+            break;
+        }
+        if (conn->paused || conn->closed || reactor->ring) break;
+        if (read_bytes >= READ_BUDGET_BYTES) {
+            defer_read(reactor, conn);
+            break;
+        }
+
+        // Let subscribers drain between reads of a busy publisher
+        process_pending(reactor);
+
+        size_t avail;
+        char *space = frame_decoder_space(&conn->decoder, &avail);
+        if (!space) {
+            fprintf(stderr, "[ERROR] Out of memory for socket %d.\n", conn->fd);
+            close_connection(reactor, conn);
+            break;
+        }
+
+        ssize_t bytes_received = recv(conn->fd, space, avail, 0);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Idle connections should not pin a read buffer
+                frame_decoder_shrink(&conn->decoder);
+                break;
+            }
+            perror("[ERROR] recv failed");
+            close_connection(reactor, conn);
+            break;
+        }
+        if (bytes_received == 0) {
+            close_connection(reactor, conn);
+            break;
+        }
+        frame_decoder_commit(&conn->decoder, bytes_received);
+        read_bytes += bytes_received;
+    }
+
+    if (reactor->ring && !conn->closed) uring_receive(reactor, conn);
+    if (conn->closed) result = -1;
+    connection_release(conn);
+    return result;
+}
+
+// Remind brokers of the topics they hold back, and release those whose
+// congested queue drained below its low watermark (or closed) or whose
+// topic another broker released
+void service_throttles(Reactor *reactor) {
+    long long now = now_ms();
+    Throttle **p = &reactor->throttles;
+    while (*p) {
+        Throttle *t = *p;
+        int held = still_held(t->blocker, t->hash);
+        if (held && !t->conn->closed) {
+            if (now >= t->remind_at_ms) {
+                send_throttle(t->conn, OP_THROTTLE, t->topic, FLAG_FORWARDED);
+                if (t->conn->peer) throttle_topic(t->hash, 1);
+                t->remind_at_ms = now + THROTTLE_REMIND_MS;
+            }
+            p = &t->next;
+            continue;
+        }
+        *p = t->next;
+        if (!t->conn->closed) send_throttle(t->conn, OP_RESUME, t->topic, FLAG_FORWARDED);
+        if (t->conn->peer) throttle_topic(t->hash, 0);
+        if (t->blocker) connection_release(t->blocker);
+        connection_release(t->conn);
+        slab_free(t);
+    }
+}
+
+// Resume the publishers whose congested queue drained below its low
+// watermark (or closed), or whose throttled topic was released. Returns
+// how soon to check again, or -1 when nothing is held back.
+int service_paused(Reactor *reactor) {
+    service_throttles(reactor);
+    Connection **p = &reactor->paused;
+    while (*p) {
+        Connection *conn = *p;
+        if (still_held(conn->blocker, conn->paused_hash) && !conn->closed) {
+            p = &conn->next_paused;
+            continue;
+        }
+
+        *p = conn->next_paused;
+        conn->paused = 0;
+        if (conn->blocker) connection_release(conn->blocker);
+        conn->blocker = NULL;
+        if (!conn->closed) {
+            if (verbose) printf("[DEBUG] Resuming the publisher on socket %d.\n", conn->fd);
+            char frame[FRAME_HEADER_SIZE];
+            size_t len = encode_frame(frame, sizeof(frame), OP_RESUME, 0, "", NULL, 0);
+            queue_frame(conn, frame, len);
+            // Edge-triggered: what arrived meanwhile will not be signalled again
+            read_connection(reactor, conn);
+        }
+        connection_release(conn);
+    }
+    return reactor->paused || reactor->throttles ? THROTTLE_TICK_MS : -1;
+}
+
+// Give the connections that used up their read budget another turn
+void read_deferred(Reactor *reactor) {
+    Connection *conn = reactor->unread;
+    reactor->unread = NULL;
+    while (conn) {
+        Connection *next = conn->next_unread;
+        conn->read_deferred = 0;
+        if (!conn->closed) read_connection(reactor, conn);
+        connection_release(conn);
+        conn = next;
+    }
+}
+
+// Whether an EPOLLERR only meant zerocopy sends completing, after
+// releasing what they held
+int zerocopy_ready(Connection *conn) {
+    if (conn->peer || conn->closed || outq_reap_zerocopy(&conn->outq, conn->fd) == 0) return 0;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    return getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+
+// Run the reactor's timers that are due. Returns how many microseconds
+// it may wait for I/O before the next one is, or -1 for as long as it takes.
+long long reactor_timeout(Reactor *reactor) {
+    int timeout = service_peer_links(reactor);
+    if (reactor->id == 0) {
+        int tick = service_membership();
+        if (timeout < 0 || tick < timeout) timeout = tick;
+    }
+    int redelivery = service_redelivery(reactor);
+    if (redelivery >= 0 && (timeout < 0 || redelivery < timeout)) timeout = redelivery;
+    int paused = service_paused(reactor);
+    if (paused >= 0 && (timeout < 0 || paused < timeout)) timeout = paused;
+    long long timeout_us = timeout < 0 ? -1 : timeout * 1000LL;
+    long long linger_left = service_lingering(reactor);
+    if (linger_left >= 0 && (timeout_us < 0 || linger_left < timeout_us)) timeout_us = linger_left;
+    if (reactor->unread) timeout_us = 0;
+    return timeout_us;
+}
+
+// Keep a multishot receive armed on a connection, or cancel it while the
+// connection is held back. A client that hung up meanwhile is closed once
+// everything it sent has been executed.
+void uring_receive(Reactor *reactor, Connection *conn) {
+    if (conn->paused) {
+        if (conn->recv_armed && !conn->recv_cancelled) {
+            uring_prep_cancel(reactor->ring, io_tag(conn, IO_RECV));
+            conn->recv_cancelled = 1;
+        }
+        return;
+    }
+    if (conn->hung_up) {
+        close_connection(reactor, conn);
+        return;
+    }
+    if (conn->recv_armed) return;
+    if (uring_prep_recv_multishot(reactor->ring, conn->fd, io_tag(conn, IO_RECV)) < 0) {
+        fprintf(stderr, "[ERROR] io_uring submission queue full, dropping socket %d.\n", conn->fd);
+        close_connection(reactor, conn);
+        return;
+    }
+    connection_retain(conn);
+    conn->recv_armed = 1;
+}
+
+// Execute the frames of a receive straight from its buffer, keeping a
+// partial frame, or what follows once the connection is held back, in the
+// decoder. Returns -1 once the connection has been closed.
+int consume_received(Reactor *reactor, Connection *conn, const char *data, size_t len) {
+    if (conn->decoder.start == conn->decoder.end && !conn->paused) {
+        FrameDecoder received;
+        frame_decoder_wrap(&received, data, len);
+        Frame frame;
+        int rc = 0;
+        while (!conn->paused && !conn->closed && (rc = decode_frame(&received, &frame)) == 1) {
+            handle_frame(conn, &frame);
+        }
+        if (rc < 0) {
+            fprintf(stderr, "[ERROR] Protocol error on socket %d.\n", conn->fd);
+            close_connection(reactor, conn);
+        }
+        if (conn->closed) return -1;
+        // A drained decoder starts over at 0
+        size_t used = received.end ? received.start : len;
+        data += used;
+        len -= used;
+    }
+
+    while (len > 0) {
+        size_t avail;
+        char *space = frame_decoder_space(&conn->decoder, &avail);
+        if (!space) {
+            fprintf(stderr, "[ERROR] Out of memory for socket %d.\n", conn->fd);
+            close_connection(reactor, conn);
+            return -1;
+        }
+        size_t n = len < avail ? len : avail;
+        memcpy(space, data, n);
+        frame_decoder_commit(&conn->decoder, n);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void uring_received(Reactor *reactor, Connection *conn, const struct io_uring_cqe *cqe) {
+    int live = io_live(conn, cqe->user_data);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (live && !more) {
+        conn->recv_armed = 0;
+        conn->recv_cancelled = 0;
+    }
+
+    int rc = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (live && cqe->res > 0) {
+            rc = consume_received(reactor, conn, uring_buffer(reactor->ring, bid), cqe->res);
+        }
+        uring_recycle(reactor->ring, bid);
+    }
+
+    if (live && rc == 0) {
+        if (cqe->res == 0) {
+            // A held-back publisher that hung up still has publishes to execute
+            conn->hung_up = 1;
+            read_connection(reactor, conn);
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            fprintf(stderr, "[ERROR] recv failed on socket %d: %s\n", conn->fd, strerror(-cqe->res));
+            close_connection(reactor, conn);
+        } else if (!more || conn->paused || conn->decoder.start != conn->decoder.end) {
+            // Out of buffers, cancelled, held back or with a frame left
+            // over: executes what it can and re-arms unless held back
+            read_connection(reactor, conn);
+        }
+    }
+    if (!more) connection_release(conn);
+}
+
+void uring_sent(Reactor *reactor, Connection *conn, const struct io_uring_cqe *cqe) {
+    UringSend *send = conn->send;
+    send->in_flight = 0;
+    size_t written = cqe->res > 0 ? (size_t)cqe->res : 0;
+    size_t done = 0;
+    while (written > 0) {
+        size_t remaining = send->frames[done]->len - send->offset;
+        if (written < remaining) {
+            send->offset += written;
+            break;
+        }
+        written -= remaining;
+        msgbuf_release(send->frames[done]);
+        done++;
+        send->offset = 0;
+    }
+    memmove(send->frames, send->frames + done, (send->count - done) * sizeof(MessageBuffer *));
+    send->count -= done;
+
+    if (io_live(conn, cqe->user_data) && cqe->res < 0) {
+        fprintf(stderr, "[ERROR] send failed on socket %d: %s\n", conn->fd, strerror(-cqe->res));
+        close_connection(reactor, conn);
+    }
+    if (!io_live(conn, cqe->user_data)) {
+        // The socket is gone: a link sends the rest, whole, on its next one
+        if (conn->peer) {
+            outq_requeue(&conn->outq, send->frames, send->count);
+        } else {
+            for (size_t i = 0; i < send->count; i++) msgbuf_release(send->frames[i]);
+        }
+        send->count = 0;
+        send->offset = 0;
+    }
+    flush_connection(reactor, conn);
+    connection_release(conn);
+}
+
+void uring_polled(Reactor *reactor, Connection *conn, const struct io_uring_cqe *cqe) {
+    if (io_live(conn, cqe->user_data)) {
+        conn->poll_armed = 0;
+        if (conn->peer && !conn->peer->connected) {
+            peer_link_connected(reactor, conn->peer);
+            if (!conn->closed) read_connection(reactor, conn);
+        }
+        flush_connection(reactor, conn);
+    }
+    connection_release(conn);
+}
+
+void uring_complete(Reactor *reactor, const struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & IO_OP_MASK;
+    if (op == IO_ACCEPT) {
+        if (cqe->res >= 0) {
+            add_client(reactor, cqe->res);
+        } else {
+            fprintf(stderr, "[ERROR] accept failed: %s\n", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE) &&
+            uring_prep_accept_multishot(reactor->ring, reactor->listen_fd, SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                        IO_ACCEPT) < 0) {
+            fprintf(stderr, "[ERROR] io_uring submission queue full, not accepting.\n");
+        }
+        return;
+    }
+    if (op == IO_WAKE) {
+        uint64_t count;
+        while (read(reactor->event_fd, &count, sizeof(count)) > 0);
+        if (!(cqe->flags & IORING_CQE_F_MORE)) uring_prep_poll(reactor->ring, reactor->event_fd, POLLIN, 1, IO_WAKE);
+        return;
+    }
+
+    Connection *conn = (Connection *)(uintptr_t)(cqe->user_data & IO_PTR_MASK);
+    if (op == IO_RECV) {
+        uring_received(reactor, conn, cqe);
+    } else if (op == IO_SEND) {
+        uring_sent(reactor, conn, cqe);
+    } else if (op == IO_POLL) {
+        uring_polled(reactor, conn, cqe);
+    }
+    // Tag 0 completes a cancel
+}
+
+// reactor_loop over io_uring: receives complete into provided buffers and
+// sends queued from anywhere in an iteration go to the kernel together
+void *uring_reactor_loop(void *arg) {
+    Reactor *reactor = (Reactor *)arg;
+    current_reactor = reactor;
+
+    while (1) {
+        long long timeout = reactor_timeout(reactor);
+        if (uring_wait(reactor->ring, timeout) < 0) {
+            perror("[ERROR] io_uring_enter failed");
+            break;
+        }
+
+        struct io_uring_cqe *next;
+        while ((next = uring_peek(reactor->ring)) != NULL) {
+            struct io_uring_cqe cqe = *next;
+            uring_advance(reactor->ring);
+            uring_complete(reactor, &cqe);
+        }
+
+        process_pending(reactor);
+        read_deferred(reactor);
+    }
+
+    return NULL;
+}
+
+void *reactor_loop(void *arg) {
+    Reactor *reactor = (Reactor *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    current_reactor = reactor;
+
+    while (1) {
+        long long timeout = reactor_timeout(reactor);
+        struct timespec ts = { timeout / 1000000, timeout % 1000000 * 1000 };
+        int n = epoll_pwait2(reactor->epoll_fd, events, MAX_EVENTS, timeout < 0 ? NULL : &ts, NULL);
+        if (n < 0 && errno == ENOSYS) {
+            // Before Linux 5.11, lingers round up to milliseconds
+            n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout < 0 ? -1 : (int)((timeout + 999) / 1000));
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[ERROR] epoll_wait failed");
+            break;
+        }
+
+        // Handlers may close (and free) connections later in this batch
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr != &reactor->listen_fd && ptr != &reactor->event_fd) connection_retain(ptr);
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &reactor->listen_fd) {
+                accept_connections(reactor);
+                continue;
+            }
+            if (ptr == &reactor->event_fd) {
+                uint64_t count;
+                while (read(reactor->event_fd, &count, sizeof(count)) > 0);
+                continue;
+            }
+
+            Connection *conn = ptr;
+            if (conn->peer && !conn->peer->connected && !conn->closed) {
+                if (!(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) continue;
+                peer_link_connected(reactor, conn->peer);
+                if (conn->closed) continue;
+            }
+            uint32_t ready = events[i].events;
+            if ((ready & EPOLLERR) && zerocopy_ready(conn)) ready &= ~EPOLLERR;
+            if (ready & EPOLLIN) {
+                if (read_connection(reactor, conn) < 0) continue;
+            }
+            if (ready & EPOLLOUT) {
+                flush_connection(reactor, conn);
+            }
+            // A held-back publisher that hung up still has publishes to read
+            if ((ready & (EPOLLHUP | EPOLLERR)) || ((ready & EPOLLRDHUP) && !conn->paused)) {
+                close_connection(reactor, conn);
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr != &reactor->listen_fd && ptr != &reactor->event_fd) connection_release(ptr);
+        }
+
+        process_pending(reactor);
+        read_deferred(reactor);
+    }
+
+    return NULL;
+}
+
+// Create a non-blocking listen socket; SO_REUSEPORT lets every reactor bind the same port
+int create_listen_socket(int port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
+        perror("[ERROR] socket failed");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("[ERROR] bind failed");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("[ERROR] listen failed");
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+// Set up the reactor's io_uring and arm its accept and wakeup requests.
+// Without io_uring in the kernel the first reactor falls back to epoll
+// for all of them.
+int init_uring(Reactor *reactor) {
+    reactor->ring = malloc(sizeof(Uring));
+    if (!reactor->ring) return -1;
+    if (uring_init(reactor->ring, URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE) < 0) {
+        free(reactor->ring);
+        reactor->ring = NULL;
+        if (reactor->id > 0) {
+            perror("[ERROR] io_uring setup failed");
+            return -1;
+        }
+        fprintf(stderr, "[ERROR] io_uring unavailable (%s), using epoll.\n", strerror(errno));
+        use_uring = 0;
+        return 0;
+    }
+    if (uring_prep_accept_multishot(reactor->ring, reactor->listen_fd, SOCK_NONBLOCK | SOCK_CLOEXEC, IO_ACCEPT) < 0 ||
+        uring_prep_poll(reactor->ring, reactor->event_fd, POLLIN, 1, IO_WAKE) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int init_reactor(Reactor *reactor, int id, int port) {
+    reactor->id = id;
+    reactor->listen_fd = create_listen_socket(port);
+    if (reactor->listen_fd < 0) return -1;
+
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->event_fd < 0) {
+        perror("[ERROR] eventfd failed");
+        return -1;
+    }
+    pthread_mutex_init(&reactor->pending_lock, NULL);
+    reactor->pending = NULL;
+    reactor->metered = NULL;
+
+    if (use_uring && init_uring(reactor) < 0) return -1;
+    if (reactor->ring) {
+        reactor->epoll_fd = -1;
+        return 0;
+    }
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        perror("[ERROR] epoll_create1 failed");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &reactor->listen_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) < 0) {
+        perror("[ERROR] epoll_ctl failed");
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &reactor->event_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &ev) < 0) {
+        perror("[ERROR] epoll_ctl failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Allow as many open sockets as the hard limit permits
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-i broker_id] [-v vnodes] [-t reactor_threads] [-q queue_len]"
+                    " [-Q queue_mb] [-o drop-oldest|drop-newest|disconnect] [-W high_pct[,low_pct]] [-w ack_window]"
+                    " [-r redelivery_ms] [-Z zerocopy_kb] [-b epoll|io_uring] [-L linger_us|topic=linger_us]..."
+                    " [-B batch_kb] [-d log_dir [-s segment_mb] [-f sync_ms]"
+                    " [-m retention_mb] [-a retention_hours]] [-H history_mb] [-p topic=partitions]... [-V]"
+                    " <port> <broker_ip:broker_port>...\n"
+                    "The broker list needs this broker plus any brokers already running;"
+                    " the rest of the cluster is learned from them.\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    const char *log_dir = NULL;
+    long long segment_mb = -1;
+    long long history_mb = DEFAULT_HISTORY_MB;
+    MsgLogOptions log_opts;
+    msglog_default_options(&log_opts);
+    while ((opt = getopt(argc, argv, "t:q:Q:o:W:w:r:Z:b:L:B:i:v:d:s:f:m:a:H:p:V")) != -1) {
+        if (opt == 'i') {
+            my_broker_id = atoi(optarg);
+        } else if (opt == 'V') {
+            verbose = 1;
+        } else if (opt == 'v') {
+            vnodes = atoi(optarg);
+        } else if (opt == 't') {
+            reactor_count = atoi(optarg);
+        } else if (opt == 'q') {
+            queue_len = strtoul(optarg, NULL, 10);
+        } else if (opt == 'Q') {
+            queue_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+        } else if (opt == 'o') {
+            if (parse_overflow_policy(optarg, &overflow_policy) < 0) exit(EXIT_FAILURE);
+        } else if (opt == 'W') {
+            char *comma = strchr(optarg, ',');
+            high_water_pct = atoi(optarg);
+            low_water_pct = comma ? atoi(comma + 1) : high_water_pct * DEFAULT_LOW_WATER_PCT / 100;
+        } else if (opt == 'w') {
+            ack_window = strtoul(optarg, NULL, 10);
+        } else if (opt == 'r') {
+            redelivery_ms = atoll(optarg);
+        } else if (opt == 'Z') {
+            zerocopy_min = strtoul(optarg, NULL, 10) * 1024;
+        } else if (opt == 'L') {
+            if (parse_linger(optarg) < 0) exit(EXIT_FAILURE);
+        } else if (opt == 'B') {
+            batch_bytes = strtoul(optarg, NULL, 10) * 1024;
+        } else if (opt == 'b') {
+            if (strcmp(optarg, "io_uring") == 0) {
+                use_uring = 1;
+            } else if (strcmp(optarg, "epoll") != 0) {
+                usage(argv[0]);
+            }
+        } else if (opt == 'd') {
+            log_dir = optarg;
+        } else if (opt == 's') {
+            segment_mb = atoll(optarg);
+        } else if (opt == 'f') {
+            log_opts.sync_interval_ms = atol(optarg);
+        } else if (opt == 'm') {
+            log_opts.retention_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+        } else if (opt == 'a') {
+            log_opts.retention_ms = atoll(optarg) * 3600 * 1000;
+        } else if (opt == 'H') {
+            history_mb = atoll(optarg);
+        } else if (opt == 'p') {
+            if (partition_map_parse(&partitioned_topics, optarg) < 0) exit(EXIT_FAILURE);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+    }
+
+    if (queue_len < 1) {
+        fprintf(stderr, "[ERROR] Queue length must be at least 1.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (high_water_pct < 0 || high_water_pct > 100 || low_water_pct < 0 ||
+        (high_water_pct > 0 && low_water_pct >= high_water_pct)) {
+        fprintf(stderr, "[ERROR] Watermarks must be percentages with the low one below the high one.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ack_window < 1 || ack_window > MAX_ACK_WINDOW || redelivery_ms < 1) {
+        fprintf(stderr, "[ERROR] The ack window must be between 1 and %d, and redelivery at least 1 ms.\n",
+                MAX_ACK_WINDOW);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < linger_topic_count && !batching; i++) batching = linger_topics[i].linger_us > 0;
+    if (linger_us > 0) batching = 1;
+
+    if (reactor_count < 1 || reactor_count > MAX_REACTORS) {
+        fprintf(stderr, "[ERROR] Reactor threads must be between 1 and %d.\n", MAX_REACTORS);
+        exit(EXIT_FAILURE);
+    }
+
+    int port = atoi(argv[optind]);
+    for (int i = optind + 1; i < argc; i++) {
+        char *colon = strchr(argv[i], ':');
+        if (colon) {
+            *colon = '\0';
+            add_broker(argv[i], atoi(colon + 1));
+        }
+    }
+
+    // Without -i, we are the listed broker whose port matches ours
+    for (int i = 0; i < broker_count && my_broker_id < 0; i++) {
+        if (brokers[i].port == port) my_broker_id = i;
+    }
+    if (my_broker_id < 0 || my_broker_id >= broker_count) {
+        fprintf(stderr, "[ERROR] This broker must appear in the broker list (or pass -i).\n");
+        exit(EXIT_FAILURE);
+    }
+    if (vnodes < 1) {
+        fprintf(stderr, "[ERROR] Virtual nodes must be at least 1.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (segment_mb == 0 || log_opts.sync_interval_ms < 1) {
+        fprintf(stderr, "[ERROR] Segment size and sync interval must be at least 1.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (history_mb < 0) {
+        fprintf(stderr, "[ERROR] History size cannot be negative.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    raise_fd_limit();
+    // Read buffers come and go with every idle spell, so they are pooled too
+    frame_decoder_set_allocator(slab_alloc, slab_free);
+    if (init_topic_stripes() < 0 || build_ring() < 0) {
+        fprintf(stderr, "[ERROR] Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (log_dir) {
+        if (segment_mb > 0) log_opts.segment_bytes = segment_mb * 1024 * 1024;
+        message_log = msglog_open(log_dir, &log_opts);
+        if (!message_log) exit(EXIT_FAILURE);
+    } else if (history_mb > 0) {
+        // Without a log directory the history is kept in memory
+        log_opts.segment_bytes = segment_mb > 0 ? segment_mb * 1024 * 1024 : MEMORY_SEGMENT_BYTES;
+        log_opts.retention_bytes = history_mb * 1024 * 1024;
+        message_log = msglog_open(NULL, &log_opts);
+        if (!message_log) exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < reactor_count; i++) {
+        if (init_reactor(&reactors[i], i, port) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    init_peer_links();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_leave;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = request_stats;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    printf("[DEBUG] Broker running on port %d with %d %s reactor thread(s)...\n", port, reactor_count,
+           use_uring ? "io_uring" : "epoll");
+
+    void *(*loop)(void *) = use_uring ? uring_reactor_loop : reactor_loop;
+    for (int i = 1; i < reactor_count; i++) {
+        pthread_create(&reactors[i].thread, NULL, loop, &reactors[i]);
+    }
+    loop(&reactors[0]);
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashring.h"
+
+#define RING_SEED 0x9747b28cULL
+
+uint64_t murmur_hash64(const void *key, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *data = key;
+    const unsigned char *end = data + (len & ~(size_t)7);
+    uint64_t h = seed ^ (len * m);
+
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        data += 8;
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48; // fall through
+    case 6: h ^= (uint64_t)data[5] << 40; // fall through
+    case 5: h ^= (uint64_t)data[4] << 32; // fall through
+    case 4: h ^= (uint64_t)data[3] << 24; // fall through
+    case 3: h ^= (uint64_t)data[2] << 16; // fall through
+    case 2: h ^= (uint64_t)data[1] << 8;  // fall through
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    const RingPoint *pa = a, *pb = b;
+    if (pa->point != pb->point) return pa->point < pb->point ? -1 : 1;
+    return pa->node - pb->node;
+}
+
+int hashring_build(HashRing *ring, const char *const *node_keys, int node_count, int vnodes) {
+    ring->points = NULL;
+    ring->count = 0;
+    if (node_count <= 0 || vnodes <= 0) return 0;
+
+    ring->points = malloc((size_t)node_count * vnodes * sizeof(RingPoint));
+    if (!ring->points) return -1;
+
+    char vnode_key[128];
+    for (int i = 0; i < node_count; i++) {
+        for (int v = 0; v < vnodes; v++) {
+            int len = snprintf(vnode_key, sizeof(vnode_key), "%s#%d", node_keys[i], v);
+            RingPoint *p = &ring->points[ring->count++];
+            p->point = murmur_hash64(vnode_key, len, RING_SEED);
+            p->node = i;
+        }
+    }
+
+    qsort(ring->points, ring->count, sizeof(RingPoint), compare_points);
+    return 0;
+}
+
+void hashring_free(HashRing *ring) {
+    free(ring->points);
+    ring->points = NULL;
+    ring->count = 0;
+}
+
+int hashring_lookup(const HashRing *ring, const char *key, size_t len) {
+    if (ring->count == 0) return -1;
+
+    uint64_t h = murmur_hash64(key, len, RING_SEED);
+
+    // First point at or after h, wrapping around to the start
+    size_t lo = 0, hi = ring->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].point < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return ring->points[lo == ring->count ? 0 : lo].node;
+}
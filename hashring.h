@@ -0,0 +1,33 @@
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_VNODES 160
+
+// Consistent-hash ring. Each node is placed at `vnodes` points derived from
+// its key ("ip:port"), and a topic belongs to the first point clockwise from
+// its hash. Adding or removing one of N nodes only moves about 1/N of the
+// topics, and placement does not depend on the order nodes are listed in.
+typedef struct {
+    uint64_t point;
+    int node;
+} RingPoint;
+
+typedef struct {
+    RingPoint *points;
+    size_t count;
+} HashRing;
+
+// MurmurHash64A
+uint64_t murmur_hash64(const void *key, size_t len, uint64_t seed);
+
+// Build a ring over node_count nodes; node i is identified by node_keys[i].
+int hashring_build(HashRing *ring, const char *const *node_keys, int node_count, int vnodes);
+void hashring_free(HashRing *ring);
+
+// Index of the node owning key, or -1 if the ring is empty.
+int hashring_lookup(const HashRing *ring, const char *key, size_t len);
+
+#endif
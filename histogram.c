@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "histogram.h"
+
+#define HALF_COUNT ((uint64_t)1 << (HISTOGRAM_SUB_BITS - 1))
+#define SUB_MASK (((uint64_t)1 << HISTOGRAM_SUB_BITS) - 1)
+#define COUNTS_LEN ((HISTOGRAM_BUCKETS + 1) * HALF_COUNT)
+
+// Bucket b holds values of HISTOGRAM_SUB_BITS + b bits in HALF_COUNT steps
+// of 2^b (bucket 0 takes the small values too)
+static size_t index_of(uint64_t value) {
+    int bucket = 64 - __builtin_clzll(value | SUB_MASK) - HISTOGRAM_SUB_BITS;
+    uint64_t sub = value >> bucket;
+    return ((size_t)(bucket + 1) << (HISTOGRAM_SUB_BITS - 1)) + sub - HALF_COUNT;
+}
+
+// The largest value counted at index
+static uint64_t highest_at(size_t index) {
+    int bucket = 0;
+    uint64_t sub = index;
+    if (index >= 2 * HALF_COUNT) {
+        bucket = (int)(index >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+        sub = (index & (HALF_COUNT - 1)) + HALF_COUNT;
+    }
+    return (sub << bucket) + ((uint64_t)1 << bucket) - 1;
+}
+
+int histogram_init(Histogram *h) {
+    h->counts = calloc(COUNTS_LEN, sizeof(uint64_t));
+    h->total = 0;
+    h->min = UINT64_MAX;
+    h->max = 0;
+    return h->counts ? 0 : -1;
+}
+
+void histogram_free(Histogram *h) {
+    free(h->counts);
+    h->counts = NULL;
+}
+
+void histogram_record(Histogram *h, uint64_t value) {
+    if (value >= HISTOGRAM_MAX_NS) value = HISTOGRAM_MAX_NS - 1;
+    h->counts[index_of(value)]++;
+    h->total++;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void histogram_merge(Histogram *dst, const Histogram *src) {
+    for (size_t i = 0; i < COUNTS_LEN; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    if (h->total == 0) return 0;
+    uint64_t target = (uint64_t)ceil(percentile / 100.0 * h->total);
+    if (target < 1) target = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < COUNTS_LEN; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = highest_at(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,37 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// High-dynamic-range histogram of latencies in nanoseconds, after
+// HdrHistogram: values are counted in buckets no wider than a thousandth
+// of their value, so percentiles keep three significant digits from a
+// nanosecond up to HISTOGRAM_MAX_NS. Recording is a few shifts and an
+// increment. Not thread-safe: keep one per thread and merge them.
+
+#define HISTOGRAM_SUB_BITS 11                  // 2048 sub-buckets, three significant digits
+#define HISTOGRAM_BUCKETS 30
+#define HISTOGRAM_MAX_NS ((uint64_t)1 << (HISTOGRAM_SUB_BITS + HISTOGRAM_BUCKETS - 1))  // about 18 minutes
+
+typedef struct {
+    uint64_t *counts;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} Histogram;
+
+// Returns -1 when out of memory
+int histogram_init(Histogram *h);
+void histogram_free(Histogram *h);
+
+// Count one value; values past HISTOGRAM_MAX_NS count as that
+void histogram_record(Histogram *h, uint64_t value);
+
+// Add src's counts to dst
+void histogram_merge(Histogram *dst, const Histogram *src);
+
+// The value at or below which percentile percent of the recorded values
+// lie, to within the precision above; 0 when nothing was recorded
+uint64_t histogram_percentile(const Histogram *h, double percentile);
+
+#endif
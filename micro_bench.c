@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "topic_table.h"
+#include "topic_trie.h"
+#include "hashring.h"
+
+// Microbenchmarks of the broker's per-message work: decoding frames and
+// finding a topic's subscribers, owner and matching patterns. Every case
+// repeats rounds over prepared inputs for a fixed time and reports the
+// cost per operation.
+
+#define FRAME_COUNT 4096
+#define PAYLOAD_SIZE 64
+#define TOPIC_COUNT 10000
+#define PATTERN_COUNT 1000
+#define CACHED_TOPICS TRIE_CACHE_TOPICS  // fills the trie's cache
+#define MISS_TOPICS 4096                  // then matched without it
+#define RING_NODES 3
+
+typedef struct {
+    const char *name;
+    size_t (*round)(void);  // one round over the inputs; returns the operations done
+} Case;
+
+char *frames;
+size_t frames_len;
+char topic_names[TOPIC_COUNT + MISS_TOPICS][32];
+size_t topic_lens[TOPIC_COUNT + MISS_TOPICS];
+size_t lookup_order[TOPIC_COUNT];
+TopicTable table;
+TopicTrie trie;
+TrieMatches scratch;
+HashRing ring;
+volatile unsigned long long sink;  // keeps results from being optimized away
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+size_t decode_round() {
+    FrameDecoder dec;
+    Frame frame;
+    Payload payload;
+    size_t n = 0;
+    unsigned long long sum = 0;
+    frame_decoder_wrap(&dec, frames, frames_len);
+    while (decode_frame(&dec, &frame) == 1 && decode_payload(&frame, &payload) == 0) {
+        sum += payload.len + frame.topic_len;
+        n++;
+    }
+    sink = sum;
+    return n;
+}
+
+size_t hash_round() {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < TOPIC_COUNT; i++) sum += topic_hash(topic_names[i], topic_lens[i]);
+    sink = sum;
+    return TOPIC_COUNT;
+}
+
+size_t table_round() {
+    size_t found = 0;
+    for (size_t i = 0; i < TOPIC_COUNT; i++) {
+        size_t t = lookup_order[i];
+        uint64_t hash = topic_hash(topic_names[t], topic_lens[t]);
+        found += topic_table_find(&table, topic_names[t], topic_lens[t], hash) != NULL;
+    }
+    sink = found;
+    return TOPIC_COUNT;
+}
+
+// Topics whose matches the cache holds
+size_t trie_round() {
+    size_t matches = 0;
+    for (size_t i = 0; i < CACHED_TOPICS; i++) {
+        size_t count;
+        topic_trie_match(&trie, topic_names[i], topic_lens[i], &scratch, &count);
+        matches += count;
+    }
+    sink = matches;
+    return CACHED_TOPICS;
+}
+
+// Topics matched from scratch once the cache is full
+size_t trie_miss_round() {
+    size_t matches = 0;
+    for (size_t i = TOPIC_COUNT; i < TOPIC_COUNT + MISS_TOPICS; i++) {
+        size_t count;
+        topic_trie_match(&trie, topic_names[i], topic_lens[i], &scratch, &count);
+        matches += count;
+    }
+    sink = matches;
+    return MISS_TOPICS;
+}
+
+size_t ring_round() {
+    long long sum = 0;
+    for (size_t i = 0; i < TOPIC_COUNT; i++) sum += hashring_lookup(&ring, topic_names[i], topic_lens[i]);
+    sink = sum;
+    return TOPIC_COUNT;
+}
+
+Case cases[] = {
+    { "decode_frame", decode_round },
+    { "topic_hash", hash_round },
+    { "table_find", table_round },
+    { "trie_match", trie_round },
+    { "trie_match_miss", trie_miss_round },
+    { "ring_lookup", ring_round },
+};
+
+int setup() {
+    for (size_t i = 0; i < TOPIC_COUNT + MISS_TOPICS; i++) {
+        topic_lens[i] = snprintf(topic_names[i], sizeof(topic_names[i]), "sensors/%zu/temp", i);
+    }
+
+    // PUBLISH frames as a client batches them
+    char payload[PAYLOAD_SIZE];
+    memset(payload, 'x', sizeof(payload));
+    size_t cap = FRAME_COUNT * frame_size(sizeof(topic_names[0]), PAYLOAD_SIZE);
+    frames = malloc(cap);
+    if (!frames) return -1;
+    for (size_t i = 0; i < FRAME_COUNT; i++) {
+        frames_len += encode_frame(frames + frames_len, cap - frames_len, OP_PUBLISH, 0, topic_names[i],
+                                   payload, sizeof(payload));
+    }
+
+    if (topic_table_init(&table) < 0) return -1;
+    for (size_t i = 0; i < TOPIC_COUNT; i++) {
+        uint64_t hash = topic_hash(topic_names[i], topic_lens[i]);
+        if (!topic_table_get_or_create(&table, topic_names[i], topic_lens[i], hash)) return -1;
+    }
+    unsigned seed = 1;
+    for (size_t i = 0; i < TOPIC_COUNT; i++) lookup_order[i] = rand_r(&seed) % TOPIC_COUNT;
+
+    // One exact-level pattern per sensor plus a few catch-alls
+    if (topic_trie_init(&trie) < 0) return -1;
+    for (size_t i = 0; i < PATTERN_COUNT; i++) {
+        char pattern[32];
+        int len = snprintf(pattern, sizeof(pattern), "sensors/%zu/+", i);
+        if (topic_trie_insert(&trie, pattern, len, &cases[i % 2]) < 0) return -1;
+    }
+    if (topic_trie_insert(&trie, "sensors/#", 9, &cases[0]) < 0 ||
+        topic_trie_insert(&trie, "+/+/temp", 8, &cases[1]) < 0) {
+        return -1;
+    }
+    trie_round();  // fills the cache
+
+    char keys[RING_NODES][32];
+    const char *key_list[RING_NODES];
+    for (int i = 0; i < RING_NODES; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "127.0.0.1:%d", 8080 + i);
+        key_list[i] = keys[i];
+    }
+    return hashring_build(&ring, key_list, RING_NODES, DEFAULT_VNODES);
+}
+
+int main(int argc, char *argv[]) {
+    long run_ms = 500;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't') {
+            run_ms = atol(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-t ms_per_case] [case]...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (setup() < 0) {
+        fprintf(stderr, "[ERROR] Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int wanted = optind == argc;
+        for (int i = optind; i < argc; i++) wanted |= strcmp(argv[i], cases[c].name) == 0;
+        if (!wanted) continue;
+
+        cases[c].round();  // warm up
+        size_t ops = 0;
+        long long start = now_ns();
+        long long elapsed;
+        do {
+            ops += cases[c].round();
+            elapsed = now_ns() - start;
+        } while (elapsed < run_ms * 1000000LL);
+        printf("%-16s %8.1f ns/op %10.2f Mops/s\n", cases[c].name, (double)elapsed / ops,
+               ops * 1e3 / elapsed);
+    }
+
+    hashring_free(&ring);
+    topic_trie_destroy(&trie);
+    free(scratch.values);
+    topic_table_destroy(&table);
+    free(frames);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include <string.h>
+
+#include "msgbuf.h"
+#include "slab.h"
+
+MessageBuffer *msgbuf_alloc(size_t len) {
+    MessageBuffer *buf = slab_alloc(sizeof(MessageBuffer) + len);
+    if (!buf) return NULL;
+    buf->refs = 1;
+    buf->len = len;
+    return buf;
+}
+
+MessageBuffer *msgbuf_copy(const char *data, size_t len) {
+    MessageBuffer *buf = msgbuf_alloc(len);
+    if (buf) memcpy(buf->data, data, len);
+    return buf;
+}
+
+void msgbuf_retain(MessageBuffer *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void msgbuf_release(MessageBuffer *buf) {
+    if (buf && __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) slab_free(buf);
+}
@@ -0,0 +1,29 @@
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include <stddef.h>
+
+// Encoded frames (one, or a run of them) that never change once built.
+// Fan-out puts the same buffer on every receiving connection's queue, each
+// holding a reference, so a message is encoded and copied once however
+// many subscribers it has. Retain and release are safe from any thread.
+// Buffers come from the slab pools (slab.h).
+typedef struct {
+    int refs;
+    size_t len;
+    char data[];
+} MessageBuffer;
+
+// A buffer of len bytes for the caller to fill in before sharing it,
+// holding one reference. Returns NULL when out of memory.
+MessageBuffer *msgbuf_alloc(size_t len);
+
+// Same, filled with a copy of data
+MessageBuffer *msgbuf_copy(const char *data, size_t len);
+
+void msgbuf_retain(MessageBuffer *buf);
+
+// Drop a reference; the last one frees the buffer
+void msgbuf_release(MessageBuffer *buf);
+
+#endif
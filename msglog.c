@@ -0,0 +1,838 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "msglog.h"
+#include "hashring.h"
+#include "protocol.h"
+#include "topic_table.h"
+
+#define SEGMENT_MAGIC "PSLOG001"
+#define SEGMENT_HEADER_SIZE 512
+#define RETENTION_CHECK_MS 1000
+#define MAX_DIR_NAME 200  // longer escaped topic names fall back to the hash
+#define MAX_PREFAULT_BYTES (4 * 1024 * 1024)
+#define INDEX_INTERVAL 4096  // bytes of records between sparse index entries
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// A segment file is a SEGMENT_HEADER_SIZE header followed by records, each
+// a RecordHeader and the payload padded to 8 bytes. A zero timestamp marks
+// the end of the data. Integers are in host byte order.
+typedef struct {
+    char magic[8];
+    uint64_t base_offset;
+    uint16_t topic_len;
+    char topic[MAX_TOPIC_LEN + 1];
+} SegmentHeader;
+
+typedef struct {
+    uint32_t len;
+    uint32_t check;        // murmur_hash64 of the payload seeded with its offset; 0 in memory
+    int64_t timestamp_ms;  // wall clock; written last
+} RecordHeader;
+
+// Where a record starts, so readers do not scan a segment from the top
+typedef struct {
+    unsigned long long offset;
+    size_t pos;
+    long long timestamp_ms;
+} IndexEntry;
+
+typedef struct Segment {
+    struct Segment *next;
+    unsigned long long base_offset;
+    unsigned long long count;
+    int fd;
+    char *map;
+    size_t map_len;
+    size_t cap;   // bytes we may write to; equals used once sealed
+    size_t used;
+    size_t synced;      // bytes known to be on disk (sync thread)
+    size_t prefaulted;  // end of the pages mapped ahead of used (sync thread)
+    long long last_ms;
+    IndexEntry *index;  // one entry per INDEX_INTERVAL bytes
+    size_t index_count;
+    size_t index_cap;
+    int readers;        // msglog_read calls using the segment unlocked
+    int removed;        // dropped by retention; the last reader frees it
+    char path[PATH_MAX];
+} Segment;
+
+// Appenders on any thread take lock; only the sync thread syncs and
+// deletes segments, so segments between sync_from and tail stay valid
+// while it works on them unlocked. Readers pin the segment they read.
+struct TopicLog {
+    pthread_mutex_t lock;
+    MsgLog *log;
+    char name[MAX_TOPIC_LEN + 1];
+    size_t name_len;
+    char dir[PATH_MAX];
+    int dir_fd;
+    Segment *head;       // oldest
+    Segment *tail;       // appended to
+    Segment *sync_from;  // oldest segment that may hold unsynced records
+    unsigned long long next_offset;
+    unsigned long long synced_offset;
+    unsigned long long bytes;
+    int dir_dirty;       // segments were created or deleted since the last sync
+};
+
+struct MsgLog {
+    char dir[PATH_MAX];  // empty for an in-memory log
+    MsgLogOptions opts;
+    pthread_rwlock_t lock;
+    TopicTable topics;  // each entry holds its TopicLog as subscribers[0]
+    TopicLog **all;
+    size_t count;
+    size_t cap;
+    pthread_mutex_t sync_lock;  // one sync pass at a time
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    int stopping;
+    pthread_t thread;
+};
+
+static long long wall_ms() {
+    // Coarse is plenty for retention and keeps appends cheap
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t record_size(size_t len) {
+    return (sizeof(RecordHeader) + len + 7) & ~(size_t)7;
+}
+
+static uint32_t record_check(const void *payload, size_t len, unsigned long long offset) {
+    return (uint32_t)murmur_hash64(payload, len, offset);
+}
+
+void msglog_default_options(MsgLogOptions *opts) {
+    opts->segment_bytes = DEFAULT_SEGMENT_BYTES;
+    opts->sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS;
+    opts->retention_bytes = 0;
+    opts->retention_ms = 0;
+}
+
+// Directory name for a topic: the name with anything outside [A-Za-z0-9_-]
+// written as %XX, or the hash if that gets too long. The real name is in
+// every segment header, so recovery never decodes it.
+static void topic_dir_name(const char *name, size_t len, uint64_t hash, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+    for (size_t i = 0; i < len && n <= MAX_DIR_NAME; i++) {
+        unsigned char c = name[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-') {
+            out[n++] = c;
+        } else {
+            out[n++] = '%';
+            out[n++] = hex[c >> 4];
+            out[n++] = hex[c & 15];
+        }
+    }
+    if (n > MAX_DIR_NAME) {
+        n = snprintf(out, MAX_DIR_NAME + 4, "#%016llx", (unsigned long long)hash);
+    }
+    out[n] = '\0';
+}
+
+static void remove_segment_file(Segment *seg) {
+    if (seg->fd >= 0 && unlink(seg->path) < 0) {
+        fprintf(stderr, "[ERROR] Could not remove %s: %s\n", seg->path, strerror(errno));
+    }
+}
+
+static void free_segment(Segment *seg) {
+    munmap(seg->map, seg->map_len);
+    if (seg->fd >= 0) close(seg->fd);
+    free(seg->index);
+    free(seg);
+}
+
+// Note where a record at pos starts if the last index entry is far enough
+// behind. Caller holds the topic lock.
+static void index_record(Segment *seg, unsigned long long offset, size_t pos, long long timestamp_ms) {
+    size_t last = seg->index_count ? seg->index[seg->index_count - 1].pos : SEGMENT_HEADER_SIZE;
+    if (pos - last < INDEX_INTERVAL) return;
+    if (seg->index_count == seg->index_cap) {
+        size_t cap = seg->index_cap ? seg->index_cap * 2 : 64;
+        IndexEntry *index = realloc(seg->index, cap * sizeof(IndexEntry));
+        if (!index) return;  // readers just scan further
+        seg->index = index;
+        seg->index_cap = cap;
+    }
+    seg->index[seg->index_count++] = (IndexEntry){ offset, pos, timestamp_ms };
+}
+
+static TopicLog *new_topic_log(MsgLog *log, const char *name, size_t len, const char *dir) {
+    TopicLog *tl = calloc(1, sizeof(TopicLog));
+    if (!tl) return NULL;
+    pthread_mutex_init(&tl->lock, NULL);
+    tl->log = log;
+    memcpy(tl->name, name, len);
+    tl->name[len] = '\0';
+    tl->name_len = len;
+    tl->dir_fd = -1;
+    if (!dir) return tl;
+
+    snprintf(tl->dir, sizeof(tl->dir), "%s", dir);
+    if (mkdir(tl->dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "[ERROR] Could not create %s: %s\n", tl->dir, strerror(errno));
+        free(tl);
+        return NULL;
+    }
+    tl->dir_fd = open(tl->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (tl->dir_fd < 0) {
+        fprintf(stderr, "[ERROR] Could not open %s: %s\n", tl->dir, strerror(errno));
+        free(tl);
+        return NULL;
+    }
+    return tl;
+}
+
+static void free_topic_log(TopicLog *tl) {
+    Segment *seg = tl->head;
+    while (seg) {
+        Segment *next = seg->next;
+        free_segment(seg);
+        seg = next;
+    }
+    if (tl->dir_fd >= 0) close(tl->dir_fd);
+    pthread_mutex_destroy(&tl->lock);
+    free(tl);
+}
+
+// Start a segment at next_offset with room for at least one record of
+// need bytes. The file is allocated up front so appends only dirty pages.
+// In-memory logs use anonymous memory instead.
+static Segment *create_segment(TopicLog *tl, size_t need) {
+    Segment *seg = calloc(1, sizeof(Segment));
+    if (!seg) return NULL;
+    seg->base_offset = tl->next_offset;
+    seg->cap = tl->log->opts.segment_bytes;
+    if (seg->cap < SEGMENT_HEADER_SIZE + need) seg->cap = SEGMENT_HEADER_SIZE + need;
+    seg->map_len = seg->cap;
+
+    if (!tl->log->dir[0]) {
+        seg->fd = -1;
+        seg->map = mmap(NULL, seg->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1, 0);
+        if (seg->map == MAP_FAILED) {
+            fprintf(stderr, "[ERROR] Out of memory for the history of topic '%s'.\n", tl->name);
+            free(seg);
+            return NULL;
+        }
+        seg->used = SEGMENT_HEADER_SIZE;
+        return seg;
+    }
+
+    if (snprintf(seg->path, sizeof(seg->path), "%s/%020llu.log", tl->dir, seg->base_offset) >= PATH_MAX) {
+        fprintf(stderr, "[ERROR] Log path too long in %s.\n", tl->dir);
+        free(seg);
+        return NULL;
+    }
+
+    seg->fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->fd < 0) {
+        fprintf(stderr, "[ERROR] Could not create %s: %s\n", seg->path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+    if (fallocate(seg->fd, 0, 0, seg->cap) < 0 && ftruncate(seg->fd, seg->cap) < 0) {
+        fprintf(stderr, "[ERROR] Could not size %s: %s\n", seg->path, strerror(errno));
+        close(seg->fd);
+        unlink(seg->path);
+        free(seg);
+        return NULL;
+    }
+    seg->map = mmap(NULL, seg->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] Could not map %s: %s\n", seg->path, strerror(errno));
+        close(seg->fd);
+        unlink(seg->path);
+        free(seg);
+        return NULL;
+    }
+
+    SegmentHeader *header = (SegmentHeader *)seg->map;
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    header->base_offset = seg->base_offset;
+    header->topic_len = tl->name_len;
+    memcpy(header->topic, tl->name, tl->name_len);
+    seg->used = SEGMENT_HEADER_SIZE;
+    return seg;
+}
+
+// Seal the current segment and start a new one. Caller holds tl->lock.
+static Segment *roll_segment(TopicLog *tl, size_t need) {
+    Segment *seg = create_segment(tl, need);
+    if (!seg) return NULL;
+
+    Segment *old = tl->tail;
+    if (old) {
+        // Give back the space that was allocated but never written
+        if (old->fd >= 0 && ftruncate(old->fd, old->used) < 0) {
+            fprintf(stderr, "[ERROR] Could not truncate %s: %s\n", old->path, strerror(errno));
+        }
+        old->next = seg;
+    } else {
+        tl->head = seg;
+    }
+    if (!tl->sync_from) tl->sync_from = seg;
+    tl->tail = seg;
+    tl->bytes += seg->used;
+    tl->dir_dirty = 1;
+    return seg;
+}
+
+long long msglog_append(TopicLog *tl, const void *payload, size_t len) {
+    size_t need = record_size(len);
+    long long now = wall_ms();
+
+    pthread_mutex_lock(&tl->lock);
+    Segment *seg = tl->tail;
+    if (!seg || seg->used + need > seg->cap) {
+        seg = roll_segment(tl, need);
+        if (!seg) {
+            pthread_mutex_unlock(&tl->lock);
+            return -1;
+        }
+    }
+
+    unsigned long long offset = tl->next_offset++;
+    index_record(seg, offset, seg->used, now);
+    RecordHeader *rec = (RecordHeader *)(seg->map + seg->used);
+    rec->len = len;
+    // Only recovery reads the check, and nothing in memory is recovered
+    rec->check = tl->log->dir[0] ? record_check(payload, len, offset) : 0;
+    memcpy(rec + 1, payload, len);
+    rec->timestamp_ms = now > 0 ? now : 1;
+
+    seg->used += need;
+    seg->count++;
+    seg->last_ms = now;
+    tl->bytes += need;
+    pthread_mutex_unlock(&tl->lock);
+    return offset;
+}
+
+unsigned long long msglog_first_offset(TopicLog *tl) {
+    pthread_mutex_lock(&tl->lock);
+    unsigned long long offset = tl->head ? tl->head->base_offset : tl->next_offset;
+    pthread_mutex_unlock(&tl->lock);
+    return offset;
+}
+
+unsigned long long msglog_next_offset(TopicLog *tl) {
+    pthread_mutex_lock(&tl->lock);
+    unsigned long long offset = tl->next_offset;
+    pthread_mutex_unlock(&tl->lock);
+    return offset;
+}
+
+// Last indexed record before the one wanted: at or before offset, or
+// older than timestamp_ms when by_time. Caller holds the topic lock.
+static IndexEntry seek_index(Segment *seg, unsigned long long offset, long long timestamp_ms, int by_time) {
+    size_t lo = 0, hi = seg->index_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int before = by_time ? seg->index[mid].timestamp_ms < timestamp_ms : seg->index[mid].offset <= offset;
+        if (before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) return seg->index[lo - 1];
+    return (IndexEntry){ seg->base_offset, SEGMENT_HEADER_SIZE, 0 };
+}
+
+unsigned long long msglog_offset_at(TopicLog *tl, long long timestamp_ms) {
+    pthread_mutex_lock(&tl->lock);
+    unsigned long long offset = tl->next_offset;
+    for (Segment *seg = tl->head; seg; seg = seg->next) {
+        if (seg->count == 0 || seg->last_ms < timestamp_ms) continue;
+
+        IndexEntry at = seek_index(seg, 0, timestamp_ms, 1);
+        offset = at.offset;
+        size_t pos = at.pos;
+        while (offset < seg->base_offset + seg->count) {
+            RecordHeader *rec = (RecordHeader *)(seg->map + pos);
+            if (rec->timestamp_ms >= timestamp_ms) break;
+            pos += record_size(rec->len);
+            offset++;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&tl->lock);
+    return offset;
+}
+
+size_t msglog_read(TopicLog *tl, unsigned long long *offset, size_t max_bytes, RecordCallback fn, void *arg) {
+    pthread_mutex_lock(&tl->lock);
+    Segment *seg = tl->head;
+    while (seg && *offset >= seg->base_offset + seg->count) seg = seg->next;
+    if (!seg) {
+        pthread_mutex_unlock(&tl->lock);
+        return 0;
+    }
+    // Already dropped by retention: carry on from the oldest record we have
+    if (*offset < seg->base_offset) *offset = seg->base_offset;
+    IndexEntry at = seek_index(seg, *offset, 0, 0);
+    unsigned long long end = seg->base_offset + seg->count;
+    seg->readers++;
+    pthread_mutex_unlock(&tl->lock);
+
+    // Records below end are complete and never change, so the segment can
+    // be read while appends carry on
+    unsigned long long current = at.offset;
+    size_t pos = at.pos;
+    while (current < *offset) {
+        pos += record_size(((RecordHeader *)(seg->map + pos))->len);
+        current++;
+    }
+    size_t count = 0;
+    size_t bytes = 0;
+    while (current < end && (count == 0 || bytes < max_bytes)) {
+        RecordHeader *rec = (RecordHeader *)(seg->map + pos);
+        fn(current, (const char *)(rec + 1), rec->len, arg);
+        bytes += rec->len;
+        pos += record_size(rec->len);
+        current++;
+        count++;
+    }
+    *offset = current;
+
+    pthread_mutex_lock(&tl->lock);
+    seg->readers--;
+    int release = seg->removed && seg->readers == 0;
+    pthread_mutex_unlock(&tl->lock);
+    if (release) free_segment(seg);
+    return count;
+}
+
+int msglog_if_caught_up(TopicLog *tl, unsigned long long offset, void (*fn)(void *arg), void *arg) {
+    pthread_mutex_lock(&tl->lock);
+    int caught_up = offset >= tl->next_offset;
+    if (caught_up) fn(arg);
+    pthread_mutex_unlock(&tl->lock);
+    return caught_up;
+}
+
+// Map the pages the tail segment is about to be written to, so appends
+// do not take a page fault (and a filesystem callback) every 4 KB. The
+// lead is twice what was appended since the last pass, so idle topics
+// do not pin memory.
+static void prefault_segment(Segment *seg, size_t used, size_t appended) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t lead = appended * 2 < MAX_PREFAULT_BYTES ? appended * 2 : MAX_PREFAULT_BYTES;
+    size_t start = seg->prefaulted > used ? seg->prefaulted : used;
+    size_t end = used + lead < seg->cap ? used + lead : seg->cap;
+    start &= ~(page - 1);
+    if (end <= start + page) return;
+    // Older kernels lack MADV_POPULATE_WRITE; appends then fault as usual
+    if (madvise(seg->map + start, end - start, MADV_POPULATE_WRITE) == 0) seg->prefaulted = end;
+}
+
+static void sync_topic(TopicLog *tl) {
+    pthread_mutex_lock(&tl->lock);
+    if (tl->synced_offset == tl->next_offset && !tl->dir_dirty) {
+        pthread_mutex_unlock(&tl->lock);
+        return;
+    }
+    Segment *from = tl->sync_from;
+    Segment *to = tl->tail;
+    size_t to_used = to ? to->used : 0;
+    unsigned long long target = tl->next_offset;
+    int dir_dirty = tl->dir_dirty;
+    tl->dir_dirty = 0;
+    pthread_mutex_unlock(&tl->lock);
+
+    // One sync covers every append since the last pass. Only the written
+    // range is synced (msync is fdatasync limited to a range), so pages
+    // mapped ahead are not written out while still empty.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t appended = 0;
+    for (Segment *seg = from; seg; seg = seg->next) {
+        size_t end = seg == to ? to_used : seg->used;
+        size_t start = seg->synced & ~(page - 1);
+        if (seg->fd >= 0 && end > seg->synced && msync(seg->map + start, end - start, MS_SYNC) < 0) {
+            fprintf(stderr, "[ERROR] Sync of %s failed: %s\n", seg->path, strerror(errno));
+        }
+        appended += end - seg->synced;
+        seg->synced = end;
+        if (seg == to) break;
+    }
+    if (to) prefault_segment(to, to_used, appended);
+    if (dir_dirty && tl->dir_fd >= 0 && fsync(tl->dir_fd) < 0) {
+        fprintf(stderr, "[ERROR] fsync of %s failed: %s\n", tl->dir, strerror(errno));
+    }
+
+    pthread_mutex_lock(&tl->lock);
+    tl->synced_offset = target;
+    tl->sync_from = to;
+    pthread_mutex_unlock(&tl->lock);
+}
+
+// Delete the oldest sealed segments while the topic is over its size limit
+// or their newest record is past the age limit
+static void apply_retention(TopicLog *tl, long long now) {
+    const MsgLogOptions *opts = &tl->log->opts;
+    for (;;) {
+        pthread_mutex_lock(&tl->lock);
+        Segment *seg = tl->head;
+        int expired = seg && seg != tl->tail &&
+                      ((opts->retention_bytes > 0 && tl->bytes > opts->retention_bytes) ||
+                       (opts->retention_ms > 0 && seg->last_ms < now - opts->retention_ms));
+        if (!expired) {
+            pthread_mutex_unlock(&tl->lock);
+            return;
+        }
+        tl->head = seg->next;
+        if (tl->sync_from == seg) tl->sync_from = seg->next;
+        tl->bytes -= seg->used;
+        tl->dir_dirty = 1;
+        pthread_mutex_unlock(&tl->lock);
+
+        printf("[DEBUG] Retention removed offsets %llu-%llu of topic '%s'.\n",
+               seg->base_offset, seg->base_offset + seg->count - 1, tl->name);
+        remove_segment_file(seg);
+
+        // Unlinked from the list, so no new reader can pin it
+        pthread_mutex_lock(&tl->lock);
+        seg->removed = 1;
+        int in_use = seg->readers > 0;
+        pthread_mutex_unlock(&tl->lock);
+        if (!in_use) free_segment(seg);
+    }
+}
+
+// Copy the topic list so syncing never holds the table lock
+static TopicLog **snapshot_topics(MsgLog *log, size_t *count) {
+    pthread_rwlock_rdlock(&log->lock);
+    TopicLog **copy = malloc((log->count ? log->count : 1) * sizeof(TopicLog *));
+    *count = 0;
+    if (copy) {
+        if (log->count) memcpy(copy, log->all, log->count * sizeof(TopicLog *));
+        *count = log->count;
+    }
+    pthread_rwlock_unlock(&log->lock);
+    return copy;
+}
+
+void msglog_sync(MsgLog *log) {
+    size_t count;
+    TopicLog **topics = snapshot_topics(log, &count);
+    if (!topics) return;
+    pthread_mutex_lock(&log->sync_lock);
+    for (size_t i = 0; i < count; i++) sync_topic(topics[i]);
+    pthread_mutex_unlock(&log->sync_lock);
+    free(topics);
+}
+
+static void *sync_thread(void *arg) {
+    MsgLog *log = arg;
+    long long retention_at = 0;
+
+    pthread_mutex_lock(&log->stop_lock);
+    while (!log->stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long long ns = ts.tv_nsec + log->opts.sync_interval_ms * 1000000LL;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&log->stop_cond, &log->stop_lock, &ts);
+        if (log->stopping) break;
+        pthread_mutex_unlock(&log->stop_lock);
+
+        msglog_sync(log);
+
+        long long now = wall_ms();
+        if (now >= retention_at && (log->opts.retention_bytes > 0 || log->opts.retention_ms > 0)) {
+            size_t count;
+            TopicLog **topics = snapshot_topics(log, &count);
+            if (topics) {
+                pthread_mutex_lock(&log->sync_lock);
+                for (size_t i = 0; i < count; i++) apply_retention(topics[i], now);
+                pthread_mutex_unlock(&log->sync_lock);
+                free(topics);
+            }
+            retention_at = now + RETENTION_CHECK_MS;
+        }
+
+        pthread_mutex_lock(&log->stop_lock);
+    }
+    pthread_mutex_unlock(&log->stop_lock);
+    return NULL;
+}
+
+// Register a topic log. Caller holds the write lock (or runs before the
+// sync thread starts).
+static int add_topic(MsgLog *log, TopicLog *tl, uint64_t hash) {
+    if (log->count == log->cap) {
+        size_t cap = log->cap ? log->cap * 2 : 16;
+        TopicLog **all = realloc(log->all, cap * sizeof(TopicLog *));
+        if (!all) return -1;
+        log->all = all;
+        log->cap = cap;
+    }
+    TopicEntry *entry = topic_table_get_or_create(&log->topics, tl->name, tl->name_len, hash);
+    if (!entry || entry->sub_count > 0 || topic_add_subscriber(entry, tl) < 0) return -1;
+    log->all[log->count++] = tl;
+    return 0;
+}
+
+TopicLog *msglog_topic(MsgLog *log, const char *topic, size_t topic_len, uint64_t hash) {
+    pthread_rwlock_rdlock(&log->lock);
+    TopicEntry *entry = topic_table_find(&log->topics, topic, topic_len, hash);
+    TopicLog *tl = entry ? entry->subscribers[0] : NULL;
+    pthread_rwlock_unlock(&log->lock);
+    if (tl) return tl;
+
+    pthread_rwlock_wrlock(&log->lock);
+    entry = topic_table_find(&log->topics, topic, topic_len, hash);
+    if (entry) {
+        tl = entry->subscribers[0];
+    } else {
+        if (!log->dir[0]) {
+            tl = new_topic_log(log, topic, topic_len, NULL);
+        } else {
+            char dir_name[MAX_DIR_NAME + 4];
+            char dir[PATH_MAX];
+            topic_dir_name(topic, topic_len, hash, dir_name);
+            if (snprintf(dir, sizeof(dir), "%s/%s", log->dir, dir_name) < PATH_MAX) {
+                tl = new_topic_log(log, topic, topic_len, dir);
+            }
+        }
+        if (tl && add_topic(log, tl, hash) < 0) {
+            free_topic_log(tl);
+            tl = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&log->lock);
+    return tl;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Map an existing segment and find the end of its valid records. Anything
+// after that (preallocated space or a torn write) is cut off, and the
+// segment stays sealed: the next append starts a new one.
+static Segment *recover_segment(const char *path, SegmentHeader *header) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < SEGMENT_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    memcpy(header, map, sizeof(SegmentHeader));
+    if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) != 0 || header->topic_len == 0 ||
+        header->topic_len > MAX_TOPIC_LEN) {
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    Segment *seg = calloc(1, sizeof(Segment));
+    if (!seg) {
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+    seg->base_offset = header->base_offset;
+    seg->fd = fd;
+    seg->map = map;
+    seg->map_len = st.st_size;
+    snprintf(seg->path, sizeof(seg->path), "%s", path);
+
+    size_t pos = SEGMENT_HEADER_SIZE;
+    while (pos + sizeof(RecordHeader) <= (size_t)st.st_size) {
+        RecordHeader *rec = (RecordHeader *)(map + pos);
+        if (rec->timestamp_ms == 0 || record_size(rec->len) > st.st_size - pos) break;
+        if (rec->check != record_check(rec + 1, rec->len, seg->base_offset + seg->count)) break;
+        index_record(seg, seg->base_offset + seg->count, pos, rec->timestamp_ms);
+        seg->last_ms = rec->timestamp_ms;
+        seg->count++;
+        pos += record_size(rec->len);
+    }
+    seg->used = pos;
+    seg->cap = pos;
+    seg->synced = pos;
+    if (pos < (size_t)st.st_size) {
+        if (ftruncate(fd, pos) < 0) {
+            fprintf(stderr, "[ERROR] Could not truncate %s: %s\n", path, strerror(errno));
+        }
+    }
+    return seg;
+}
+
+static TopicLog *recover_topic(MsgLog *log, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return NULL;
+    unsigned long long *bases = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        unsigned long long base;
+        char tail;
+        if (sscanf(de->d_name, "%llu.lo%c", &base, &tail) != 2 || tail != 'g') continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            unsigned long long *grown = realloc(bases, cap * sizeof(*bases));
+            if (!grown) break;
+            bases = grown;
+        }
+        bases[count++] = base;
+    }
+    closedir(d);
+    qsort(bases, count, sizeof(*bases), compare_offsets);
+
+    TopicLog *tl = NULL;
+    for (size_t i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%020llu.log", dir, bases[i]) >= PATH_MAX) continue;
+        SegmentHeader header;
+        Segment *seg = recover_segment(path, &header);
+        if (!seg) {
+            fprintf(stderr, "[ERROR] Skipping unreadable segment %s.\n", path);
+            continue;
+        }
+        if (!tl) {
+            tl = new_topic_log(log, header.topic, header.topic_len, dir);
+            if (!tl) {
+                free_segment(seg);
+                break;
+            }
+        }
+        if (tl->tail) {
+            tl->tail->next = seg;
+        } else {
+            tl->head = seg;
+        }
+        tl->tail = seg;
+        tl->next_offset = seg->base_offset + seg->count;
+        tl->bytes += seg->used;
+    }
+    free(bases);
+    if (tl) tl->synced_offset = tl->next_offset;
+    return tl;
+}
+
+// Load every topic directory found in the log directory
+static int recover_topics(MsgLog *log) {
+    const char *dir = log->dir;
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= PATH_MAX) continue;
+        struct stat st;
+        if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) continue;
+
+        TopicLog *tl = recover_topic(log, path);
+        if (!tl) continue;
+        if (add_topic(log, tl, topic_hash(tl->name, tl->name_len)) < 0) {
+            fprintf(stderr, "[ERROR] Could not recover topic '%s' from %s.\n", tl->name, path);
+            free_topic_log(tl);
+            continue;
+        }
+        printf("[DEBUG] Recovered topic '%s' at offset %llu.\n", tl->name, tl->next_offset);
+    }
+    closedir(d);
+    return 0;
+}
+
+MsgLog *msglog_open(const char *dir, const MsgLogOptions *opts) {
+    MsgLog *log = calloc(1, sizeof(MsgLog));
+    if (!log) return NULL;
+    if (opts) {
+        log->opts = *opts;
+    } else {
+        msglog_default_options(&log->opts);
+    }
+    if (log->opts.segment_bytes < SEGMENT_HEADER_SIZE) log->opts.segment_bytes = SEGMENT_HEADER_SIZE;
+    if (log->opts.sync_interval_ms < 1) log->opts.sync_interval_ms = 1;
+    if (topic_table_init(&log->topics) < 0) {
+        free(log);
+        return NULL;
+    }
+    pthread_rwlock_init(&log->lock, NULL);
+    pthread_mutex_init(&log->sync_lock, NULL);
+    pthread_mutex_init(&log->stop_lock, NULL);
+    pthread_cond_init(&log->stop_cond, NULL);
+
+    if (dir) {
+        snprintf(log->dir, sizeof(log->dir), "%s", dir);
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "[ERROR] Could not create %s: %s\n", dir, strerror(errno));
+            topic_table_destroy(&log->topics);
+            free(log);
+            return NULL;
+        }
+        if (recover_topics(log) < 0) {
+            fprintf(stderr, "[ERROR] Could not open %s: %s\n", dir, strerror(errno));
+            topic_table_destroy(&log->topics);
+            free(log);
+            return NULL;
+        }
+    }
+
+    if (pthread_create(&log->thread, NULL, sync_thread, log) != 0) {
+        fprintf(stderr, "[ERROR] Could not start the log sync thread.\n");
+        for (size_t i = 0; i < log->count; i++) free_topic_log(log->all[i]);
+        free(log->all);
+        topic_table_destroy(&log->topics);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+void msglog_close(MsgLog *log) {
+    pthread_mutex_lock(&log->stop_lock);
+    log->stopping = 1;
+    pthread_cond_signal(&log->stop_cond);
+    pthread_mutex_unlock(&log->stop_lock);
+    pthread_join(log->thread, NULL);
+
+    msglog_sync(log);
+    for (size_t i = 0; i < log->count; i++) {
+        TopicLog *tl = log->all[i];
+        if (tl->tail && tl->tail->fd >= 0 && ftruncate(tl->tail->fd, tl->tail->used) < 0) {
+            fprintf(stderr, "[ERROR] Could not truncate %s: %s\n", tl->tail->path, strerror(errno));
+        }
+        free_topic_log(tl);
+    }
+    free(log->all);
+    topic_table_destroy(&log->topics);
+    pthread_rwlock_destroy(&log->lock);
+    pthread_mutex_destroy(&log->sync_lock);
+    pthread_mutex_destroy(&log->stop_lock);
+    pthread_cond_destroy(&log->stop_cond);
+    free(log);
+}
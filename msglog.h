@@ -0,0 +1,74 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_SEGMENT_BYTES (64 * 1024 * 1024)
+#define DEFAULT_SYNC_INTERVAL_MS 10
+#define MEMORY_SEGMENT_BYTES (1024 * 1024)
+
+// Durable per-topic message log. Each topic is a directory of append-only
+// segment files named after the offset of their first record; the newest
+// segment is memory-mapped and appended to with memcpy. Offsets start at 0
+// and grow by one per message.
+//
+// Appends never wait for the disk: a background thread fdatasyncs every
+// topic with new records once per sync interval (group commit) and deletes
+// the oldest segments once a topic is over its retention size or age.
+// Records past the last sync can be lost if the machine (not just the
+// process) goes down.
+//
+// Opened without a directory, the same segments live in anonymous memory
+// and retention bounds them, which makes a cheap in-memory history.
+typedef struct MsgLog MsgLog;
+typedef struct TopicLog TopicLog;
+
+typedef struct {
+    size_t segment_bytes;
+    long sync_interval_ms;
+    unsigned long long retention_bytes;  // per topic, 0 keeps everything
+    long long retention_ms;              // 0 keeps everything
+} MsgLogOptions;
+
+void msglog_default_options(MsgLogOptions *opts);
+
+// Open (creating it if needed) the log directory, recover the topics
+// already in it and start the sync thread. dir may be NULL for an
+// in-memory log. Returns NULL on error.
+MsgLog *msglog_open(const char *dir, const MsgLogOptions *opts);
+
+// Sync everything, stop the sync thread and unmap every segment
+void msglog_close(MsgLog *log);
+
+// fdatasync every topic with unsynced records now
+void msglog_sync(MsgLog *log);
+
+// The log for a topic, created on first use. Returns NULL on error.
+TopicLog *msglog_topic(MsgLog *log, const char *topic, size_t topic_len, uint64_t hash);
+
+// Append one message. Returns its offset, or -1 on error.
+long long msglog_append(TopicLog *tl, const void *payload, size_t len);
+
+// Oldest offset still retained, and the offset the next append will get
+unsigned long long msglog_first_offset(TopicLog *tl);
+unsigned long long msglog_next_offset(TopicLog *tl);
+
+// First retained offset appended at or after timestamp_ms (Unix time), or
+// the next offset if there is none
+unsigned long long msglog_offset_at(TopicLog *tl, long long timestamp_ms);
+
+typedef void (*RecordCallback)(unsigned long long offset, const char *payload, size_t len, void *arg);
+
+// Pass the records from *offset on to fn, stopping once about max_bytes of
+// payload were read or at the end of a segment. Starts at the oldest
+// retained record if *offset was already deleted. Appends are not blocked
+// while fn runs. Advances *offset and returns the number of records read,
+// 0 at the end of the log.
+size_t msglog_read(TopicLog *tl, unsigned long long *offset, size_t max_bytes, RecordCallback fn, void *arg);
+
+// Call fn under the topic's append lock if nothing was appended at or
+// after offset yet, so no append can come in between. Returns 1 if fn ran.
+int msglog_if_caught_up(TopicLog *tl, unsigned long long offset, void (*fn)(void *arg), void *arg);
+
+#endif
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+
+#include "outq.h"
+
+#define MAX_FLUSH_IOV 64
+
+int outq_init(OutQueue *q, size_t capacity, size_t max_bytes, OverflowPolicy policy) {
+    q->ring = calloc(capacity, sizeof(MessageBuffer *));
+    if (!q->ring) return -1;
+    pthread_mutex_init(&q->lock, NULL);
+    q->capacity = capacity;
+    q->max_bytes = max_bytes;
+    q->bytes = 0;
+    q->head = 0;
+    q->count = 0;
+    q->head_offset = 0;
+    q->policy = policy;
+    q->closed = 0;
+    q->dropped = 0;
+    q->high_frames = 0;
+    q->low_frames = 0;
+    q->high_bytes = 0;
+    q->low_bytes = 0;
+    q->congested = 0;
+    q->zerocopy_min = 0;
+    q->zerocopy_next = 0;
+    q->zerocopy = NULL;
+    q->zerocopy_start = 0;
+    q->zerocopy_count = 0;
+    q->zerocopy_cap = 0;
+    q->batch_bytes = 0;
+    return 0;
+}
+
+// Re-check the watermarks after the queue grew or shrank. Caller holds the lock.
+static void update_congestion(OutQueue *q) {
+    if (q->high_frames == 0) return;
+    int over = q->count >= q->high_frames || (q->high_bytes > 0 && q->bytes >= q->high_bytes);
+    int under = q->count <= q->low_frames && (q->high_bytes == 0 || q->bytes <= q->low_bytes);
+    if (over && !q->congested) {
+        __atomic_store_n(&q->congested, 1, __ATOMIC_RELAXED);
+    } else if (under && q->congested) {
+        __atomic_store_n(&q->congested, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static void discard_all(OutQueue *q) {
+    for (size_t i = 0; i < q->count; i++) {
+        msgbuf_release(q->ring[(q->head + i) % q->capacity]);
+    }
+    q->head = 0;
+    q->count = 0;
+    q->bytes = 0;
+    q->head_offset = 0;
+    update_congestion(q);
+}
+
+// Let go of the buffers of zerocopy sends not yet reported complete.
+// Only once the socket is closed: its pages may still be read until then.
+static void release_zerocopy(OutQueue *q) {
+    for (size_t i = 0; i < q->zerocopy_count; i++) {
+        msgbuf_release(q->zerocopy[q->zerocopy_start + i].buf);
+    }
+    free(q->zerocopy);
+    q->zerocopy = NULL;
+    q->zerocopy_start = 0;
+    q->zerocopy_count = 0;
+    q->zerocopy_cap = 0;
+}
+
+void outq_destroy(OutQueue *q) {
+    discard_all(q);
+    release_zerocopy(q);
+    free(q->ring);
+    pthread_mutex_destroy(&q->lock);
+}
+
+// Whether a frame of len bytes does not fit. A queue over its byte limit
+// still takes one frame when empty.
+static int is_full(const OutQueue *q, size_t len) {
+    return q->count == q->capacity || (q->max_bytes > 0 && q->count > 0 && q->bytes + len > q->max_bytes);
+}
+
+int outq_push(OutQueue *q, const char *frame, size_t len) {
+    MessageBuffer *buf = msgbuf_copy(frame, len);
+    if (!buf) {
+        pthread_mutex_lock(&q->lock);
+        int rc = q->closed ? -1 : 0;
+        if (!q->closed) q->dropped++;
+        pthread_mutex_unlock(&q->lock);
+        return rc;
+    }
+    int rc = outq_push_buffer(q, buf);
+    msgbuf_release(buf);
+    return rc;
+}
+
+int outq_push_buffer(OutQueue *q, MessageBuffer *buf) {
+    size_t len = buf->len;
+    pthread_mutex_lock(&q->lock);
+
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    if (is_full(q, len)) {
+        if (q->policy == OVERFLOW_DISCONNECT) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+
+        // Drop the oldest frames that have not started going out on the
+        // wire; a partially written head must finish or the stream
+        // desynchronises.
+        while (q->policy == OVERFLOW_DROP_OLDEST && is_full(q, len) && q->count > (q->head_offset > 0 ? 1u : 0u)) {
+            size_t next = (q->head + 1) % q->capacity;
+            if (q->head_offset > 0) {
+                q->bytes -= q->ring[next]->len;
+                msgbuf_release(q->ring[next]);
+                q->ring[next] = q->ring[q->head];
+            } else {
+                q->bytes -= q->ring[q->head]->len;
+                msgbuf_release(q->ring[q->head]);
+            }
+            q->head = next;
+            q->count--;
+            q->dropped++;
+        }
+        if (is_full(q, len)) {
+            q->dropped++;
+            pthread_mutex_unlock(&q->lock);
+            return 0;
+        }
+    }
+
+    msgbuf_retain(buf);
+    q->ring[(q->head + q->count) % q->capacity] = buf;
+    int was_empty = q->count == 0;
+    int filled = q->batch_bytes > 0 && q->bytes < q->batch_bytes && q->bytes + len >= q->batch_bytes;
+    q->count++;
+    q->bytes += len;
+    update_congestion(q);
+
+    pthread_mutex_unlock(&q->lock);
+    return was_empty || filled;
+}
+
+// Keep buf until the zerocopy send id completes. Caller holds the lock.
+static int hold_for_zerocopy(OutQueue *q, uint32_t id, MessageBuffer *buf) {
+    if (q->zerocopy_start + q->zerocopy_count == q->zerocopy_cap) {
+        if (q->zerocopy_start > 0) {
+            memmove(q->zerocopy, q->zerocopy + q->zerocopy_start, q->zerocopy_count * sizeof(ZerocopySend));
+            q->zerocopy_start = 0;
+        } else {
+            size_t cap = q->zerocopy_cap ? q->zerocopy_cap * 2 : 64;
+            ZerocopySend *sends = realloc(q->zerocopy, cap * sizeof(ZerocopySend));
+            if (!sends) return -1;
+            q->zerocopy = sends;
+            q->zerocopy_cap = cap;
+        }
+    }
+    msgbuf_retain(buf);
+    q->zerocopy[q->zerocopy_start + q->zerocopy_count++] = (ZerocopySend){ id, buf };
+    return 0;
+}
+
+int outq_flush(OutQueue *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+
+    while (q->count > 0 && !q->closed) {
+        struct iovec iov[MAX_FLUSH_IOV];
+        int iovcnt = 0;
+        int zerocopy = 0;
+        for (size_t i = 0; i < q->count && iovcnt < MAX_FLUSH_IOV; i++) {
+            MessageBuffer *f = q->ring[(q->head + i) % q->capacity];
+            size_t skip = i == 0 ? q->head_offset : 0;
+            iov[iovcnt].iov_base = f->data + skip;
+            iov[iovcnt].iov_len = f->len - skip;
+            iovcnt++;
+            if (q->zerocopy_min > 0 && f->len >= q->zerocopy_min) zerocopy = 1;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        // Like TCP_CORK, without the system calls: a backlog taking several
+        // writes goes out in full segments
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (q->count > (size_t)iovcnt ? MSG_MORE : 0);
+        ssize_t sent = sendmsg(fd, &msg, flags | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (sent < 0 && zerocopy && errno == ENOBUFS) {
+            // Out of the socket's option memory for pinning pages: copy
+            sent = sendmsg(fd, &msg, flags);
+            zerocopy = 0;
+        }
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            pthread_mutex_unlock(&q->lock);
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        uint32_t id = q->zerocopy_next;
+        if (zerocopy) q->zerocopy_next++;
+
+        // Retire fully written frames; the kernel may still be reading
+        // those sent with zerocopy
+        while (sent > 0) {
+            MessageBuffer *f = q->ring[q->head];
+            size_t remaining = f->len - q->head_offset;
+            if (zerocopy && hold_for_zerocopy(q, id, f) < 0) {
+                // Leaking it beats the kernel reading freed memory
+                msgbuf_retain(f);
+            }
+            if ((size_t)sent < remaining) {
+                q->head_offset += sent;
+                break;
+            }
+            sent -= remaining;
+            q->bytes -= f->len;
+            msgbuf_release(f);
+            q->head = (q->head + 1) % q->capacity;
+            q->count--;
+            q->head_offset = 0;
+        }
+        update_congestion(q);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+int outq_pop(OutQueue *q, MessageBuffer **buf) {
+    pthread_mutex_lock(&q->lock);
+    int popped = q->count > 0 && !q->closed ? (q->head_offset == 0 ? 1 : -1) : 0;
+    if (popped > 0) {
+        *buf = q->ring[q->head];
+        q->ring[q->head] = NULL;
+        q->bytes -= (*buf)->len;
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        update_congestion(q);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return popped;
+}
+
+void outq_requeue(OutQueue *q, MessageBuffer **bufs, size_t n) {
+    pthread_mutex_lock(&q->lock);
+    size_t fit = q->closed ? 0 : q->capacity - q->count;
+    size_t skip = n > fit ? n - fit : 0;
+    for (size_t i = 0; i < skip; i++) msgbuf_release(bufs[i]);
+    if (!q->closed) q->dropped += skip;
+    for (size_t i = n; i > skip; i--) {
+        q->head = (q->head + q->capacity - 1) % q->capacity;
+        q->ring[q->head] = bufs[i - 1];
+        q->count++;
+        q->bytes += bufs[i - 1]->len;
+    }
+    update_congestion(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+size_t outq_length(OutQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    size_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+void outq_set_watermarks(OutQueue *q, int high_pct, int low_pct) {
+    pthread_mutex_lock(&q->lock);
+    q->high_frames = high_pct > 0 ? (q->capacity * high_pct + 99) / 100 : 0;
+    q->low_frames = q->capacity * low_pct / 100;
+    q->high_bytes = high_pct > 0 ? q->max_bytes / 100 * high_pct : 0;
+    q->low_bytes = q->max_bytes / 100 * low_pct;
+    if (high_pct == 0) __atomic_store_n(&q->congested, 0, __ATOMIC_RELAXED);
+    update_congestion(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int outq_congested(OutQueue *q) {
+    return __atomic_load_n(&q->congested, __ATOMIC_RELAXED);
+}
+
+void outq_set_batch(OutQueue *q, size_t batch_bytes) {
+    pthread_mutex_lock(&q->lock);
+    q->batch_bytes = batch_bytes;
+    pthread_mutex_unlock(&q->lock);
+}
+
+int outq_batch_full(OutQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    int full = q->batch_bytes > 0 && q->bytes >= q->batch_bytes;
+    pthread_mutex_unlock(&q->lock);
+    return full;
+}
+
+void outq_discard(OutQueue *q, void (*fn)(const char *frame, size_t len, void *arg), void *arg) {
+    pthread_mutex_lock(&q->lock);
+    size_t keep = q->head_offset > 0 ? 1 : 0;
+    size_t n = q->count - keep;
+    MessageBuffer **taken = n > 0 ? malloc(n * sizeof(MessageBuffer *)) : NULL;
+    for (size_t i = 0; i < n; i++) {
+        MessageBuffer **f = &q->ring[(q->head + keep + i) % q->capacity];
+        q->bytes -= (*f)->len;
+        if (taken) taken[i] = *f;
+        else msgbuf_release(*f);
+        *f = NULL;
+    }
+    q->count = keep;
+    update_congestion(q);
+    pthread_mutex_unlock(&q->lock);
+
+    // Hand the frames over outside the lock so fn may push to other queues
+    for (size_t i = 0; taken && i < n; i++) {
+        if (fn) fn(taken[i]->data, taken[i]->len, arg);
+        msgbuf_release(taken[i]);
+    }
+    free(taken);
+}
+
+int outq_enable_zerocopy(OutQueue *q, int fd, size_t min_len) {
+    int one = 1;
+    if (min_len == 0 || setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) return -1;
+    pthread_mutex_lock(&q->lock);
+    q->zerocopy_min = min_len;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+int outq_reap_zerocopy(OutQueue *q, int fd) {
+    int reaped = 0;
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (!cm) continue;
+        struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+        reaped++;
+
+        // Sends ids ee_info to ee_data are done, usually the oldest ones
+        uint32_t first = err->ee_info;
+        uint32_t span = err->ee_data - first;
+        for (size_t i = 0; i < q->zerocopy_count; i++) {
+            ZerocopySend *s = &q->zerocopy[q->zerocopy_start + i];
+            if (s->buf && s->id - first <= span) {
+                msgbuf_release(s->buf);
+                s->buf = NULL;
+            }
+        }
+        while (q->zerocopy_count > 0 && !q->zerocopy[q->zerocopy_start].buf) {
+            q->zerocopy_start++;
+            q->zerocopy_count--;
+        }
+        if (q->zerocopy_count == 0) q->zerocopy_start = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return reaped;
+}
+
+void outq_rewind(OutQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->head_offset = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+void outq_close(OutQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    discard_all(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int parse_overflow_policy(const char *name, OverflowPolicy *policy) {
+    if (strcmp(name, "drop-oldest") == 0) {
+        *policy = OVERFLOW_DROP_OLDEST;
+    } else if (strcmp(name, "drop-newest") == 0) {
+        *policy = OVERFLOW_DROP_NEWEST;
+    } else if (strcmp(name, "disconnect") == 0) {
+        *policy = OVERFLOW_DISCONNECT;
+    } else {
+        fprintf(stderr, "[ERROR] Unknown overflow policy '%s' (drop-oldest, drop-newest, disconnect).\n", name);
+        return -1;
+    }
+    return 0;
+}
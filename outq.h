@@ -0,0 +1,125 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "msgbuf.h"
+
+// What to do when a subscriber's outbound queue is full
+typedef enum {
+    OVERFLOW_DROP_OLDEST,
+    OVERFLOW_DROP_NEWEST,
+    OVERFLOW_DISCONNECT
+} OverflowPolicy;
+
+// A buffer handed to the kernel by a MSG_ZEROCOPY send, kept until the
+// kernel reports that send (id) complete
+typedef struct {
+    uint32_t id;
+    MessageBuffer *buf;
+} ZerocopySend;
+
+// Bounded ring of encoded frames waiting to be written to one socket.
+// Producers (publish paths on any thread) only enqueue; the I/O layer that
+// owns the socket drains it when the socket is writable. Frames are shared
+// buffers, so a message fanned out to many queues exists once.
+typedef struct {
+    pthread_mutex_t lock;
+    MessageBuffer **ring;
+    size_t capacity;
+    size_t max_bytes;    // 0 for no limit
+    size_t bytes;
+    size_t head;
+    size_t count;
+    size_t head_offset;  // bytes of ring[head] already written
+    OverflowPolicy policy;
+    int closed;
+    unsigned long dropped;
+    size_t high_frames;  // watermarks, 0 when off
+    size_t low_frames;
+    size_t high_bytes;
+    size_t low_bytes;
+    int congested;       // over the high watermark and not yet back under the low one
+    size_t zerocopy_min; // frames this big go out with MSG_ZEROCOPY, 0 for never
+    uint32_t zerocopy_next;    // id the kernel gives the next zerocopy send
+    ZerocopySend *zerocopy;    // still being sent, oldest first from zerocopy[zerocopy_start]
+    size_t zerocopy_start;
+    size_t zerocopy_count;
+    size_t zerocopy_cap;
+    size_t batch_bytes;  // a batch worth writing without waiting for more, 0 when not batching
+} OutQueue;
+
+// The queue is full at capacity frames or, with max_bytes set, once the
+// next frame would take it over max_bytes
+int outq_init(OutQueue *q, size_t capacity, size_t max_bytes, OverflowPolicy policy);
+void outq_destroy(OutQueue *q);
+
+// Copy a frame onto the queue. Returns 1 if the queue was empty or just
+// filled a batch (the caller must schedule a flush), 0 if it was queued or
+// dropped by policy, and -1 if the queue is closed or overflowed under
+// OVERFLOW_DISCONNECT.
+int outq_push(OutQueue *q, const char *frame, size_t len);
+
+// Same, queueing a reference to buf instead of a copy
+int outq_push_buffer(OutQueue *q, MessageBuffer *buf);
+
+// Write as much as the socket accepts without blocking. Returns 1 when the
+// queue is empty, 0 when the socket is full and -1 on a socket error.
+int outq_flush(OutQueue *q, int fd);
+
+// Take the head frame off the queue, handing *buf (and its reference) to
+// the caller. Returns 1 on success, 0 if the queue is empty and -1 if the
+// head frame is partly written, so only outq_flush can finish it.
+int outq_pop(OutQueue *q, MessageBuffer **buf);
+
+// Put n frames taken off with outq_pop back at the head, in order,
+// taking over their references. Frames that no longer fit are dropped,
+// oldest first.
+void outq_requeue(OutQueue *q, MessageBuffer **bufs, size_t n);
+
+// Frames waiting
+size_t outq_length(OutQueue *q);
+
+// Count the queue as congested once it holds high_pct percent of its
+// frames (or of max_bytes), until it drains to low_pct percent. A
+// high_pct of 0 turns this off.
+void outq_set_watermarks(OutQueue *q, int high_pct, int low_pct);
+
+// Whether the queue is congested; safe to call without the lock
+int outq_congested(OutQueue *q);
+
+// Have pushes report once the queue holds batch_bytes, for owners that
+// let frames linger for others to join them (0 turns it off)
+void outq_set_batch(OutQueue *q, size_t batch_bytes);
+
+// Whether the queue holds a full batch
+int outq_batch_full(OutQueue *q);
+
+// Send frames of at least min_len bytes on fd with MSG_ZEROCOPY: the
+// kernel reads them straight out of their buffers, which the queue keeps
+// until it hears the send is done. Returns -1, leaving the queue copying,
+// when the socket cannot do it.
+int outq_enable_zerocopy(OutQueue *q, int fd, size_t min_len);
+
+// Read the zerocopy completions on fd's error queue (which raises
+// EPOLLERR) and release the buffers they cover. Returns how many were read.
+int outq_reap_zerocopy(OutQueue *q, int fd);
+
+// Forget how much of the head frame was written, so the whole frame is sent
+// again on a fresh connection (used by reconnecting links).
+void outq_rewind(OutQueue *q);
+
+// Drop queued frames but keep accepting new ones, calling fn (if set) on
+// each one first. A partially written head frame is kept so the stream
+// stays intact.
+void outq_discard(OutQueue *q, void (*fn)(const char *frame, size_t len, void *arg), void *arg);
+
+// Stop accepting frames and discard anything still queued. After this
+// returns no flush will touch the socket, so it is safe to close it.
+void outq_close(OutQueue *q);
+
+int parse_overflow_policy(const char *name, OverflowPolicy *policy);
+
+#endif
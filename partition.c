@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "partition.h"
+#include "hashring.h"
+
+// Not the ring's seed, so partitions do not follow ring placement, and not
+// the hash consumer groups pick members with, so keys in one partition
+// still spread over a group's members
+#define PARTITION_SEED 0x5bd1e995c6a4a793ULL
+
+int partition_map_add(PartitionMap *map, const char *topic, size_t len, int partitions) {
+    if (partitions < 1 || partitions > MAX_PARTITIONS || len == 0 || len + 4 > MAX_TOPIC_LEN) return -1;
+
+    for (int i = 0; i < map->count; i++) {
+        if (map->topics[i].len == len && memcmp(map->topics[i].name, topic, len) == 0) {
+            map->topics[i].partitions = partitions;
+            return 0;
+        }
+    }
+    if (map->count == MAX_PARTITIONED_TOPICS) return -1;
+
+    PartitionedTopic *pt = &map->topics[map->count++];
+    memcpy(pt->name, topic, len);
+    pt->name[len] = '\0';
+    pt->len = len;
+    pt->partitions = partitions;
+    return 0;
+}
+
+int partition_map_parse(PartitionMap *map, const char *spec) {
+    const char *eq = strrchr(spec, '=');
+    char *end;
+    long partitions = eq ? strtol(eq + 1, &end, 10) : 0;
+    if (!eq || eq[1] == '\0' || *end != '\0' || partitions > MAX_PARTITIONS ||
+        partition_map_add(map, spec, eq - spec, (int)partitions) < 0) {
+        fprintf(stderr, "[ERROR] Invalid partitioned topic '%s' (topic=N, 1 to %d partitions).\n",
+                spec, MAX_PARTITIONS);
+        return -1;
+    }
+    return 0;
+}
+
+int partition_count(const PartitionMap *map, const char *topic, size_t len) {
+    for (int i = 0; i < map->count; i++) {
+        if (map->topics[i].len == len && memcmp(map->topics[i].name, topic, len) == 0) {
+            return map->topics[i].partitions;
+        }
+    }
+    return 0;
+}
+
+size_t partition_topic(char *out, const char *topic, size_t len, int partition) {
+    memcpy(out, topic, len);
+    return len + snprintf(out + len, MAX_TOPIC_LEN + 1 - len, "%c%d", PARTITION_SEPARATOR, partition);
+}
+
+int partition_for_key(const char *key, size_t key_len, int partitions) {
+    return (int)(murmur_hash64(key, key_len, PARTITION_SEED) % (uint64_t)partitions);
+}
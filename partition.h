@@ -0,0 +1,50 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+// A partitioned topic is spread over N ordinary topics named "topic:0" to
+// "topic:N-1". Each partition is placed on the ring on its own, so a hot
+// topic is shared by several brokers and reactor threads. Messages with the
+// same key always go to the same partition and keep their order; messages
+// without a key are spread round-robin.
+//
+// Partition counts are configuration: everyone partitioning a topic must
+// use the same count for it, like they use the same vnodes.
+
+#define MAX_PARTITIONS 1000
+#define MAX_PARTITIONED_TOPICS 64
+#define PARTITION_SEPARATOR ':'
+
+typedef struct {
+    char name[MAX_TOPIC_LEN + 1];
+    size_t len;
+    int partitions;
+} PartitionedTopic;
+
+typedef struct {
+    PartitionedTopic topics[MAX_PARTITIONED_TOPICS];
+    int count;
+} PartitionMap;
+
+// Declare a topic with partitions partitions, replacing an earlier count.
+// Returns 0, or -1 if the count is out of range, the name is too long to
+// take a partition suffix or the map is full.
+int partition_map_add(PartitionMap *map, const char *topic, size_t len, int partitions);
+
+// Same, from a "topic=N" command-line argument
+int partition_map_parse(PartitionMap *map, const char *spec);
+
+// Number of partitions of a topic, 0 if it is not partitioned
+int partition_count(const PartitionMap *map, const char *topic, size_t len);
+
+// Write a partition's topic name to out (MAX_TOPIC_LEN + 1 bytes) and
+// return its length
+size_t partition_topic(char *out, const char *topic, size_t len, int partition);
+
+// The partition messages with this key go to
+int partition_for_key(const char *key, size_t key_len, int partitions);
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+#define DECODER_INITIAL_SIZE 16384
+
+static void *(*decoder_alloc)(size_t) = malloc;
+static void (*decoder_release)(void *) = free;
+
+void frame_decoder_set_allocator(void *(*alloc)(size_t), void (*release)(void *)) {
+    decoder_alloc = alloc;
+    decoder_release = release;
+}
+
+void frame_decoder_init(FrameDecoder *dec) {
+    dec->buf = NULL;
+    dec->cap = 0;
+    dec->start = 0;
+    dec->end = 0;
+}
+
+void frame_decoder_free(FrameDecoder *dec) {
+    decoder_release(dec->buf);
+    frame_decoder_init(dec);
+}
+
+uint32_t max_payload(uint16_t flags) {
+    return MAX_PAYLOAD_SIZE + (flags & FLAG_GROUP ? 1 + MAX_GROUP_LEN : 0) +
+           (flags & FLAG_KEY ? 1 + MAX_KEY_LEN : 0) + (flags & FLAG_OFFSET ? OFFSET_SIZE : 0) + (flags & FLAG_SEQ ? SEQ_SIZE : 0);
+}
+
+// Size of the frame starting at dec->start, or 0 if its header is incomplete
+static size_t pending_frame_size(const FrameDecoder *dec) {
+    if (dec->end - dec->start < FRAME_HEADER_SIZE) return 0;
+
+    const unsigned char *h = (const unsigned char *)dec->buf + dec->start;
+    uint16_t flags = (uint16_t)(h[2] << 8 | h[3]);
+    uint16_t topic_len = (uint16_t)(h[4] << 8 | h[5]);
+    uint32_t payload_len = (uint32_t)h[8] << 24 | (uint32_t)h[9] << 16 | (uint32_t)h[10] << 8 | h[11];
+    if (topic_len > MAX_TOPIC_LEN || payload_len > max_payload(flags)) return 0;
+    return frame_size(topic_len, payload_len);
+}
+
+char *frame_decoder_space(FrameDecoder *dec, size_t *avail) {
+    // Slide unconsumed bytes to the front so the buffer never creeps
+    if (dec->start > 0) {
+        memmove(dec->buf, dec->buf + dec->start, dec->end - dec->start);
+        dec->end -= dec->start;
+        dec->start = 0;
+    }
+
+    size_t need = pending_frame_size(dec);
+    if (need < DECODER_INITIAL_SIZE) need = DECODER_INITIAL_SIZE;
+    if (dec->cap - dec->end == 0 || dec->cap < need) {
+        size_t cap = dec->cap ? dec->cap : DECODER_INITIAL_SIZE;
+        while (cap < need || cap - dec->end == 0) cap *= 2;
+        char *buf = decoder_alloc(cap);
+        if (!buf) {
+            *avail = 0;
+            return NULL;
+        }
+        if (dec->end) memcpy(buf, dec->buf, dec->end);
+        decoder_release(dec->buf);
+        dec->buf = buf;
+        dec->cap = cap;
+    }
+
+    *avail = dec->cap - dec->end;
+    return dec->buf + dec->end;
+}
+
+void frame_decoder_commit(FrameDecoder *dec, size_t n) {
+    dec->end += n;
+}
+
+void frame_decoder_shrink(FrameDecoder *dec) {
+    if (dec->start == dec->end) {
+        frame_decoder_free(dec);
+    }
+}
+
+void frame_decoder_wrap(FrameDecoder *dec, const char *buf, size_t len) {
+    dec->buf = (char *)buf;
+    dec->cap = len;
+    dec->start = 0;
+    dec->end = len;
+}
+
+int decode_frame(FrameDecoder *dec, Frame *frame) {
+    size_t available = dec->end - dec->start;
+    if (available < FRAME_HEADER_SIZE) return 0;
+
+    const unsigned char *h = (const unsigned char *)dec->buf + dec->start;
+    frame->version = h[0];
+    frame->opcode = h[1];
+    frame->flags = (uint16_t)(h[2] << 8 | h[3]);
+    frame->topic_len = (uint16_t)(h[4] << 8 | h[5]);
+    frame->payload_len = (uint32_t)h[8] << 24 | (uint32_t)h[9] << 16 | (uint32_t)h[10] << 8 | h[11];
+
+    if (frame->version != PROTO_VERSION) {
+        fprintf(stderr, "[ERROR] Unsupported protocol version %d.\n", frame->version);
+        return -1;
+    }
+    if (frame->topic_len > MAX_TOPIC_LEN || frame->payload_len > max_payload(frame->flags)) {
+        fprintf(stderr, "[ERROR] Oversized frame (topic %u bytes, payload %u bytes).\n",
+                frame->topic_len, frame->payload_len);
+        return -1;
+    }
+
+    size_t total = frame_size(frame->topic_len, frame->payload_len);
+    if (available < total) return 0;
+
+    const char *body = dec->buf + dec->start + FRAME_HEADER_SIZE;
+    memcpy(frame->topic, body, frame->topic_len);
+    frame->topic[frame->topic_len] = '\0';
+    if (memchr(frame->topic, '\0', frame->topic_len)) {
+        fprintf(stderr, "[ERROR] Topic contains a NUL byte.\n");
+        return -1;
+    }
+    frame->payload = body + frame->topic_len;
+
+    dec->start += total;
+    if (dec->start == dec->end) {
+        dec->start = 0;
+        dec->end = 0;
+    }
+    return 1;
+}
+
+size_t frame_size(size_t topic_len, size_t payload_len) {
+    return FRAME_HEADER_SIZE + topic_len + payload_len;
+}
+
+void encode_frame_header(char *out, uint8_t opcode, uint16_t flags, size_t topic_len, size_t payload_len) {
+    unsigned char *h = (unsigned char *)out;
+    h[0] = PROTO_VERSION;
+    h[1] = opcode;
+    h[2] = (unsigned char)(flags >> 8);
+    h[3] = (unsigned char)flags;
+    h[4] = (unsigned char)(topic_len >> 8);
+    h[5] = (unsigned char)topic_len;
+    h[6] = 0;
+    h[7] = 0;
+    h[8] = (unsigned char)(payload_len >> 24);
+    h[9] = (unsigned char)(payload_len >> 16);
+    h[10] = (unsigned char)(payload_len >> 8);
+    h[11] = (unsigned char)payload_len;
+}
+
+size_t encode_frame(char *out, size_t cap, uint8_t opcode, uint16_t flags,
+                    const char *topic, const void *payload, size_t payload_len) {
+    size_t topic_len = topic ? strlen(topic) : 0;
+    size_t total = frame_size(topic_len, payload_len);
+    if (topic_len > MAX_TOPIC_LEN || payload_len > MAX_PAYLOAD_SIZE || total > cap) return 0;
+
+    encode_frame_header(out, opcode, flags, topic_len, payload_len);
+    memcpy(out + FRAME_HEADER_SIZE, topic, topic_len);
+    if (payload_len) memcpy(out + FRAME_HEADER_SIZE + topic_len, payload, payload_len);
+    return total;
+}
+
+size_t message_size(size_t topic_len, size_t payload_len) {
+    return frame_size(topic_len, OFFSET_SIZE + payload_len);
+}
+
+size_t encode_message(char *out, size_t cap, const char *topic, size_t topic_len, unsigned long long offset,
+                      const void *payload, size_t payload_len) {
+    Payload p;
+    payload_init(&p, payload, payload_len);
+    p.offset = (long long)offset;
+    return encode_payload_frame(out, cap, OP_MESSAGE, 0, topic, topic_len, &p);
+}
+
+unsigned long long decode_offset(const char *payload) {
+    const unsigned char *p = (const unsigned char *)payload;
+    unsigned long long offset = 0;
+    for (int i = 0; i < OFFSET_SIZE; i++) offset = offset << 8 | p[i];
+    return offset;
+}
+
+// Big-endian, like every other field on the wire
+static void put_uint(char *out, unsigned long long value, int size) {
+    for (int i = size - 1; i >= 0; i--) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+void encode_ack(char *out, unsigned long long seq, uint32_t window) {
+    put_uint(out, seq, SEQ_SIZE);
+    put_uint(out + SEQ_SIZE, window, 4);
+}
+
+static uint32_t get_uint32(const char *in) {
+    const unsigned char *p = (const unsigned char *)in;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void decode_ack(const char *payload, unsigned long long *seq, uint32_t *window) {
+    *seq = decode_offset(payload);
+    *window = get_uint32(payload + SEQ_SIZE);
+}
+
+void encode_credit(char *out, uint32_t messages, uint32_t bytes) {
+    put_uint(out, messages, 4);
+    put_uint(out + 4, bytes, 4);
+}
+
+void decode_credit(const char *payload, uint32_t *messages, uint32_t *bytes) {
+    *messages = get_uint32(payload);
+    *bytes = get_uint32(payload + 4);
+}
+
+void payload_init(Payload *p, const void *data, size_t len) {
+    memset(p, 0, sizeof(*p));
+    p->offset = -1;
+    p->seq = -1;
+    p->data = data;
+    p->len = len;
+}
+
+static size_t prefix_size(const Payload *p) {
+    return (p->group ? 1 + p->group_len : 0) + (p->key ? 1 + p->key_len : 0) + (p->offset >= 0 ? OFFSET_SIZE : 0) +
+           (p->seq >= 0 ? SEQ_SIZE : 0);
+}
+
+size_t payload_frame_size(size_t topic_len, const Payload *p) {
+    return frame_size(topic_len, prefix_size(p) + p->len);
+}
+
+size_t encode_payload_frame(char *out, size_t cap, uint8_t opcode, uint16_t flags,
+                            const char *topic, size_t topic_len, const Payload *p) {
+    size_t total = payload_frame_size(topic_len, p);
+    if (topic_len > MAX_TOPIC_LEN || p->len > MAX_PAYLOAD_SIZE || total > cap ||
+        (p->group && p->group_len > MAX_GROUP_LEN) || (p->key && p->key_len > MAX_KEY_LEN)) {
+        return 0;
+    }
+
+    if (p->group) flags |= FLAG_GROUP;
+    if (p->key) flags |= FLAG_KEY;
+    if (p->offset >= 0) flags |= FLAG_OFFSET;
+    if (p->seq >= 0) flags |= FLAG_SEQ;
+    encode_frame_header(out, opcode, flags, topic_len, prefix_size(p) + p->len);
+    char *q = out + FRAME_HEADER_SIZE;
+    memcpy(q, topic, topic_len);
+    q += topic_len;
+    if (p->group) {
+        *q++ = (char)p->group_len;
+        memcpy(q, p->group, p->group_len);
+        q += p->group_len;
+    }
+    if (p->key) {
+        *q++ = (char)p->key_len;
+        memcpy(q, p->key, p->key_len);
+        q += p->key_len;
+    }
+    if (p->offset >= 0) {
+        put_uint(q, (unsigned long long)p->offset, OFFSET_SIZE);
+        q += OFFSET_SIZE;
+    }
+    if (p->seq >= 0) {
+        put_uint(q, (unsigned long long)p->seq, SEQ_SIZE);
+        q += SEQ_SIZE;
+    }
+    if (p->len) memcpy(q, p->data, p->len);
+    return total;
+}
+
+// Take a length-prefixed name off the front of the payload
+static int take_name(const char **data, size_t *len, const char **name, size_t *name_len) {
+    if (*len < 1 || *len - 1 < (unsigned char)**data) return -1;
+    *name_len = (unsigned char)**data;
+    *name = *data + 1;
+    *data += 1 + *name_len;
+    *len -= 1 + *name_len;
+    return 0;
+}
+
+int decode_payload(const Frame *frame, Payload *p) {
+    payload_init(p, frame->payload, frame->payload_len);
+    if ((frame->flags & FLAG_GROUP) && take_name(&p->data, &p->len, &p->group, &p->group_len) < 0) return -1;
+    if ((frame->flags & FLAG_KEY) && take_name(&p->data, &p->len, &p->key, &p->key_len) < 0) return -1;
+    if (frame->flags & FLAG_OFFSET) {
+        if (p->len < OFFSET_SIZE) return -1;
+        p->offset = (long long)decode_offset(p->data);
+        p->data += OFFSET_SIZE;
+        p->len -= OFFSET_SIZE;
+    }
+    if (frame->flags & FLAG_SEQ) {
+        if (p->len < SEQ_SIZE) return -1;
+        p->seq = (long long)decode_offset(p->data);
+        p->data += SEQ_SIZE;
+        p->len -= SEQ_SIZE;
+    }
+    return 0;
+}
+
+int parse_start_position(const char *text, size_t len, StartKind *kind, unsigned long long *value) {
+    char buf[32];
+    if (len == 0 || len >= sizeof(buf)) return -1;
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+    *value = 0;
+
+    if (strcmp(buf, "earliest") == 0) {
+        *kind = START_EARLIEST;
+        return 0;
+    }
+    if (strcmp(buf, "latest") == 0) {
+        *kind = START_LATEST;
+        return 0;
+    }
+
+    const char *digits = buf;
+    *kind = START_OFFSET;
+    if (*digits == '@') {
+        *kind = START_TIME;
+        digits++;
+    }
+    if (*digits < '0' || *digits > '9') return -1;
+    char *end;
+    errno = 0;
+    *value = strtoull(digits, &end, 10);
+    return (*end != '\0' || errno == ERANGE) ? -1 : 0;
+}
+
+int send_frame(int fd, uint8_t opcode, uint16_t flags, const char *topic,
+               const void *payload, size_t payload_len) {
+    size_t topic_len = topic ? strlen(topic) : 0;
+    if (topic_len > MAX_TOPIC_LEN || payload_len > MAX_PAYLOAD_SIZE) {
+        fprintf(stderr, "[ERROR] Topic or payload exceeds protocol limits.\n");
+        return -1;
+    }
+
+    char header[FRAME_HEADER_SIZE];
+    encode_frame_header(header, opcode, flags, topic_len, payload_len);
+
+    struct iovec iov[3] = {
+        { header, FRAME_HEADER_SIZE },
+        { (void *)topic, topic_len },
+        { (void *)payload, payload_len },
+    };
+    struct iovec *v = iov;
+    int iovcnt = 3;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    while (iovcnt > 0) {
+        msg.msg_iov = v;
+        msg.msg_iovlen = iovcnt;
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+
+        // Skip past whatever the kernel accepted
+        while (iovcnt > 0 && (size_t)sent >= v->iov_len) {
+            sent -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + sent;
+            v->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+int recv_frame(int fd, FrameDecoder *dec, Frame *frame) {
+    while (1) {
+        int rc = decode_frame(dec, frame);
+        if (rc != 0) return rc;
+
+        size_t avail;
+        char *space = frame_decoder_space(dec, &avail);
+        if (!space) return -1;
+
+        ssize_t bytes_received = recv(fd, space, avail, 0);
+        if (bytes_received == 0) return 0;
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        frame_decoder_commit(dec, bytes_received);
+    }
+}
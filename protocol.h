@@ -0,0 +1,188 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire format: every message is a 12-byte header followed by the topic
+// bytes and the payload bytes. Multi-byte fields are in network byte order.
+//
+//   0      1      2             4             6             8
+//   +------+------+-------------+-------------+-------------+---------------------------+
+//   | ver  |  op  |    flags    |  topic_len  |  reserved   |        payload_len        |
+//   +------+------+-------------+-------------+-------------+---------------------------+
+
+#define PROTO_VERSION 1
+#define FRAME_HEADER_SIZE 12
+#define MAX_TOPIC_LEN 255
+#define MAX_PAYLOAD_SIZE (16 * 1024 * 1024)
+
+// Opcodes
+#define OP_PUBLISH 1    // client -> broker: topic + payload
+#define OP_SUBSCRIBE 2  // client -> broker: topic, empty payload or a start position (below)
+#define OP_MESSAGE 3    // broker -> subscriber: topic + payload
+#define OP_UNSUBSCRIBE 4  // client -> broker: topic, empty payload
+#define OP_MEMBERS 5      // broker -> broker heartbeat: topic = sender "ip:port", payload = live members
+#define OP_LEAVE 6        // broker -> broker: topic = sender "ip:port", leaving the cluster
+#define OP_ACK 7          // subscriber -> broker: no topic, payload = an acknowledgement (below)
+#define OP_CREDIT 8       // subscriber -> broker: no topic, payload = a credit grant (below)
+#define OP_THROTTLE 9     // broker -> publisher or broker: topic, empty payload; hold publishes back (below)
+#define OP_RESUME 10      // broker -> publisher (no topic) or broker (topic): publishing may go on
+
+// Flags
+#define FLAG_FORWARDED 0x0001  // frame was relayed by another broker
+#define FLAG_REROUTED 0x0002   // forwarded again after topic ownership moved
+#define FLAG_OFFSET 0x0004     // MESSAGE payload starts with the message's offset
+#define FLAG_GROUP 0x0008      // payload starts with a consumer group name
+#define FLAG_KEY 0x0010        // payload starts with a partitioning key
+#define FLAG_SEQ 0x0020        // MESSAGE payload carries a delivery sequence number
+
+#define OFFSET_SIZE 8  // big-endian
+#define MAX_GROUP_LEN 255
+#define MAX_KEY_LEN 255
+#define SEQ_SIZE 8     // big-endian
+#define ACK_SIZE 12    // sequence number, then a 4-byte window
+#define CREDIT_SIZE 8  // 4-byte messages, then 4-byte bytes
+
+// Payload prefixes, in this order when several flags are set: the group
+// (a length byte, then the name), the key (same), the offset and the
+// sequence number. They are not counted against MAX_PAYLOAD_SIZE.
+//
+// A SUBSCRIBE or UNSUBSCRIBE with a group joins or leaves that consumer
+// group: each message on the topic goes to one member of every group. A
+// PUBLISH with a key sends all messages with that key to the same member
+// while the group's membership stays the same; others go round-robin.
+//
+// A subscriber that sends an ACK gets acknowledged delivery on that
+// connection: every MESSAGE then carries a sequence number, counting from
+// 1, and the broker resends whatever the subscriber has not acknowledged
+// within its redelivery timeout. An ACK acknowledges every message up to
+// its sequence number (0 for none) and sets how many messages may be
+// unacknowledged at once (0 keeps the current window). Messages queued
+// before the first one go out unnumbered.
+//
+// A subscriber that sends a CREDIT paces delivery on that connection: the
+// broker only sends while the subscriber has credit left, and holds the
+// rest on the connection's queue. Each CREDIT adds to the messages and
+// bytes (of whole frames) granted; either is only counted once some were
+// granted. A message may overdraw the byte credit.
+//
+// A broker stops reading from a publisher whose publish landed on a queue
+// past its high watermark, and tells it so with a THROTTLE naming the
+// topic. A RESUME follows once the queue drains below its low watermark.
+// Brokers answer a forwarded publish or relayed message that landed on
+// such a queue with a THROTTLE (FLAG_FORWARDED), and the sender then holds
+// back its own publishers on that topic. It lets go when a RESUME follows,
+// or when the THROTTLE is not repeated in time.
+typedef struct {
+    const char *group;  // NULL if absent
+    size_t group_len;
+    const char *key;    // NULL if absent
+    size_t key_len;
+    long long offset;   // -1 if absent
+    long long seq;      // -1 if absent
+    const char *data;   // what follows the prefixes
+    size_t len;
+} Payload;
+
+// Where a SUBSCRIBE starts. An empty payload subscribes to new messages
+// only; "earliest", "latest", an offset or "@" and a Unix time in
+// milliseconds first replay the topic's history from that point.
+typedef enum {
+    START_EARLIEST,
+    START_LATEST,
+    START_OFFSET,
+    START_TIME
+} StartKind;
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t topic_len;
+    uint32_t payload_len;
+    char topic[MAX_TOPIC_LEN + 1];  // NUL-terminated copy
+    const char *payload;            // points into the decoder buffer
+} Frame;
+
+// Streaming decoder for one connection. Bytes are appended as they arrive
+// and complete frames are pulled out one at a time, so frames split across
+// reads or batched into one read are both handled.
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t start;  // first unconsumed byte
+    size_t end;    // one past the last received byte
+} FrameDecoder;
+
+void frame_decoder_init(FrameDecoder *dec);
+void frame_decoder_free(FrameDecoder *dec);
+
+// Return a writable region of at least one byte for the next recv().
+char *frame_decoder_space(FrameDecoder *dec, size_t *avail);
+void frame_decoder_commit(FrameDecoder *dec, size_t n);
+
+// Release the buffer if it holds no partial frame (for idle connections).
+void frame_decoder_shrink(FrameDecoder *dec);
+
+// Where every decoder's buffers come from: malloc and free unless a
+// program sets its own pool before any decoder is used.
+void frame_decoder_set_allocator(void *(*alloc)(size_t), void (*release)(void *));
+
+// Decode the frames of an already encoded buffer, such as a queued one.
+// The buffer stays the caller's: only decode_frame may be used on dec.
+void frame_decoder_wrap(FrameDecoder *dec, const char *buf, size_t len);
+
+// Returns 1 and fills *frame when a complete frame is available, 0 when more
+// bytes are needed and -1 on a malformed frame. frame->payload stays valid
+// until the next call to frame_decoder_space().
+int decode_frame(FrameDecoder *dec, Frame *frame);
+
+size_t frame_size(size_t topic_len, size_t payload_len);
+// The largest payload_len a frame with these flags may carry: the data plus
+// the prefixes the flags announce
+uint32_t max_payload(uint16_t flags);
+void encode_frame_header(char *out, uint8_t opcode, uint16_t flags, size_t topic_len, size_t payload_len);
+
+// Encode a whole frame into out; returns its size or 0 if it does not fit.
+size_t encode_frame(char *out, size_t cap, uint8_t opcode, uint16_t flags,
+                    const char *topic, const void *payload, size_t payload_len);
+
+// Encode a MESSAGE carrying its offset (FLAG_OFFSET)
+size_t message_size(size_t topic_len, size_t payload_len);
+size_t encode_message(char *out, size_t cap, const char *topic, size_t topic_len, unsigned long long offset,
+                      const void *payload, size_t payload_len);
+unsigned long long decode_offset(const char *payload);
+
+// A payload with no prefixes
+void payload_init(Payload *p, const void *data, size_t len);
+
+// Encode a frame whose payload has prefixes; flags gets their bits added
+size_t payload_frame_size(size_t topic_len, const Payload *p);
+size_t encode_payload_frame(char *out, size_t cap, uint8_t opcode, uint16_t flags,
+                            const char *topic, size_t topic_len, const Payload *p);
+
+// Encode and decode an OP_ACK payload of ACK_SIZE bytes
+void encode_ack(char *out, unsigned long long seq, uint32_t window);
+void decode_ack(const char *payload, unsigned long long *seq, uint32_t *window);
+
+// Same for an OP_CREDIT payload of CREDIT_SIZE bytes
+void encode_credit(char *out, uint32_t messages, uint32_t bytes);
+void decode_credit(const char *payload, uint32_t *messages, uint32_t *bytes);
+
+// Split a frame's payload into its prefixes and data. Returns 0 on success
+// and -1 if the prefixes its flags announce are malformed.
+int decode_payload(const Frame *frame, Payload *p);
+
+// Parse a SUBSCRIBE start position. Returns 0 on success and -1 if it is malformed.
+int parse_start_position(const char *text, size_t len, StartKind *kind, unsigned long long *value);
+
+// Write a whole frame, waiting for the socket if it is non-blocking.
+int send_frame(int fd, uint8_t opcode, uint16_t flags, const char *topic,
+               const void *payload, size_t payload_len);
+
+// Blocking read of the next frame from fd. Returns 1 on success, 0 when the
+// peer closed the connection and -1 on error.
+int recv_frame(int fd, FrameDecoder *dec, Frame *frame);
+
+#endif
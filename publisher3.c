@@ -1,122 +1,130 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-
-#define BUFFER_SIZE 1024
-#define MAX_BROKERS 5
-
-typedef struct {
-    char ip[50];
-    int port;
-} Broker;
-
-Broker brokers[MAX_BROKERS];
-int broker_count = 0;
-
-// Function to calculate the responsible broker for a topic
-int get_broker_for_topic(const char *topic_name) {
-    unsigned long hash = 0;
-    for (int i = 0; topic_name[i] != '\0'; i++) {
-        hash = (hash * 31 + topic_name[i]) % broker_count;
-    }
-    return hash % broker_count;
-}
-
-// Add a broker to the list
-void add_broker(const char *ip, int port) {
-    if (broker_count >= MAX_BROKERS) {
-        fprintf(stderr, "[ERROR] Maximum number of brokers reached.\n");
-        return;
-    }
-    strncpy(brokers[broker_count].ip, ip, sizeof(brokers[broker_count].ip) - 1);
-    brokers[broker_count].port = port;
-    printf("[DEBUG] Broker added: %s:%d\n", ip, port);
-    broker_count++;
-}
-
-int connect_to_broker(int broker_id) {
-    int sock;
-    struct sockaddr_in broker_address;
-
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("[ERROR] Socket creation error");
-        return -1;
-    }
-
-    broker_address.sin_family = AF_INET;
-    broker_address.sin_port = htons(brokers[broker_id].port);
-    if (inet_pton(AF_INET, brokers[broker_id].ip, &broker_address.sin_addr) <= 0) {
-        perror("[ERROR] Invalid broker IP address");
-        close(sock);
-        return -1;
-    }
-
-    if (connect(sock, (struct sockaddr *)&broker_address, sizeof(broker_address)) < 0) {
-        fprintf(stderr, "[ERROR] Connection failed to broker %s:%d\n", brokers[broker_id].ip, brokers[broker_id].port);
-        close(sock);
-        return -1;
-    }
-
-    return sock;
-}
-
-void publish_messages() {
-    char topic[BUFFER_SIZE];
-    char message[BUFFER_SIZE];
-    char buffer[BUFFER_SIZE];
-
-    while (1) {
-        printf("\nEnter topic to publish (or 'exit' to quit): ");
-        fgets(topic, sizeof(topic), stdin);
-        topic[strcspn(topic, "\n")] = '\0'; // Remove newline character
-
-        if (strcmp(topic, "exit") == 0) {
-            break;
-        }
-
-        printf("Enter message: ");
-        fgets(message, sizeof(message), stdin);
-        message[strcspn(message, "\n")] = '\0'; // Remove newline character
-
-        // Calculate required buffer size
-        size_t required_size = strlen("PUBLISH ") + strlen(topic) + strlen(message) + 1;
-
-        if (required_size > sizeof(buffer)) {
-            fprintf(stderr, "[ERROR] Topic and message length exceed allowed size.\n");
-            continue;
-        }
-
-        int broker_id = get_broker_for_topic(topic);
-        int sock = connect_to_broker(broker_id);
-        if (sock < 0) continue;
-
-        snprintf(buffer, sizeof(buffer), "PUBLISH %s %s", topic, message);
-        send(sock, buffer, strlen(buffer), 0);
-
-        printf("[DEBUG] Published: Topic='%s', Message='%s' (via Broker %d)\n", topic, message, broker_id);
-
-        close(sock);
-    }
-}
-
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <broker_ip:port>...\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    for (int i = 1; i < argc; i++) {
-        char *colon = strchr(argv[i], ':');
-        if (colon) {
-            *colon = '\0';
-            add_broker(argv[i], atoi(colon + 1));
-        }
-    }
-
-    printf("[DEBUG] Publisher started. Type 'exit' to quit.\n");
-    publish_messages();
-
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "pubsub.h"
+#include "partition.h"
+
+#define BUFFER_SIZE 1024
+
+// Read topic/message line pairs from stdin; "topic KEY key" publishes with
+// a key. Prompts and per-message logging are skipped when stdin is not a
+// terminal, so a file or pipe can be published at full speed. A broker
+// that pushes back makes us wait, or with fail_fast drop the message.
+void publish_messages(PubSubClient *client, int fail_fast) {
+    char topic[BUFFER_SIZE];
+    char message[BUFFER_SIZE];
+    int interactive = isatty(STDIN_FILENO);
+    unsigned long published = 0;
+    unsigned long refused = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (1) {
+        if (interactive) printf("\nEnter topic [KEY key] to publish (or 'exit' to quit): ");
+        if (!fgets(topic, sizeof(topic), stdin)) break;
+        topic[strcspn(topic, "\n")] = '\0'; // Remove newline character
+
+        if (strcmp(topic, "exit") == 0) {
+            break;
+        }
+
+        if (interactive) printf("Enter message: ");
+        if (!fgets(message, sizeof(message), stdin)) break;
+        message[strcspn(message, "\n")] = '\0'; // Remove newline character
+
+        char *key = strstr(topic, " KEY ");
+        if (key) {
+            *key = '\0';
+            key += strlen(" KEY ");
+        }
+
+        if (strlen(topic) == 0 || strlen(topic) > MAX_TOPIC_LEN) {
+            fprintf(stderr, "[ERROR] Topic must be 1 to %d bytes long.\n", MAX_TOPIC_LEN);
+            continue;
+        }
+
+        // A broker that falls behind pushes back instead of growing our buffers
+        int rc;
+        while ((rc = key ? pubsub_publish_key(client, topic, key, strlen(key), message, strlen(message))
+                         : pubsub_publish(client, topic, message, strlen(message))) < 0 && errno == EAGAIN) {
+            if (fail_fast) break;
+            usleep(100);
+        }
+        if (rc < 0) {
+            if (errno == EAGAIN) {
+                refused++;
+                if (interactive) fprintf(stderr, "[ERROR] The broker is holding back topic '%s'.\n", topic);
+            }
+            continue;
+        }
+        published++;
+
+        if (interactive) {
+            printf("[DEBUG] Published: Topic='%s', Message='%s'\n", topic, message);
+        }
+    }
+
+    pubsub_flush(client);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("[DEBUG] Published %lu message(s) in %.2fs (%.0f msgs/s).\n",
+           published, secs, secs > 0 ? published / secs : 0.0);
+    if (refused > 0) printf("[DEBUG] Dropped %lu message(s) the brokers held back.\n", refused);
+}
+
+int main(int argc, char *argv[]) {
+    PubSubOptions opts;
+    pubsub_default_options(&opts);
+    PartitionMap partitions = { .count = 0 };
+    int fail_fast = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "v:b:s:l:c:p:f")) != -1) {
+        if (opt == 'v') {
+            opts.vnodes = atoi(optarg);
+        } else if (opt == 'b') {
+            opts.batch_count = strtoul(optarg, NULL, 10);
+        } else if (opt == 's') {
+            opts.batch_bytes = strtoul(optarg, NULL, 10);
+        } else if (opt == 'l') {
+            opts.linger_us = atol(optarg);
+        } else if (opt == 'c') {
+            opts.connections = atoi(optarg);
+        } else if (opt == 'p') {
+            if (partition_map_parse(&partitions, optarg) < 0) exit(EXIT_FAILURE);
+        } else if (opt == 'f') {
+            fail_fast = 1;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    // The broker list, -v and -p must match what the brokers were started with
+    if (argc - optind < 1) {
+        fprintf(stderr, "Usage: %s [-v vnodes] [-b batch_messages] [-s batch_bytes] [-l linger_us]"
+                        " [-c connections] [-p topic=partitions]... [-f] <broker_ip:port>...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    PubSubClient *client = pubsub_connect((const char *const *)&argv[optind], argc - optind, &opts);
+    if (!client || pubsub_start(client) < 0) {
+        fprintf(stderr, "[ERROR] Could not start the publisher.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < partitions.count; i++) {
+        pubsub_partition(client, partitions.topics[i].name, partitions.topics[i].partitions);
+    }
+
+    printf("[DEBUG] Publisher started. Type 'exit' to quit.\n");
+    publish_messages(client, fail_fast);
+    pubsub_close(client);
+
+    return 0;
+}
@@ -0,0 +1,788 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+
+#include "pubsub.h"
+#include "protocol.h"
+#include "hashring.h"
+#include "batch.h"
+#include "topic_table.h"
+#include "topic_trie.h"
+#include "partition.h"
+
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS 5000
+#define CONNECT_TIMEOUT_MS 1000  // pubsub_connect waits this long for the brokers
+#define CLOSE_TIMEOUT_MS 1000    // pubsub_close waits this long for pending writes
+#define MAX_LINKS (PUBSUB_MAX_BROKERS * PUBSUB_MAX_CONNECTIONS)
+
+// One persistent broker connection. out is shared with publishing threads;
+// everything else belongs to whichever thread runs pubsub_poll.
+typedef struct {
+    char ip[50];
+    int port;
+    Batch out;           // owns fd once the connect completed
+    int fd;              // -1 while down
+    int connecting;      // non-blocking connect in flight
+    int backoff_ms;
+    long long retry_at_ms;
+    FrameDecoder decoder;
+    unsigned long long last_seq;  // last message sequence number seen on this connection
+    int ack_due;                  // messages have arrived since the last acknowledgement
+    size_t used_messages;         // credit spent since the last grant
+    size_t used_bytes;
+    int throttled;                // the broker holds our publishes back (read by publishing threads)
+} ClientLink;
+
+typedef struct {
+    MessageCallback callback;
+    void *arg;
+    char from[32];                   // start position to send, empty for new messages only
+    char group[MAX_GROUP_LEN + 1];   // consumer group, empty for a plain subscription
+    int has_offset;                  // the broker numbers this topic's messages
+    unsigned long long next_offset;  // where to resume after a reconnect
+    size_t topic_len;                // of the topic callbacks get, without a partition suffix
+    int link;                        // where it was sent, and so where its messages arrive
+} Subscription;
+
+// A callback owed a message, collected under sub_lock and called outside it
+typedef struct {
+    MessageCallback callback;
+    void *arg;
+    size_t topic_len;
+} Delivery;
+
+struct PubSubClient {
+    ClientLink *links;  // connections per broker, broker by broker
+    int link_count;
+    int connections;
+    int ack_window;
+    unsigned credit_messages;
+    unsigned credit_bytes;
+    HashRing ring;
+    long linger_us;
+    pthread_mutex_t sub_lock;
+    TopicTable subscriptions;  // each entry holds a single Subscription
+    TopicTrie patterns;        // wildcard subscriptions -> their subscriptions entry
+    TrieMatches pattern_matches;
+    Delivery *deliveries;      // poll thread only
+    size_t delivery_cap;
+    int wake_fd;               // interrupts pubsub_poll when a batch starts
+    pthread_t thread;
+    int running;
+    int stopping;
+    PartitionMap partitions;  // set up before use, read-only after
+    unsigned next_partition;  // round-robin for keyless publishes
+};
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void pubsub_default_options(PubSubOptions *opts) {
+    opts->vnodes = DEFAULT_VNODES;
+    opts->batch_count = DEFAULT_BATCH_COUNT;
+    opts->batch_bytes = DEFAULT_BATCH_BYTES;
+    opts->linger_us = DEFAULT_LINGER_US;
+    opts->connections = 1;
+    opts->ack_window = 0;
+    opts->credit_messages = 0;
+    opts->credit_bytes = 0;
+}
+
+// Same placement the brokers use: "ip:port" keys on a consistent-hash ring.
+// Each topic then sticks to one of the owner's connections.
+static int owner_of(PubSubClient *client, const char *topic) {
+    size_t len = strlen(topic);
+    int broker = hashring_lookup(&client->ring, topic, len);
+    return broker * client->connections + (int)(topic_hash(topic, len) % (uint64_t)client->connections);
+}
+
+static void wake_poller(PubSubClient *client) {
+    uint64_t one = 1;
+    if (write(client->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("[ERROR] eventfd write failed");
+    }
+}
+
+// Start a non-blocking connect; pubsub_poll completes it
+static void start_connect(ClientLink *link) {
+    struct sockaddr_in broker_address;
+    memset(&broker_address, 0, sizeof(broker_address));
+    broker_address.sin_family = AF_INET;
+    broker_address.sin_port = htons(link->port);
+    if (inet_pton(AF_INET, link->ip, &broker_address.sin_addr) <= 0) {
+        fprintf(stderr, "[ERROR] Invalid broker IP address %s.\n", link->ip);
+        link->retry_at_ms = now_ms() + RECONNECT_MAX_MS;
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("[ERROR] Socket creation error");
+        link->retry_at_ms = now_ms() + link->backoff_ms;
+        return;
+    }
+
+    // Messages are already coalesced by the batch, so send them right away
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(sock, (struct sockaddr *)&broker_address, sizeof(broker_address)) < 0 && errno != EINPROGRESS) {
+        close(sock);
+        link->retry_at_ms = now_ms() + link->backoff_ms;
+        return;
+    }
+    link->fd = sock;
+    link->connecting = 1;
+}
+
+static void link_down(ClientLink *link) {
+    if (!link->connecting) {
+        fprintf(stderr, "[ERROR] Lost connection to broker %s:%d.\n", link->ip, link->port);
+        batch_attach(&link->out, -1);
+    } else {
+        close(link->fd);
+    }
+    link->fd = -1;
+    link->connecting = 0;
+    __atomic_store_n(&link->throttled, 0, __ATOMIC_RELAXED);
+    frame_decoder_free(&link->decoder);
+
+    link->retry_at_ms = now_ms() + link->backoff_ms;
+    link->backoff_ms *= 2;
+    if (link->backoff_ms > RECONNECT_MAX_MS) link->backoff_ms = RECONNECT_MAX_MS;
+}
+
+// Queue a SUBSCRIBE or UNSUBSCRIBE for a subscription. Once messages carry
+// offsets, a plain subscription resumes right after the last one received.
+// Caller holds sub_lock.
+static int queue_subscription(PubSubClient *client, uint8_t opcode, const char *topic, const Subscription *sub) {
+    char from[32];
+    Payload p;
+    payload_init(&p, NULL, 0);
+    if (sub->group[0]) {
+        p.group = sub->group;
+        p.group_len = strlen(sub->group);
+    } else if (opcode == OP_SUBSCRIBE) {
+        p.data = from;
+        if (sub->has_offset) p.len = snprintf(from, sizeof(from), "%llu", sub->next_offset);
+        else p.len = snprintf(from, sizeof(from), "%s", sub->from);
+    }
+    return batch_payload_frame(&client->links[owner_of(client, topic)].out, opcode, topic, &p);
+}
+
+// The broker forgot our subscriptions with the old connection
+static void resubscribe(PubSubClient *client, int link_id) {
+    pthread_mutex_lock(&client->sub_lock);
+    for (size_t i = 0; i < client->subscriptions.cap; i++) {
+        TopicEntry *entry = client->subscriptions.slots[i];
+        if (entry && owner_of(client, entry->name) == link_id) {
+            queue_subscription(client, OP_SUBSCRIBE, entry->name, entry->subscribers[0]);
+        }
+    }
+    pthread_mutex_unlock(&client->sub_lock);
+}
+
+static void finish_connect(PubSubClient *client, int link_id) {
+    ClientLink *link = &client->links[link_id];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        link_down(link);
+        return;
+    }
+
+    link->connecting = 0;
+    link->backoff_ms = RECONNECT_MIN_MS;
+    if (client->ack_window > 0) {
+        // Asked for before any SUBSCRIBE, as the broker requires
+        char ack[ACK_SIZE];
+        encode_ack(ack, 0, (uint32_t)client->ack_window);
+        batch_frame(&link->out, OP_ACK, "", ack, sizeof(ack));
+        link->last_seq = 0;
+        link->ack_due = 0;
+    }
+    if (client->credit_messages > 0 || client->credit_bytes > 0) {
+        // A new connection starts without credit
+        char credit[CREDIT_SIZE];
+        encode_credit(credit, client->credit_messages, client->credit_bytes);
+        batch_frame(&link->out, OP_CREDIT, "", credit, sizeof(credit));
+        link->used_messages = 0;
+        link->used_bytes = 0;
+    }
+    resubscribe(client, link_id);
+    batch_attach(&link->out, link->fd);
+    batch_flush(&link->out);
+}
+
+// Split "ip:port" into a link; returns -1 if malformed
+static int parse_broker(ClientLink *link, const char *addr) {
+    const char *colon = strrchr(addr, ':');
+    if (!colon || colon == addr || (size_t)(colon - addr) >= sizeof(link->ip)) return -1;
+    memcpy(link->ip, addr, colon - addr);
+    link->ip[colon - addr] = '\0';
+    link->port = atoi(colon + 1);
+    return link->port > 0 && link->port <= 65535 ? 0 : -1;
+}
+
+PubSubClient *pubsub_connect(const char *const *brokers, int count, const PubSubOptions *opts) {
+    PubSubOptions defaults;
+    if (!opts) {
+        pubsub_default_options(&defaults);
+        opts = &defaults;
+    }
+    if (count < 1 || count > PUBSUB_MAX_BROKERS || opts->vnodes < 1 ||
+        opts->batch_count < 1 || opts->batch_bytes < 1 || opts->linger_us < 0 ||
+        opts->connections < 1 || opts->connections > PUBSUB_MAX_CONNECTIONS || opts->ack_window < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    PubSubClient *client = calloc(1, sizeof(PubSubClient));
+    if (!client) return NULL;
+    client->linger_us = opts->linger_us;
+    client->connections = opts->connections;
+    client->ack_window = opts->ack_window;
+    client->credit_messages = opts->credit_messages;
+    client->credit_bytes = opts->credit_bytes;
+    client->wake_fd = -1;
+    pthread_mutex_init(&client->sub_lock, NULL);
+
+    char keys[PUBSUB_MAX_BROKERS][64];
+    const char *key_ptrs[PUBSUB_MAX_BROKERS];
+    int links = count * opts->connections;
+    client->links = calloc(links, sizeof(ClientLink));
+    int failed = !client->links || topic_table_init(&client->subscriptions) < 0 ||
+                 topic_trie_init(&client->patterns) < 0;
+    for (int i = 0; i < links && !failed; i++) {
+        ClientLink *link = &client->links[i];
+        int broker = i / opts->connections;
+        if (parse_broker(link, brokers[broker]) < 0) {
+            fprintf(stderr, "[ERROR] Invalid broker address '%s'.\n", brokers[broker]);
+            errno = EINVAL;
+            failed = 1;
+            break;
+        }
+        snprintf(keys[broker], sizeof(keys[broker]), "%.49s:%d", link->ip, link->port);
+        key_ptrs[broker] = keys[broker];
+
+        link->fd = -1;
+        link->backoff_ms = RECONNECT_MIN_MS;
+        frame_decoder_init(&link->decoder);
+        if (batch_init(&link->out, opts->batch_count, opts->batch_bytes, opts->linger_us) < 0) {
+            failed = 1;
+            break;
+        }
+        client->link_count = i + 1;
+    }
+    if (failed || hashring_build(&client->ring, key_ptrs, count, opts->vnodes) < 0 ||
+        (client->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        pubsub_close(client);
+        return NULL;
+    }
+
+    // Connect to every broker in parallel and give them a moment to answer
+    for (int i = 0; i < links; i++) {
+        start_connect(&client->links[i]);
+    }
+    long long deadline = now_ms() + CONNECT_TIMEOUT_MS;
+    while (1) {
+        struct pollfd pfds[MAX_LINKS];
+        int ids[MAX_LINKS];
+        int n = 0;
+        for (int i = 0; i < links; i++) {
+            if (!client->links[i].connecting) continue;
+            pfds[n].fd = client->links[i].fd;
+            pfds[n].events = POLLOUT;
+            ids[n++] = i;
+        }
+        int wait = (int)(deadline - now_ms());
+        if (n == 0 || wait <= 0) break;
+        if (poll(pfds, n, wait) < 0 && errno != EINTR) break;
+        for (int j = 0; j < n; j++) {
+            if (pfds[j].revents) finish_connect(client, ids[j]);
+        }
+    }
+    for (int i = 0; i < links; i++) {
+        ClientLink *link = &client->links[i];
+        if (link->fd < 0 || link->connecting) {
+            fprintf(stderr, "[ERROR] Connection failed to broker %s:%d, will retry.\n", link->ip, link->port);
+        }
+    }
+
+    return client;
+}
+
+int pubsub_partition(PubSubClient *client, const char *topic, int partitions) {
+    if (partition_map_add(&client->partitions, topic, strlen(topic), partitions) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+// Where a publish goes: the topic itself, or the partition its key (or
+// the round-robin) picks, written to buf
+static const char *publish_topic(PubSubClient *client, const char *topic, const char *key, size_t key_len,
+                                 char *buf) {
+    size_t len = strlen(topic);
+    int partitions = partition_count(&client->partitions, topic, len);
+    if (partitions == 0) return topic;
+    int partition = key ? partition_for_key(key, key_len, partitions)
+                        : (int)(__atomic_fetch_add(&client->next_partition, 1, __ATOMIC_RELAXED) % partitions);
+    partition_topic(buf, topic, len, partition);
+    return buf;
+}
+
+// The connection a publish goes out on, or NULL with errno set to EAGAIN
+// while its broker holds publishes back
+static ClientLink *publish_link(PubSubClient *client, const char *topic) {
+    ClientLink *link = &client->links[owner_of(client, topic)];
+    if (__atomic_load_n(&link->throttled, __ATOMIC_RELAXED)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    return link;
+}
+
+int pubsub_publish(PubSubClient *client, const char *topic, const void *buf, size_t len) {
+    char name[MAX_TOPIC_LEN + 1];
+    topic = publish_topic(client, topic, NULL, 0, name);
+    ClientLink *link = publish_link(client, topic);
+    if (!link) return -1;
+    int rc = batch_publish(&link->out, topic, buf, len);
+    if (rc > 0) {
+        // The poller may be asleep with no batch pending or without POLLOUT
+        wake_poller(client);
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+int pubsub_publish_key(PubSubClient *client, const char *topic, const void *key, size_t key_len,
+                       const void *buf, size_t len) {
+    char name[MAX_TOPIC_LEN + 1];
+    topic = publish_topic(client, topic, key, key_len, name);
+    Payload p;
+    payload_init(&p, buf, len);
+    p.key = key;
+    p.key_len = key_len;
+    ClientLink *link = publish_link(client, topic);
+    if (!link) return -1;
+    int rc = batch_payload_frame(&link->out, OP_PUBLISH, topic, &p);
+    if (rc > 0) wake_poller(client);
+    return rc < 0 ? -1 : 0;
+}
+
+// Subscribe to one topic or partition; callbacks get the first topic_len
+// bytes of its name. Caller holds sub_lock. Returns -1 when out of memory.
+static int subscribe_topic(PubSubClient *client, const char *name, size_t topic_len, const char *from,
+                           const char *group, MessageCallback callback, void *arg) {
+    size_t len = strlen(name);
+    int pattern = topic_is_pattern(name, len);
+    TopicEntry *entry = topic_table_get_or_create(&client->subscriptions, name, len, topic_hash(name, len));
+    Subscription *sub = NULL;
+    if (entry && entry->sub_count == 0) {
+        sub = malloc(sizeof(Subscription));
+        if (!sub || topic_add_subscriber(entry, sub) < 0 ||
+            (pattern && topic_trie_insert(&client->patterns, name, len, entry) < 0)) {
+            free(sub);
+            sub = NULL;
+            topic_table_remove(&client->subscriptions, entry);
+        }
+    } else if (entry) {
+        sub = entry->subscribers[0];
+        // Switching between groups, or to or from one, leaves the old one
+        if (strcmp(sub->group, group ? group : "") != 0) queue_subscription(client, OP_UNSUBSCRIBE, name, sub);
+    }
+    if (!sub) return -1;
+    sub->callback = callback;
+    sub->arg = arg;
+    snprintf(sub->from, sizeof(sub->from), "%s", from ? from : "");
+    snprintf(sub->group, sizeof(sub->group), "%s", group ? group : "");
+    sub->has_offset = 0;
+    sub->topic_len = topic_len;
+    sub->link = owner_of(client, name);
+
+    // Queued under the lock so it cannot overtake an UNSUBSCRIBE
+    return queue_subscription(client, OP_SUBSCRIBE, name, sub);
+}
+
+static int subscribe(PubSubClient *client, const char *topic, const char *from, const char *group,
+                     MessageCallback callback, void *arg) {
+    size_t len = strlen(topic);
+    StartKind kind;
+    unsigned long long value;
+    if (len == 0 || len > MAX_TOPIC_LEN || !callback ||
+        (from && parse_start_position(from, strlen(from), &kind, &value) < 0) ||
+        (group && (group[0] == '\0' || strlen(group) > MAX_GROUP_LEN))) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Patterns get new messages only, and no groups
+    if (topic_is_pattern(topic, len) && (from || group || !topic_pattern_valid(topic, len))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // A partitioned topic is a subscription to each of its partitions
+    char name[MAX_TOPIC_LEN + 1];
+    int partitions = partition_count(&client->partitions, topic, len);
+    int queued = 0;
+    pthread_mutex_lock(&client->sub_lock);
+    for (int i = 0; i < (partitions ? partitions : 1); i++) {
+        if (partitions) partition_topic(name, topic, len, i);
+        int rc = subscribe_topic(client, partitions ? name : topic, len, from, group, callback, arg);
+        if (rc < 0) {
+            pthread_mutex_unlock(&client->sub_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        queued |= rc > 0;
+    }
+    pthread_mutex_unlock(&client->sub_lock);
+
+    if (queued) wake_poller(client);
+    return 0;
+}
+
+int pubsub_subscribe(PubSubClient *client, const char *topic, MessageCallback callback, void *arg) {
+    return subscribe(client, topic, NULL, NULL, callback, arg);
+}
+
+int pubsub_subscribe_from(PubSubClient *client, const char *topic, const char *from,
+                          MessageCallback callback, void *arg) {
+    return subscribe(client, topic, from, NULL, callback, arg);
+}
+
+int pubsub_subscribe_group(PubSubClient *client, const char *topic, const char *group,
+                           MessageCallback callback, void *arg) {
+    return subscribe(client, topic, NULL, group, callback, arg);
+}
+
+// Caller holds sub_lock. Returns what queuing the UNSUBSCRIBE returned.
+static int unsubscribe_topic(PubSubClient *client, const char *name) {
+    size_t len = strlen(name);
+    TopicEntry *entry = topic_table_find(&client->subscriptions, name, len, topic_hash(name, len));
+    if (!entry) return 0;
+
+    Subscription *sub = entry->subscribers[0];
+    int rc = queue_subscription(client, OP_UNSUBSCRIBE, name, sub);
+    topic_trie_remove(&client->patterns, name, len);
+    topic_remove_subscriber(entry, sub);
+    free(sub);
+    topic_table_remove(&client->subscriptions, entry);
+    return rc;
+}
+
+int pubsub_unsubscribe(PubSubClient *client, const char *topic) {
+    char name[MAX_TOPIC_LEN + 1];
+    size_t len = strlen(topic);
+    int partitions = partition_count(&client->partitions, topic, len);
+    int queued = 0;
+    pthread_mutex_lock(&client->sub_lock);
+    for (int i = 0; i < (partitions ? partitions : 1); i++) {
+        if (partitions) partition_topic(name, topic, len, i);
+        queued |= unsubscribe_topic(client, partitions ? name : topic) > 0;
+    }
+    pthread_mutex_unlock(&client->sub_lock);
+
+    if (queued) wake_poller(client);
+    return 0;
+}
+
+int pubsub_flush(PubSubClient *client) {
+    int result = 0;
+    for (int i = 0; i < client->link_count; i++) {
+        int rc = batch_flush(&client->links[i].out);
+        if (rc < 0) result = -1;
+        else if (rc == 0 && result == 0) result = 1;
+    }
+    if (result > 0 && client->running) wake_poller(client);  // to wait for POLLOUT
+    return result;
+}
+
+// Owe sub's callback the message being dispatched. Caller holds sub_lock.
+static size_t add_delivery(PubSubClient *client, size_t n, const Subscription *sub) {
+    if (n == client->delivery_cap) {
+        size_t cap = client->delivery_cap ? client->delivery_cap * 2 : 8;
+        Delivery *deliveries = realloc(client->deliveries, cap * sizeof(Delivery));
+        if (!deliveries) return n;
+        client->deliveries = deliveries;
+        client->delivery_cap = cap;
+    }
+    client->deliveries[n] = (Delivery){ sub->callback, sub->arg, sub->topic_len };
+    return n + 1;
+}
+
+// Hand a message to its topic's subscription and to every matching
+// pattern sent over the same link: the broker sends one copy per link, so
+// each of them sees every message once. The callbacks are looked up under
+// the lock and called outside it, so they may (un)subscribe themselves.
+static void dispatch(PubSubClient *client, int link_id, Frame *frame, const Payload *msg) {
+    size_t n = 0;
+    pthread_mutex_lock(&client->sub_lock);
+    TopicEntry *entry = topic_table_find(&client->subscriptions, frame->topic, frame->topic_len,
+                                         topic_hash(frame->topic, frame->topic_len));
+    if (entry && ((Subscription *)entry->subscribers[0])->link == link_id) {
+        Subscription *sub = entry->subscribers[0];
+        n = add_delivery(client, n, sub);
+        if (msg->offset >= 0) {
+            sub->has_offset = 1;
+            sub->next_offset = msg->offset + 1;
+        }
+    }
+    if (client->patterns.count > 0) {
+        size_t count;
+        void *const *matches = topic_trie_match(&client->patterns, frame->topic, frame->topic_len,
+                                                &client->pattern_matches, &count);
+        for (size_t i = 0; i < count; i++) {
+            Subscription *sub = ((TopicEntry *)matches[i])->subscribers[0];
+            if (sub->link == link_id) n = add_delivery(client, n, sub);
+        }
+    }
+    pthread_mutex_unlock(&client->sub_lock);
+
+    char name[MAX_TOPIC_LEN + 1];
+    for (size_t i = 0; i < n; i++) {
+        Delivery *d = &client->deliveries[i];
+        const char *topic = frame->topic;
+        // Callbacks see a partition's topic, not the partition
+        if (d->topic_len < frame->topic_len) {
+            memcpy(name, frame->topic, d->topic_len);
+            name[d->topic_len] = '\0';
+            topic = name;
+        }
+        d->callback(topic, msg->data, msg->len, d->arg);
+    }
+}
+
+// Whether a message is new on its connection, rather than a redelivery of
+// one already dispatched
+static int accept_seq(ClientLink *link, const Payload *msg) {
+    if (msg->seq < 0) return 1;
+    link->ack_due = 1;
+    if ((unsigned long long)msg->seq <= link->last_seq) return 0;
+    link->last_seq = msg->seq;
+    return 1;
+}
+
+// Hand back the credit the dispatched messages used, once they used half
+// of it, so the broker can keep sending without a grant per message
+static void grant_credit(PubSubClient *client, ClientLink *link) {
+    int due = (client->credit_messages > 0 && link->used_messages * 2 >= client->credit_messages) ||
+              (client->credit_bytes > 0 && link->used_bytes * 2 >= client->credit_bytes);
+    if (!due || link->fd < 0) return;
+
+    uint32_t messages = client->credit_messages > 0 ? (uint32_t)link->used_messages : 0;
+    uint32_t bytes = 0;
+    if (client->credit_bytes > 0) bytes = link->used_bytes < UINT32_MAX ? (uint32_t)link->used_bytes : UINT32_MAX;
+    char credit[CREDIT_SIZE];
+    encode_credit(credit, messages, bytes);
+    if (batch_frame(&link->out, OP_CREDIT, "", credit, sizeof(credit)) < 0) return;
+    link->used_messages = 0;
+    link->used_bytes = client->credit_bytes > 0 ? link->used_bytes - bytes : 0;
+    // The broker may be waiting for it, so it does not linger
+    batch_flush(&link->out);
+}
+
+// Drain a readable connection. Returns the number of messages dispatched.
+static int read_link(PubSubClient *client, ClientLink *link) {
+    int dispatched = 0;
+    while (1) {
+        size_t avail;
+        char *space = frame_decoder_space(&link->decoder, &avail);
+        if (!space) {
+            fprintf(stderr, "[ERROR] Out of memory reading from broker %s:%d.\n", link->ip, link->port);
+            link_down(link);
+            break;
+        }
+
+        ssize_t bytes_received = recv(link->fd, space, avail, 0);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                frame_decoder_shrink(&link->decoder);
+                break;
+            }
+            link_down(link);
+            break;
+        }
+        if (bytes_received == 0) {
+            link_down(link);
+            break;
+        }
+        frame_decoder_commit(&link->decoder, bytes_received);
+
+        Frame frame;
+        int rc;
+        while ((rc = decode_frame(&link->decoder, &frame)) == 1) {
+            if (frame.opcode == OP_THROTTLE || frame.opcode == OP_RESUME) {
+                __atomic_store_n(&link->throttled, frame.opcode == OP_THROTTLE, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (frame.opcode != OP_MESSAGE) continue;
+            link->used_messages++;
+            link->used_bytes += frame_size(frame.topic_len, frame.payload_len);
+            Payload msg;
+            if (decode_payload(&frame, &msg) == 0 && accept_seq(link, &msg)) {
+                dispatch(client, (int)(link - client->links), &frame, &msg);
+                dispatched++;
+            }
+        }
+        if (rc < 0) {
+            fprintf(stderr, "[ERROR] Protocol error from broker %s:%d.\n", link->ip, link->port);
+            link_down(link);
+            break;
+        }
+    }
+
+    // One acknowledgement covers everything read, once its callbacks ran
+    if (link->ack_due && link->fd >= 0) {
+        char ack[ACK_SIZE];
+        encode_ack(ack, link->last_seq, 0);
+        batch_frame(&link->out, OP_ACK, "", ack, sizeof(ack));
+        link->ack_due = 0;
+    }
+    grant_credit(client, link);
+    return dispatched;
+}
+
+int pubsub_poll(PubSubClient *client, int timeout_ms) {
+    struct pollfd pfds[MAX_LINKS + 1];
+    int ids[MAX_LINKS + 1];
+    int n = 0;
+    long long now = now_ms();
+
+    for (int i = 0; i < client->link_count; i++) {
+        ClientLink *link = &client->links[i];
+        if (link->fd >= 0 && !link->connecting && !batch_attached(&link->out)) {
+            link_down(link);  // a publishing thread hit a write error
+        }
+        if (link->fd < 0 && now >= link->retry_at_ms) {
+            start_connect(link);
+        }
+        if (link->fd < 0) {
+            int wait = (int)(link->retry_at_ms - now);
+            if (timeout_ms < 0 || wait < timeout_ms) timeout_ms = wait;
+            continue;
+        }
+
+        // Lingering batches wake the poll by timeout; only a full socket
+        // waits for POLLOUT, which would otherwise fire at once
+        if (!link->connecting && batch_pending(&link->out)) {
+            int wait = (int)((batch_flush_due(&link->out) + 999) / 1000);
+            if (timeout_ms < 0 || wait < timeout_ms) timeout_ms = wait;
+        }
+        pfds[n].fd = link->fd;
+        pfds[n].events = POLLIN | (link->connecting || batch_blocked(&link->out) ? POLLOUT : 0);
+        ids[n++] = i;
+    }
+    pfds[n].fd = client->wake_fd;
+    pfds[n].events = POLLIN;
+    ids[n++] = -1;
+
+    if (poll(pfds, n, timeout_ms) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int dispatched = 0;
+    for (int j = 0; j < n; j++) {
+        if (!pfds[j].revents) continue;
+        if (ids[j] < 0) {
+            uint64_t count;
+            while (read(client->wake_fd, &count, sizeof(count)) > 0);
+            continue;
+        }
+
+        ClientLink *link = &client->links[ids[j]];
+        if (link->connecting) {
+            finish_connect(client, ids[j]);
+            continue;
+        }
+        if (pfds[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+            dispatched += read_link(client, link);
+            if (link->fd < 0) continue;
+        }
+        if (pfds[j].revents & POLLOUT) {
+            batch_flush_due(&link->out);
+        }
+    }
+
+    for (int i = 0; i < client->link_count; i++) {
+        if (client->links[i].fd >= 0 && !client->links[i].connecting) {
+            batch_flush_due(&client->links[i].out);
+        }
+    }
+    return dispatched;
+}
+
+static void *poll_thread(void *arg) {
+    PubSubClient *client = arg;
+    while (!__atomic_load_n(&client->stopping, __ATOMIC_ACQUIRE)) {
+        if (pubsub_poll(client, 1000) < 0) {
+            perror("[ERROR] poll failed");
+            break;
+        }
+    }
+    return NULL;
+}
+
+int pubsub_start(PubSubClient *client) {
+    if (client->running) return 0;
+    if (pthread_create(&client->thread, NULL, poll_thread, client) != 0) return -1;
+    client->running = 1;
+    return 0;
+}
+
+void pubsub_close(PubSubClient *client) {
+    if (client->running) {
+        __atomic_store_n(&client->stopping, 1, __ATOMIC_RELEASE);
+        wake_poller(client);
+        pthread_join(client->thread, NULL);
+    }
+
+    // Give full sockets a moment to take the last batches
+    long long deadline = now_ms() + CLOSE_TIMEOUT_MS;
+    while (pubsub_flush(client) > 0 && now_ms() < deadline) {
+        struct pollfd pfds[MAX_LINKS];
+        int n = 0;
+        for (int i = 0; i < client->link_count; i++) {
+            if (client->links[i].fd >= 0 && !client->links[i].connecting) {
+                pfds[n].fd = client->links[i].fd;
+                pfds[n++].events = POLLOUT;
+            }
+        }
+        if (n == 0 || poll(pfds, n, 100) < 0) break;
+    }
+
+    for (int i = 0; i < client->link_count; i++) {
+        ClientLink *link = &client->links[i];
+        if (link->connecting) close(link->fd);
+        batch_destroy(&link->out);
+        frame_decoder_free(&link->decoder);
+    }
+    for (size_t i = 0; i < client->subscriptions.cap; i++) {
+        TopicEntry *entry = client->subscriptions.slots[i];
+        if (entry && entry->sub_count > 0) free(entry->subscribers[0]);
+    }
+    free(client->links);
+    free(client->deliveries);
+    free(client->pattern_matches.values);
+    topic_trie_destroy(&client->patterns);
+    topic_table_destroy(&client->subscriptions);
+    hashring_free(&client->ring);
+    if (client->wake_fd >= 0) close(client->wake_fd);
+    pthread_mutex_destroy(&client->sub_lock);
+    free(client);
+}
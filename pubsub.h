@@ -0,0 +1,110 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <stddef.h>
+
+// Client library for the broker3 cluster (also works against a single
+// broker2). Topics are routed to their owner on the same consistent-hash
+// ring the brokers use, over persistent connections to every broker.
+//
+// Publishing never blocks: frames are batched per connection and written
+// when a batch fills, when it has lingered long enough, or on pubsub_flush.
+// Incoming messages are dispatched from pubsub_poll, either on a thread of
+// the caller's choosing or on the one started by pubsub_start.
+//
+// With an ack_window, the brokers deliver at least once: each message is
+// acknowledged after its callbacks return, and the broker sends it again
+// if the acknowledgement does not arrive in time. Redeliveries on the same
+// connection are filtered out; a message may still reach a callback twice
+// when a connection drops before acknowledging it. A bigger window keeps
+// a distant subscriber's link busy while acknowledgements travel back.
+//
+// With credit, a broker sends no further ahead of the callbacks than the
+// credit allows and keeps the rest queued, so a slow subscriber does not
+// pile messages up in its socket buffers. Credit is granted back as the
+// callbacks return.
+//
+// A broker whose subscribers fall behind holds back the publishers feeding
+// them: publishing on its connection fails with EAGAIN until it lets go,
+// and whatever was already batched waits for it.
+
+#define PUBSUB_MAX_BROKERS 64
+#define PUBSUB_MAX_CONNECTIONS 8
+
+typedef struct PubSubClient PubSubClient;
+
+// Called for every message on a subscribed topic. payload is only valid
+// for the duration of the call.
+typedef void (*MessageCallback)(const char *topic, const char *payload, size_t len, void *arg);
+
+typedef struct {
+    int vnodes;           // must match the brokers' -v
+    size_t batch_count;   // frames per write
+    size_t batch_bytes;   // bytes per write
+    long linger_us;       // longest a frame waits for its batch to fill; 0 sends at once
+    int connections;      // per broker; topics are spread over them, and so over its reactor threads
+    int ack_window;       // > 0 for acknowledged delivery with this many messages in flight (broker3 only)
+    unsigned credit_messages;  // > 0 to let each connection's broker send only this many messages ahead
+    unsigned credit_bytes;     // the same in bytes (broker3 only)
+} PubSubOptions;
+
+void pubsub_default_options(PubSubOptions *opts);
+
+// Connect to every broker in the list ("ip:port" strings). Brokers that are
+// down are retried in the background. opts may be NULL for the defaults.
+// Returns NULL on invalid arguments or when out of memory.
+PubSubClient *pubsub_connect(const char *const *brokers, int count, const PubSubOptions *opts);
+
+// Flush what can be written, stop the background thread and disconnect
+void pubsub_close(PubSubClient *client);
+
+// Spread topic over partitions partitions (see partition.h) when publishing
+// and subscribing. Use the count the brokers' -p gives it, and declare it
+// before using the topic. Returns 0, or -1 with errno set to EINVAL.
+int pubsub_partition(PubSubClient *client, const char *topic, int partitions);
+
+// Queue a message. Returns 0 on success and -1 with errno set on failure:
+// EINVAL for an oversized topic or payload, EAGAIN when the broker is too
+// far behind to buffer more or holds publishes back.
+int pubsub_publish(PubSubClient *client, const char *topic, const void *buf, size_t len);
+
+// Same, with a key: consumer groups hand every message with the same key
+// to the same member, in order, while the group's membership is stable
+int pubsub_publish_key(PubSubClient *client, const char *topic, const void *key, size_t key_len,
+                       const void *buf, size_t len);
+
+// Route messages on topic to callback, replacing any earlier callback for it.
+// topic may be a wildcard pattern ("sports/+/score", "food/#"); a message
+// matching several subscriptions goes to each of their callbacks.
+// Returns 0 on success and -1 with errno set on failure.
+int pubsub_subscribe(PubSubClient *client, const char *topic, MessageCallback callback, void *arg);
+
+// Same, but first replay the topic's history starting from "earliest",
+// "latest", an offset or "@" and a Unix time in milliseconds (not for
+// patterns, which get new messages only). After a
+// reconnect, subscriptions resume after the last message received, so
+// nothing the broker still retains is missed.
+int pubsub_subscribe_from(PubSubClient *client, const char *topic, const char *from,
+                          MessageCallback callback, void *arg);
+
+// Join a consumer group on topic instead: each message goes to only one of
+// the group's members, wherever in the cluster they are connected. Groups
+// receive new messages only.
+int pubsub_subscribe_group(PubSubClient *client, const char *topic, const char *group,
+                           MessageCallback callback, void *arg);
+int pubsub_unsubscribe(PubSubClient *client, const char *topic);
+
+// Write out every pending batch without waiting for the linger. Returns 0
+// when everything was written, 1 when some sockets are full or still
+// connecting (pubsub_poll finishes the job) and -1 if a write failed.
+int pubsub_flush(PubSubClient *client);
+
+// Wait up to timeout_ms for socket activity, dispatch received messages,
+// write due batches and reconnect lost brokers. Must not run on two
+// threads at once. Returns the number of messages dispatched or -1.
+int pubsub_poll(PubSubClient *client, int timeout_ms);
+
+// Run pubsub_poll on a background thread until pubsub_close
+int pubsub_start(PubSubClient *client);
+
+#endif
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "protocol.h"
+#include "pubsub.h"
+#include "histogram.h"
+
+#define MAX_CLIENTS 256
+#define MAX_TOPICS 4096
+#define MAX_SIZES 16
+#define MAX_BROKER_ARGS 32
+#define STAMP_SIZE 8              // payloads start with their send time
+#define SUBSCRIBE_SETTLE_MS 500   // for subscriptions to reach the topic owners
+#define BROKER_START_MS 3000      // how long -x brokers get to start listening
+#define BROKER_STOP_MS 3000       // and to exit
+#define DRAIN_IDLE_MS 1000        // stop waiting for deliveries after this long without any
+
+// One subscribing client, subscribed to every topic. Its callbacks run on
+// its own background thread, which alone writes the counts and histogram.
+typedef struct {
+    PubSubClient *client;
+    Histogram latency;
+    unsigned long long delivered;  // measured messages, read by the main thread
+    unsigned long long bytes;
+    unsigned long long malformed;
+} Subscriber;
+
+// One publishing client on its own thread
+typedef struct {
+    int id;
+    PubSubClient *client;
+    pthread_t thread;
+    unsigned long long published;  // measured messages
+    unsigned long long failed;
+    unsigned seed;
+} Publisher;
+
+PubSubOptions client_opts;
+Publisher publishers[MAX_CLIENTS];
+Subscriber subscribers[MAX_CLIENTS];
+int publisher_count = 1;
+int subscriber_count = 1;
+int topic_count = 1;
+char topics[MAX_TOPICS][32];
+size_t sizes[MAX_SIZES] = { 64 };
+int size_count = 1;
+size_t max_size = 64;
+double rate = 0;       // messages per second over all publishers, 0 for flat out
+int poisson = 0;       // exponential gaps between sends instead of even ones
+long long start_ns;    // publishing starts
+long long measure_ns;  // messages sent from here on are measured
+long long end_ns;
+const char *const *broker_list;
+int broker_list_count;
+pid_t broker_pids[PUBSUB_MAX_BROKERS];
+int broker_pid_count = 0;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sleep_until(long long ns) {
+    struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Runs on the subscriber's background thread
+void record_message(const char *topic, const char *payload, size_t len, void *arg) {
+    (void)topic;
+    Subscriber *sub = arg;
+    long long now = now_ns();
+    long long sent;
+    if (len < STAMP_SIZE) {
+        sub->malformed++;
+        return;
+    }
+    memcpy(&sent, payload, STAMP_SIZE);
+    if (sent < measure_ns || sent >= end_ns) return;
+    histogram_record(&sub->latency, now > sent ? (uint64_t)(now - sent) : 0);
+    __atomic_store_n(&sub->bytes, sub->bytes + len, __ATOMIC_RELAXED);
+    __atomic_store_n(&sub->delivered, sub->delivered + 1, __ATOMIC_RELAXED);
+}
+
+// Publish until the run ends. With a rate every message has a slot in a
+// schedule of its own, even or Poisson, and carries the slot's time: a
+// publisher held up by the brokers then reports the wait as latency
+// instead of quietly sending less.
+void *publish_loop(void *arg) {
+    Publisher *pub = arg;
+    char *payload = malloc(max_size);
+    if (!payload) {
+        fprintf(stderr, "[ERROR] Out of memory.\n");
+        return NULL;
+    }
+    memset(payload, 'x', max_size);
+    double per_publisher = rate / publisher_count;
+    long long next = start_ns;
+    unsigned long long seq = pub->id;
+
+    while (1) {
+        long long now = now_ns();
+        if (now >= end_ns) break;
+        long long sent = now;
+        if (per_publisher > 0) {
+            if (next > now) {
+                sleep_until(next < end_ns ? next : end_ns);
+                continue;
+            }
+            sent = next;
+            double gap = 1e9 / per_publisher;
+            if (poisson) gap *= -log((rand_r(&pub->seed) + 1.0) / (RAND_MAX + 2.0));
+            next += (long long)gap;
+        }
+
+        const char *topic = topics[seq++ % topic_count];
+        size_t len = sizes[rand_r(&pub->seed) % size_count];
+        memcpy(payload, &sent, STAMP_SIZE);
+        int rc;
+        while ((rc = pubsub_publish(pub->client, topic, payload, len)) < 0 && errno == EAGAIN &&
+               now_ns() < end_ns) {
+            usleep(50);
+        }
+        if (rc < 0) {
+            if (errno != EAGAIN) pub->failed++;
+            continue;
+        }
+        if (sent >= measure_ns) pub->published++;
+    }
+
+    pubsub_flush(pub->client);
+    free(payload);
+    return NULL;
+}
+
+// Parse a comma-separated list of payload sizes
+int parse_sizes(const char *spec) {
+    size_count = 0;
+    max_size = 0;
+    const char *p = spec;
+    while (*p && size_count < MAX_SIZES) {
+        char *end;
+        unsigned long size = strtoul(p, &end, 10);
+        if (end == p || size < STAMP_SIZE || size > MAX_PAYLOAD_SIZE || (*end && *end != ',')) break;
+        sizes[size_count++] = size;
+        if (size > max_size) max_size = size;
+        p = *end ? end + 1 : end;
+    }
+    if (*p || size_count == 0) {
+        fprintf(stderr, "[ERROR] Payload sizes must be %d to %d bytes, at most %d of them.\n",
+                STAMP_SIZE, MAX_PAYLOAD_SIZE, MAX_SIZES);
+        return -1;
+    }
+    return 0;
+}
+
+// Whether something listens at "ip:port"
+int broker_listening(const char *address) {
+    char ip[64];
+    const char *colon = strrchr(address, ':');
+    if (!colon || (size_t)(colon - address) >= sizeof(ip)) return 0;
+    memcpy(ip, address, colon - address);
+    ip[colon - address] = '\0';
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) return 0;
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return 0;
+    int ok = connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(sock);
+    return ok;
+}
+
+// Start a broker for every address on the list, all with the same extra
+// arguments, and wait for them to listen. Returns -1 if one does not.
+int start_brokers(const char *binary, char *extra) {
+    char *args[MAX_BROKER_ARGS + PUBSUB_MAX_BROKERS + 3];
+    int argc = 1;
+    args[0] = (char *)binary;
+    for (char *arg = strtok(extra, " "); arg && argc <= MAX_BROKER_ARGS; arg = strtok(NULL, " ")) {
+        args[argc++] = arg;
+    }
+    int port_arg = argc++;
+    for (int i = 0; i < broker_list_count; i++) args[argc++] = (char *)broker_list[i];
+    args[argc] = NULL;
+
+    for (int i = 0; i < broker_list_count; i++) {
+        char port[16];
+        const char *colon = strrchr(broker_list[i], ':');
+        snprintf(port, sizeof(port), "%s", colon ? colon + 1 : "");
+        args[port_arg] = port;
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("[ERROR] fork failed");
+            return -1;
+        }
+        if (pid == 0) {
+            freopen("/dev/null", "w", stdout);
+            execv(binary, args);
+            perror("[ERROR] Could not start the broker");
+            _exit(127);
+        }
+        broker_pids[broker_pid_count++] = pid;
+    }
+
+    for (int i = 0; i < broker_list_count; i++) {
+        long long deadline = now_ns() + BROKER_START_MS * 1000000LL;
+        while (!broker_listening(broker_list[i])) {
+            if (now_ns() >= deadline) {
+                fprintf(stderr, "[ERROR] Broker %s did not start.\n", broker_list[i]);
+                return -1;
+            }
+            usleep(10000);
+        }
+    }
+    return 0;
+}
+
+// Let the brokers leave and exit on their own (so that, for one, a
+// profiling build writes its profile), or kill them after a while
+void stop_brokers() {
+    for (int i = 0; i < broker_pid_count; i++) kill(broker_pids[i], SIGTERM);
+    long long deadline = now_ns() + BROKER_STOP_MS * 1000000LL;
+    int running = broker_pid_count;
+    while (running > 0 && now_ns() < deadline) {
+        usleep(10000);
+        for (int i = 0; i < broker_pid_count; i++) {
+            if (broker_pids[i] > 0 && waitpid(broker_pids[i], NULL, WNOHANG) != 0) {
+                broker_pids[i] = 0;
+                running--;
+            }
+        }
+    }
+    for (int i = 0; i < broker_pid_count; i++) {
+        if (broker_pids[i] > 0) {
+            kill(broker_pids[i], SIGKILL);
+            waitpid(broker_pids[i], NULL, 0);
+        }
+    }
+    broker_pid_count = 0;
+}
+
+unsigned long long total_delivered() {
+    unsigned long long total = 0;
+    for (int i = 0; i < subscriber_count; i++) total += __atomic_load_n(&subscribers[i].delivered, __ATOMIC_RELAXED);
+    return total;
+}
+
+void print_latency(const char *label, uint64_t ns) {
+    if (ns >= 10000000) printf("%s %.1f ms", label, ns / 1e6);
+    else printf("%s %.1f us", label, ns / 1e3);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-P publishers] [-S subscribers] [-T topics] [-r msgs_per_sec [-e]]"
+                    " [-s bytes[,bytes]...] [-d seconds] [-w warmup_seconds] [-v vnodes] [-c connections]"
+                    " [-l linger_us] [-a ack_window] [-x broker_binary [-X \"broker args\"]]"
+                    " <broker_ip:port>...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    pubsub_default_options(&client_opts);
+    double duration = 10;
+    double warmup = 1;
+    const char *broker_binary = NULL;
+    char *broker_args = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "P:S:T:r:es:d:w:v:c:l:a:x:X:")) != -1) {
+        if (opt == 'P') {
+            publisher_count = atoi(optarg);
+        } else if (opt == 'S') {
+            subscriber_count = atoi(optarg);
+        } else if (opt == 'T') {
+            topic_count = atoi(optarg);
+        } else if (opt == 'r') {
+            rate = atof(optarg);
+        } else if (opt == 'e') {
+            poisson = 1;
+        } else if (opt == 's') {
+            if (parse_sizes(optarg) < 0) exit(EXIT_FAILURE);
+        } else if (opt == 'd') {
+            duration = atof(optarg);
+        } else if (opt == 'w') {
+            warmup = atof(optarg);
+        } else if (opt == 'v') {
+            client_opts.vnodes = atoi(optarg);
+        } else if (opt == 'c') {
+            client_opts.connections = atoi(optarg);
+        } else if (opt == 'l') {
+            client_opts.linger_us = atol(optarg);
+        } else if (opt == 'a') {
+            client_opts.ack_window = atoi(optarg);
+        } else if (opt == 'x') {
+            broker_binary = optarg;
+        } else if (opt == 'X') {
+            broker_args = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1 || argc - optind > PUBSUB_MAX_BROKERS) usage(argv[0]);
+    if (publisher_count < 1 || publisher_count > MAX_CLIENTS || subscriber_count < 0 ||
+        subscriber_count > MAX_CLIENTS || topic_count < 1 || topic_count > MAX_TOPICS) {
+        fprintf(stderr, "[ERROR] Publishers must be 1 to %d, subscribers 0 to %d and topics 1 to %d.\n",
+                MAX_CLIENTS, MAX_CLIENTS, MAX_TOPICS);
+        exit(EXIT_FAILURE);
+    }
+    if (rate < 0 || duration <= 0 || warmup < 0 || warmup >= duration) {
+        fprintf(stderr, "[ERROR] The rate cannot be negative, and the warmup must end before the run.\n");
+        exit(EXIT_FAILURE);
+    }
+    broker_list = (const char *const *)&argv[optind];
+    broker_list_count = argc - optind;
+    for (int i = 0; i < topic_count; i++) snprintf(topics[i], sizeof(topics[i]), "bench/%d", i);
+
+    if (broker_binary) {
+        char none[] = "";
+        if (start_brokers(broker_binary, broker_args ? broker_args : none) < 0) {
+            stop_brokers();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < subscriber_count; i++) {
+        Subscriber *sub = &subscribers[i];
+        sub->client = pubsub_connect(broker_list, broker_list_count, &client_opts);
+        if (!sub->client || histogram_init(&sub->latency) < 0 || pubsub_start(sub->client) < 0) {
+            fprintf(stderr, "[ERROR] Could not start subscriber %d.\n", i);
+            stop_brokers();
+            exit(EXIT_FAILURE);
+        }
+        for (int t = 0; t < topic_count; t++) {
+            if (pubsub_subscribe(sub->client, topics[t], record_message, sub) < 0) {
+                perror("[ERROR] Subscribe failed");
+                stop_brokers();
+                exit(EXIT_FAILURE);
+            }
+        }
+        pubsub_flush(sub->client);
+    }
+    usleep(SUBSCRIBE_SETTLE_MS * 1000);
+
+    for (int i = 0; i < publisher_count; i++) {
+        publishers[i].id = i;
+        publishers[i].seed = i + 1;
+        publishers[i].client = pubsub_connect(broker_list, broker_list_count, &client_opts);
+        if (!publishers[i].client || pubsub_start(publishers[i].client) < 0) {
+            fprintf(stderr, "[ERROR] Could not start publisher %d.\n", i);
+            stop_brokers();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start_ns = now_ns();
+    measure_ns = start_ns + (long long)(warmup * 1e9);
+    end_ns = start_ns + (long long)(duration * 1e9);
+    for (int i = 0; i < publisher_count; i++) {
+        pthread_create(&publishers[i].thread, NULL, publish_loop, &publishers[i]);
+    }
+    unsigned long long published = 0;
+    unsigned long long failed = 0;
+    for (int i = 0; i < publisher_count; i++) {
+        pthread_join(publishers[i].thread, NULL);
+        published += publishers[i].published;
+        failed += publishers[i].failed;
+    }
+
+    // Wait for the deliveries still on their way, while they keep coming
+    unsigned long long expected = published * subscriber_count;
+    unsigned long long delivered = total_delivered();
+    long long idle_since = now_ns();
+    while (delivered < expected && now_ns() - idle_since < DRAIN_IDLE_MS * 1000000LL) {
+        usleep(10000);
+        unsigned long long now_delivered = total_delivered();
+        if (now_delivered != delivered) idle_since = now_ns();
+        delivered = now_delivered;
+    }
+
+    for (int i = 0; i < publisher_count; i++) pubsub_close(publishers[i].client);
+    Histogram latency;
+    if (histogram_init(&latency) < 0) {
+        fprintf(stderr, "[ERROR] Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long long bytes = 0;
+    unsigned long long malformed = 0;
+    for (int i = 0; i < subscriber_count; i++) {
+        pubsub_close(subscribers[i].client);
+        histogram_merge(&latency, &subscribers[i].latency);
+        bytes += subscribers[i].bytes;
+        malformed += subscribers[i].malformed;
+        histogram_free(&subscribers[i].latency);
+    }
+    delivered = latency.total;
+    stop_brokers();
+
+    double secs = duration - warmup;
+    printf("%d publisher(s), %d subscriber(s), %d topic(s), payload", publisher_count, subscriber_count,
+           topic_count);
+    for (int i = 0; i < size_count; i++) printf("%s%zu", i ? "," : " ", sizes[i]);
+    if (rate > 0) printf(" B, %s %.0f msgs/s", poisson ? "Poisson" : "fixed", rate);
+    else printf(" B, flat out");
+    printf(", %.1f s measured after %.1f s warmup\n", secs, warmup);
+    printf("Published: %llu msgs, %.0f msgs/s", published, published / secs);
+    if (failed > 0) printf(", %llu failed", failed);
+    printf("\n");
+    printf("Delivered: %llu msgs, %.0f msgs/s, %.1f MB/s, %llu missing", delivered, delivered / secs,
+           bytes / secs / (1024 * 1024), expected > delivered ? expected - delivered : 0);
+    if (malformed > 0) printf(", %llu malformed", malformed);
+    printf("\n");
+    printf("Latency:");
+    print_latency(" p50", histogram_percentile(&latency, 50));
+    print_latency(", p99", histogram_percentile(&latency, 99));
+    print_latency(", p99.9", histogram_percentile(&latency, 99.9));
+    print_latency(", max", latency.max);
+    printf("\n");
+    histogram_free(&latency);
+    return expected > delivered ? 2 : 0;
+}
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "slab.h"
+
+#define SLAB_LARGE UINT32_MAX
+#define BATCH_BYTES (64 * 1024)  // moved between a thread and the depot at once
+#define MIN_BATCH 4
+#define MAX_BATCH 64
+
+// In front of every object; 16 bytes keep the object itself aligned
+typedef struct {
+    uint32_t cls;
+    uint32_t unused;
+    size_t size;  // requested, for large objects
+} Header;
+
+// A free object, header included. The first of each batch in the depot
+// links to the next batch.
+typedef struct FreeObject {
+    struct FreeObject *next;
+    struct FreeObject *next_batch;
+} FreeObject;
+
+typedef struct ThreadCache {
+    FreeObject *free[SLAB_CLASSES];
+    size_t count[SLAB_CLASSES];  // written by the owner only, read by slab_stats
+    struct ThreadCache *next;
+    struct ThreadCache **prev;
+    int registered;
+} ThreadCache;
+
+// Batches of free objects handed back by threads with too many
+typedef struct {
+    pthread_mutex_t lock;
+    FreeObject *batches;
+    size_t count;
+    size_t reserved;  // objects ever carved, updated atomically
+} Depot;
+
+static Depot depots[SLAB_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadCache *registry;
+static size_t large_in_use;
+static size_t large_bytes;
+static __thread ThreadCache cache;
+
+static size_t object_size(int cls) {
+    return (size_t)1 << (cls + SLAB_MIN_SHIFT);
+}
+
+// Objects per batch: about BATCH_BYTES of them
+static size_t batch_count(int cls) {
+    size_t n = BATCH_BYTES / object_size(cls);
+    return n < MIN_BATCH ? MIN_BATCH : n > MAX_BATCH ? MAX_BATCH : n;
+}
+
+static void set_count(int cls, size_t count) {
+    __atomic_store_n(&cache.count[cls], count, __ATOMIC_RELAXED);
+}
+
+// Move the first batch of a thread's free list to the depot
+static void give_back(int cls, size_t n) {
+    FreeObject *first = cache.free[cls];
+    FreeObject *last = first;
+    for (size_t i = 1; i < n; i++) last = last->next;
+    cache.free[cls] = last->next;
+    last->next = NULL;
+    set_count(cls, cache.count[cls] - n);
+
+    Depot *depot = &depots[cls];
+    pthread_mutex_lock(&depot->lock);
+    first->next_batch = depot->batches;
+    depot->batches = first;
+    depot->count += n;
+    pthread_mutex_unlock(&depot->lock);
+}
+
+// A thread is exiting: everything it holds goes to the depot
+static void retire_cache(void *arg) {
+    (void)arg;
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        while (cache.count[cls] > 0) {
+            size_t n = batch_count(cls);
+            give_back(cls, cache.count[cls] < n ? cache.count[cls] : n);
+        }
+    }
+    pthread_mutex_lock(&registry_lock);
+    *cache.prev = cache.next;
+    if (cache.next) cache.next->prev = cache.prev;
+    pthread_mutex_unlock(&registry_lock);
+    cache.registered = 0;
+}
+
+static void init_slabs(void) {
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        pthread_mutex_init(&depots[cls].lock, NULL);
+    }
+    pthread_key_create(&cache_key, retire_cache);
+}
+
+#ifdef __SANITIZE_ADDRESS__
+
+void *slab_alloc(size_t size) {
+    return malloc(size);
+}
+
+void *slab_calloc(size_t size) {
+    return calloc(1, size);
+}
+
+void slab_free(void *ptr) {
+    free(ptr);
+}
+
+#else
+
+// The smallest class holding size bytes plus the header, or -1
+static int class_for(size_t size) {
+    size_t need = size + sizeof(Header);
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        if (need <= object_size(cls)) return cls;
+    }
+    return -1;
+}
+
+static void register_cache(void) {
+    pthread_once(&slab_once, init_slabs);
+    pthread_mutex_lock(&registry_lock);
+    cache.next = registry;
+    cache.prev = &registry;
+    if (registry) registry->prev = &cache.next;
+    registry = &cache;
+    pthread_mutex_unlock(&registry_lock);
+    pthread_setspecific(cache_key, &cache);
+    cache.registered = 1;
+}
+
+// Fill an empty free list from the depot, or else from a new slab.
+// Returns -1 when out of memory.
+static int refill(int cls) {
+    Depot *depot = &depots[cls];
+    pthread_mutex_lock(&depot->lock);
+    FreeObject *batch = depot->batches;
+    if (batch) {
+        depot->batches = batch->next_batch;
+        size_t n = 0;
+        for (FreeObject *o = batch; o; o = o->next) n++;
+        depot->count -= n;
+        pthread_mutex_unlock(&depot->lock);
+        cache.free[cls] = batch;
+        set_count(cls, n);
+        return 0;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    size_t size = object_size(cls);
+    size_t n = SLAB_BYTES / size;
+    char *slab = malloc(n * size);
+    if (!slab) return -1;
+    for (size_t i = 0; i < n; i++) {
+        FreeObject *o = (FreeObject *)(slab + i * size);
+        o->next = i + 1 < n ? (FreeObject *)(slab + (i + 1) * size) : NULL;
+    }
+    cache.free[cls] = (FreeObject *)slab;
+    set_count(cls, n);
+    __atomic_add_fetch(&depot->reserved, n, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void *slab_alloc(size_t size) {
+    int cls = class_for(size);
+    Header *h;
+    if (cls < 0) {
+        h = malloc(sizeof(Header) + size);
+        if (!h) return NULL;
+        h->cls = SLAB_LARGE;
+        h->size = size;
+        __atomic_add_fetch(&large_in_use, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&large_bytes, size, __ATOMIC_RELAXED);
+        return h + 1;
+    }
+
+    if (!cache.registered) register_cache();
+    if (!cache.free[cls] && refill(cls) < 0) return NULL;
+    FreeObject *o = cache.free[cls];
+    cache.free[cls] = o->next;
+    set_count(cls, cache.count[cls] - 1);
+    h = (Header *)o;
+    h->cls = cls;
+    h->size = size;
+    return h + 1;
+}
+
+void *slab_calloc(size_t size) {
+    void *ptr = slab_alloc(size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+void slab_free(void *ptr) {
+    if (!ptr) return;
+    Header *h = (Header *)ptr - 1;
+    if (h->cls == SLAB_LARGE) {
+        __atomic_sub_fetch(&large_in_use, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&large_bytes, h->size, __ATOMIC_RELAXED);
+        free(h);
+        return;
+    }
+
+    int cls = h->cls;
+    if (!cache.registered) register_cache();
+    FreeObject *o = (FreeObject *)h;
+    o->next = cache.free[cls];
+    cache.free[cls] = o;
+    set_count(cls, cache.count[cls] + 1);
+    // Keep up to two batches, so alternating alloc and free stays local
+    size_t n = batch_count(cls);
+    if (cache.count[cls] > 2 * n) give_back(cls, n);
+}
+
+#endif
+
+void slab_stats(SlabStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_once(&slab_once, init_slabs);
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        Depot *depot = &depots[cls];
+        SlabClassStats *c = &stats->classes[cls];
+        c->object_size = object_size(cls);
+        c->reserved = __atomic_load_n(&depot->reserved, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&depot->lock);
+        c->cached = depot->count;
+        pthread_mutex_unlock(&depot->lock);
+    }
+    pthread_mutex_lock(&registry_lock);
+    for (ThreadCache *t = registry; t; t = t->next) {
+        for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+            stats->classes[cls].cached += __atomic_load_n(&t->count[cls], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        SlabClassStats *c = &stats->classes[cls];
+        // Counted at different moments, so the cached figure may run ahead
+        c->in_use = c->reserved > c->cached ? c->reserved - c->cached : 0;
+    }
+    stats->large_in_use = __atomic_load_n(&large_in_use, __ATOMIC_RELAXED);
+    stats->large_bytes = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+}
+
+void slab_print_stats(FILE *out) {
+    SlabStats stats;
+    slab_stats(&stats);
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        SlabClassStats *c = &stats.classes[cls];
+        if (c->reserved == 0) continue;
+        fprintf(out, "[STATS] Slab class %zu B: %zu in use, %zu free, %zu KB reserved.\n", c->object_size,
+                c->in_use, c->cached, c->reserved * c->object_size / 1024);
+    }
+    fprintf(out, "[STATS] Large objects: %zu in use, %zu KB.\n", stats.large_in_use, stats.large_bytes / 1024);
+}
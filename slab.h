@@ -0,0 +1,51 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define SLAB_MIN_SHIFT 6    // smallest class, 64 bytes
+#define SLAB_CLASSES 13     // powers of two up to 256 KB
+#define SLAB_BYTES (256 * 1024)  // carved at a time; the biggest class gets one object per slab
+
+// Size-classed object pools for the broker's hot paths: connections,
+// encoded frames and the small records hanging off them. Each thread keeps
+// its own free lists, so allocating and freeing take no lock; objects
+// freed on another thread than the one that allocated them join that
+// thread's lists, and surplus moves through a shared depot in batches.
+// Memory is carved from big slabs that are never given back, so once the
+// pools have grown to the working set nothing reaches malloc. Requests
+// bigger than the largest class go straight to malloc.
+//
+// Built with AddressSanitizer, every call goes to malloc and free so
+// use-after-free is still caught.
+
+void *slab_alloc(size_t size);
+
+// Same, zeroed
+void *slab_calloc(size_t size);
+
+// Return an object from slab_alloc or slab_calloc (NULL is ignored)
+void slab_free(void *ptr);
+
+typedef struct {
+    size_t object_size;  // including the header
+    size_t reserved;     // objects carved from slabs
+    size_t in_use;
+    size_t cached;       // free on some thread's lists or in the depot
+} SlabClassStats;
+
+typedef struct {
+    SlabClassStats classes[SLAB_CLASSES];
+    size_t large_in_use;  // passed on to malloc
+    size_t large_bytes;
+} SlabStats;
+
+// Occupancy of every class, summed over the threads. Other threads keep
+// allocating meanwhile, so the figures are approximate.
+void slab_stats(SlabStats *stats);
+
+// One line per class in use, for logs
+void slab_print_stats(FILE *out);
+
+#endif
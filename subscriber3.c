@@ -1,139 +1,118 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-
-#define BUFFER_SIZE 1024
-#define MAX_BROKERS 5
-
-typedef struct {
-    char ip[50];
-    int port;
-} Broker;
-
-Broker brokers[MAX_BROKERS];
-int broker_count = 0;
-
-int get_broker_for_topic(const char *topic_name) {
-    unsigned long hash = 0;
-    for (int i = 0; topic_name[i] != '\0'; i++) {
-        hash = (hash * 31 + topic_name[i]) % broker_count;
-    }
-    return hash % broker_count;
-}
-
-void listen_for_messages(int sock) {
-    char buffer[BUFFER_SIZE];
-    printf("[DEBUG] Listening for messages...\n");
-
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
-        if (bytes_received > 0) {
-            printf("Message received: %s\n", buffer);
-        } else if (bytes_received == 0) {
-            printf("[DEBUG] Connection closed by broker.\n");
-            break;
-        } else {
-            perror("[ERROR] recv failed");
-            break;
-        }
-    }
-
-    close(sock);
-}
-
-int connect_to_broker(int broker_id) {
-    int sock;
-    struct sockaddr_in broker_address;
-
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("[ERROR] Socket creation error");
-        return -1;
-    }
-
-    broker_address.sin_family = AF_INET;
-    broker_address.sin_port = htons(brokers[broker_id].port);
-    if (inet_pton(AF_INET, brokers[broker_id].ip, &broker_address.sin_addr) <= 0) {
-        perror("[ERROR] Invalid broker IP address");
-        close(sock);
-        return -1;
-    }
-
-    if (connect(sock, (struct sockaddr *)&broker_address, sizeof(broker_address)) < 0) {
-        fprintf(stderr, "[ERROR] Connection failed to broker %s:%d\n", brokers[broker_id].ip, brokers[broker_id].port);
-        close(sock);
-        return -1;
-    }
-
-    return sock;
-}
-
-// Add a broker to the list
-void add_broker(const char *ip, int port) {
-    if (broker_count >= MAX_BROKERS) {
-        fprintf(stderr, "[ERROR] Maximum number of brokers reached.\n");
-        return;
-    }
-    strncpy(brokers[broker_count].ip, ip, sizeof(brokers[broker_count].ip) - 1);
-    brokers[broker_count].port = port;
-    printf("[DEBUG] Broker added: %s:%d\n", ip, port);
-    broker_count++;
-}
-
-void subscribe_to_topics() {
-    char topic[BUFFER_SIZE];
-    char buffer[BUFFER_SIZE];
-
-    while (1) {
-        printf("\nEnter topic to subscribe (or 'exit' to quit): ");
-        fgets(topic, sizeof(topic), stdin);
-        topic[strcspn(topic, "\n")] = '\0'; // Remove newline character
-
-        if (strcmp(topic, "exit") == 0) {
-            break;
-        }
-
-        // Calculate required buffer size
-        size_t required_size = strlen("SUBSCRIBE ") + strlen(topic) + 1;
-
-        if (required_size > sizeof(buffer)) {
-            fprintf(stderr, "[ERROR] Topic name exceeds allowed size.\n");
-            continue;
-        }
-
-        int broker_id = get_broker_for_topic(topic);
-        int sock = connect_to_broker(broker_id);
-        if (sock < 0) continue;
-
-        snprintf(buffer, sizeof(buffer), "SUBSCRIBE %s", topic);
-        send(sock, buffer, strlen(buffer), 0);
-
-        printf("[DEBUG] Subscribed to topic '%s' (via Broker %d).\n", topic, broker_id);
-
-        listen_for_messages(sock);
-    }
-}
-
-
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <broker_ip:port>...\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    for (int i = 1; i < argc; i++) {
-        char *colon = strchr(argv[i], ':');
-        if (colon) {
-            *colon = '\0';
-            add_broker(argv[i], atoi(colon + 1));
-        }
-    }
-
-    printf("[DEBUG] Subscriber started. Type 'exit' to quit.\n");
-    subscribe_to_topics();
-
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "protocol.h"
+#include "pubsub.h"
+#include "partition.h"
+
+#define BUFFER_SIZE 1024
+
+// Runs on the client library's background thread
+void print_message(const char *topic, const char *payload, size_t len, void *arg) {
+    (void)arg;
+    printf("Message received on topic '%s': %.*s\n", topic, (int)len, payload);
+    fflush(stdout);
+}
+
+// Subscriptions add up: messages keep arriving for every topic entered
+// while the next one is typed. "topic FROM position" replays history first
+// and "topic GROUP name" joins a consumer group.
+void subscribe_to_topics(PubSubClient *client) {
+    char topic[BUFFER_SIZE];
+    int interactive = isatty(STDIN_FILENO);
+
+    while (1) {
+        if (interactive) {
+            printf("\nEnter topic [FROM earliest|latest|offset|@unix_ms | GROUP name] (or 'exit' to quit): ");
+        }
+        if (!fgets(topic, sizeof(topic), stdin)) {
+            // Piped topic list: keep listening once it runs out
+            while (!interactive) pause();
+            break;
+        }
+        topic[strcspn(topic, "\n")] = '\0'; // Remove newline character
+
+        if (strcmp(topic, "exit") == 0) {
+            break;
+        }
+
+        char *from = strstr(topic, " FROM ");
+        if (from) {
+            *from = '\0';
+            from += strlen(" FROM ");
+        }
+        char *group = strstr(topic, " GROUP ");
+        if (group) {
+            *group = '\0';
+            group += strlen(" GROUP ");
+        }
+
+        if (strlen(topic) == 0 || strlen(topic) > MAX_TOPIC_LEN) {
+            fprintf(stderr, "[ERROR] Topic must be 1 to %d bytes long.\n", MAX_TOPIC_LEN);
+            continue;
+        }
+
+        int rc = group ? pubsub_subscribe_group(client, topic, group, print_message, NULL)
+                       : pubsub_subscribe_from(client, topic, from, print_message, NULL);
+        if (rc < 0) {
+            perror("[ERROR] Subscribe failed");
+            continue;
+        }
+        pubsub_flush(client);
+
+        if (group) printf("[DEBUG] Joined group '%s' on topic '%s'.\n", group, topic);
+        else if (from) printf("[DEBUG] Subscribed to topic '%s' from %s.\n", topic, from);
+        else printf("[DEBUG] Subscribed to topic '%s'.\n", topic);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    PubSubOptions opts;
+    pubsub_default_options(&opts);
+    PartitionMap partitions = { .count = 0 };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "v:c:p:a:n:b:")) != -1) {
+        if (opt == 'v') {
+            opts.vnodes = atoi(optarg);
+        } else if (opt == 'c') {
+            opts.connections = atoi(optarg);
+        } else if (opt == 'p') {
+            if (partition_map_parse(&partitions, optarg) < 0) exit(EXIT_FAILURE);
+        } else if (opt == 'a') {
+            opts.ack_window = atoi(optarg);
+        } else if (opt == 'n') {
+            opts.credit_messages = strtoul(optarg, NULL, 10);
+        } else if (opt == 'b') {
+            opts.credit_bytes = strtoul(optarg, NULL, 10);
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    // The broker list, -v and -p must match what the brokers were started with
+    if (argc - optind < 1) {
+        fprintf(stderr, "Usage: %s [-v vnodes] [-c connections] [-p topic=partitions]... [-a ack_window]"
+                        " [-n credit_messages] [-b credit_bytes] <broker_ip:port>...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    PubSubClient *client = pubsub_connect((const char *const *)&argv[optind], argc - optind, &opts);
+    if (!client || pubsub_start(client) < 0) {
+        fprintf(stderr, "[ERROR] Could not start the subscriber.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < partitions.count; i++) {
+        pubsub_partition(client, partitions.topics[i].name, partitions.topics[i].partitions);
+    }
+
+    printf("[DEBUG] Subscriber started. Type 'exit' to quit.\n");
+    subscribe_to_topics(client);
+    pubsub_close(client);
+
+    return 0;
+}
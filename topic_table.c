@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "topic_table.h"
+
+#define TABLE_INITIAL_SIZE 64
+#define SUB_INDEX_MIN 16  // subscriber sets this big are indexed; smaller ones are scanned
+
+// FNV-1a, 64 bit
+uint64_t topic_hash(const char *name, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int topic_table_init(TopicTable *table) {
+    table->slots = calloc(TABLE_INITIAL_SIZE, sizeof(TopicEntry *));
+    if (!table->slots) return -1;
+    table->cap = TABLE_INITIAL_SIZE;
+    table->count = 0;
+    return 0;
+}
+
+static void free_group(ConsumerGroup *group) {
+    free(group->members);
+    free(group->name);
+    free(group);
+}
+
+static void free_entry(TopicEntry *entry) {
+    for (size_t i = 0; i < entry->group_count; i++) free_group(entry->groups[i]);
+    free(entry->groups);
+    free(entry->subscribers);
+    free(entry->sub_from);
+    free(entry->sub_index);
+    free(entry->name);
+    free(entry);
+}
+
+void topic_table_destroy(TopicTable *table) {
+    for (size_t i = 0; i < table->cap; i++) {
+        if (table->slots[i]) free_entry(table->slots[i]);
+    }
+    free(table->slots);
+    table->slots = NULL;
+    table->cap = 0;
+    table->count = 0;
+}
+
+void topic_table_clear(TopicTable *table) {
+    if (table->count == 0) return;
+    for (size_t i = 0; i < table->cap; i++) {
+        if (table->slots[i]) free_entry(table->slots[i]);
+        table->slots[i] = NULL;
+    }
+    table->count = 0;
+}
+
+TopicEntry *topic_table_find(TopicTable *table, const char *name, size_t len, uint64_t hash) {
+    size_t mask = table->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        TopicEntry *entry = table->slots[i];
+        if (!entry) return NULL;
+        if (entry->hash == hash && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+    }
+}
+
+static void insert_slot(TopicEntry **slots, size_t cap, TopicEntry *entry) {
+    size_t mask = cap - 1;
+    size_t i = entry->hash & mask;
+    while (slots[i]) i = (i + 1) & mask;
+    slots[i] = entry;
+}
+
+static int grow(TopicTable *table) {
+    size_t cap = table->cap * 2;
+    TopicEntry **slots = calloc(cap, sizeof(TopicEntry *));
+    if (!slots) return -1;
+    for (size_t i = 0; i < table->cap; i++) {
+        if (table->slots[i]) insert_slot(slots, cap, table->slots[i]);
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->cap = cap;
+    return 0;
+}
+
+TopicEntry *topic_table_get_or_create(TopicTable *table, const char *name, size_t len, uint64_t hash) {
+    TopicEntry *entry = topic_table_find(table, name, len, hash);
+    if (entry) return entry;
+
+    // Keep the load factor under 3/4 so probe chains stay short
+    if ((table->count + 1) * 4 > table->cap * 3 && grow(table) < 0) return NULL;
+
+    entry = calloc(1, sizeof(TopicEntry));
+    if (!entry) return NULL;
+    entry->name = malloc(len + 1);
+    if (!entry->name) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->name_len = len;
+    entry->hash = hash;
+    entry->remote_owner = -1;
+    entry->prev_owner = -1;
+
+    insert_slot(table->slots, table->cap, entry);
+    table->count++;
+    return entry;
+}
+
+void topic_table_remove(TopicTable *table, TopicEntry *entry) {
+    size_t mask = table->cap - 1;
+    size_t i = entry->hash & mask;
+    while (table->slots[i] != entry) {
+        if (!table->slots[i]) return;
+        i = (i + 1) & mask;
+    }
+
+    // Backward-shift deletion: pull later members of the probe chain into
+    // the hole so lookups never need tombstones
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+        size_t home = table->slots[j]->hash & mask;
+        int movable = hole <= j ? (home <= hole || home > j) : (home <= hole && home > j);
+        if (movable) {
+            table->slots[hole] = table->slots[j];
+            hole = j;
+        }
+    }
+    table->slots[hole] = NULL;
+    table->count--;
+    free_entry(entry);
+}
+
+int topic_in_use(const TopicEntry *entry) {
+    return entry->sub_count > 0 || entry->group_count > 0;
+}
+
+int topic_add_subscriber(TopicEntry *entry, void *sub) {
+    return topic_add_subscriber_from(entry, sub, 0);
+}
+
+static size_t sub_hash(const void *sub) {
+    return (size_t)(((uintptr_t)sub >> 4) * 11400714819323198485ULL >> 16);
+}
+
+// The index slot holding position pos of the set, whose subscriber is sub
+static size_t find_sub_slot(const TopicEntry *entry, const void *sub, size_t pos) {
+    size_t mask = entry->sub_index_cap - 1;
+    size_t i = sub_hash(sub) & mask;
+    while (entry->sub_index[i] != pos + 1) i = (i + 1) & mask;
+    return i;
+}
+
+static void insert_sub_slot(size_t *slots, size_t cap, const void *sub, size_t pos) {
+    size_t mask = cap - 1;
+    size_t i = sub_hash(sub) & mask;
+    while (slots[i]) i = (i + 1) & mask;
+    slots[i] = pos + 1;
+}
+
+// Rebuild the index for up to count subscribers at half load. Without
+// memory the index is dropped, and removal falls back to scanning.
+static void reindex_subscribers(TopicEntry *entry, size_t count) {
+    size_t cap = entry->sub_index_cap ? entry->sub_index_cap : SUB_INDEX_MIN * 2;
+    while (cap < count * 2) cap *= 2;
+    free(entry->sub_index);
+    entry->sub_index = calloc(cap, sizeof(size_t));
+    entry->sub_index_cap = entry->sub_index ? cap : 0;
+    for (size_t i = 0; entry->sub_index && i < entry->sub_count; i++) {
+        insert_sub_slot(entry->sub_index, cap, entry->subscribers[i], i);
+    }
+}
+
+int topic_add_subscriber_from(TopicEntry *entry, void *sub, unsigned long long from) {
+    if (entry->sub_count == entry->sub_cap) {
+        size_t cap = entry->sub_cap ? entry->sub_cap * 2 : 4;
+        void **subs = realloc(entry->subscribers, cap * sizeof(void *));
+        if (!subs) return -1;
+        entry->subscribers = subs;
+        unsigned long long *sub_from = realloc(entry->sub_from, cap * sizeof(*sub_from));
+        if (!sub_from) return -1;
+        entry->sub_from = sub_from;
+        entry->sub_cap = cap;
+    }
+
+    entry->subscribers[entry->sub_count] = sub;
+    entry->sub_from[entry->sub_count] = from;
+    entry->sub_count++;
+    if (entry->sub_count * 2 > entry->sub_index_cap && entry->sub_count >= SUB_INDEX_MIN) {
+        reindex_subscribers(entry, entry->sub_count);
+    } else if (entry->sub_index) {
+        insert_sub_slot(entry->sub_index, entry->sub_index_cap, sub, entry->sub_count - 1);
+    }
+    return 0;
+}
+
+// Backward-shift deletion of index slot i, as in topic_table_remove
+static void remove_sub_slot(TopicEntry *entry, size_t i) {
+    size_t mask = entry->sub_index_cap - 1;
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; entry->sub_index[j]; j = (j + 1) & mask) {
+        size_t home = sub_hash(entry->subscribers[entry->sub_index[j] - 1]) & mask;
+        int movable = hole <= j ? (home <= hole || home > j) : (home <= hole && home > j);
+        if (movable) {
+            entry->sub_index[hole] = entry->sub_index[j];
+            hole = j;
+        }
+    }
+    entry->sub_index[hole] = 0;
+}
+
+int topic_remove_subscriber(TopicEntry *entry, void *sub) {
+    size_t pos = entry->sub_count;
+    if (entry->sub_index) {
+        size_t mask = entry->sub_index_cap - 1;
+        for (size_t i = sub_hash(sub) & mask; entry->sub_index[i]; i = (i + 1) & mask) {
+            if (entry->subscribers[entry->sub_index[i] - 1] == sub) {
+                pos = entry->sub_index[i] - 1;
+                remove_sub_slot(entry, i);
+                break;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < entry->sub_count; i++) {
+            if (entry->subscribers[i] == sub) {
+                pos = i;
+                break;
+            }
+        }
+    }
+    if (pos == entry->sub_count) return 0;
+
+    size_t last = --entry->sub_count;
+    if (pos != last) {
+        if (entry->sub_index) entry->sub_index[find_sub_slot(entry, entry->subscribers[last], last)] = pos + 1;
+        entry->subscribers[pos] = entry->subscribers[last];
+        entry->sub_from[pos] = entry->sub_from[last];
+    }
+    return 1;
+}
+
+ConsumerGroup *topic_find_group(TopicEntry *entry, const char *name, size_t len) {
+    for (size_t i = 0; i < entry->group_count; i++) {
+        ConsumerGroup *group = entry->groups[i];
+        if (group->name_len == len && memcmp(group->name, name, len) == 0) return group;
+    }
+    return NULL;
+}
+
+static ConsumerGroup *create_group(TopicEntry *entry, const char *name, size_t len) {
+    if (entry->group_count == entry->group_cap) {
+        size_t cap = entry->group_cap ? entry->group_cap * 2 : 2;
+        ConsumerGroup **groups = realloc(entry->groups, cap * sizeof(ConsumerGroup *));
+        if (!groups) return NULL;
+        entry->groups = groups;
+        entry->group_cap = cap;
+    }
+
+    ConsumerGroup *group = calloc(1, sizeof(ConsumerGroup));
+    if (!group) return NULL;
+    group->name = malloc(len + 1);
+    if (!group->name) {
+        free(group);
+        return NULL;
+    }
+    memcpy(group->name, name, len);
+    group->name[len] = '\0';
+    group->name_len = len;
+    entry->groups[entry->group_count++] = group;
+    return group;
+}
+
+static void remove_group(TopicEntry *entry, ConsumerGroup *group) {
+    for (size_t i = 0; i < entry->group_count; i++) {
+        if (entry->groups[i] == group) {
+            entry->groups[i] = entry->groups[--entry->group_count];
+            free_group(group);
+            return;
+        }
+    }
+}
+
+ConsumerGroup *topic_join_group(TopicEntry *entry, const char *name, size_t len, void *member) {
+    ConsumerGroup *group = topic_find_group(entry, name, len);
+    if (!group) group = create_group(entry, name, len);
+    if (!group) return NULL;
+
+    if (group->member_count == group->member_cap) {
+        size_t cap = group->member_cap ? group->member_cap * 2 : 4;
+        void **members = realloc(group->members, cap * sizeof(void *));
+        if (!members) {
+            if (group->member_count == 0) remove_group(entry, group);
+            return NULL;
+        }
+        group->members = members;
+        group->member_cap = cap;
+    }
+    group->members[group->member_count++] = member;
+    return group;
+}
+
+int topic_leave_group(TopicEntry *entry, ConsumerGroup *group, void *member) {
+    for (size_t i = 0; i < group->member_count; i++) {
+        if (group->members[i] == member) {
+            group->members[i] = group->members[--group->member_count];
+            if (group->member_count == 0) remove_group(entry, group);
+            return 1;
+        }
+    }
+    return 0;
+}
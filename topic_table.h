@@ -0,0 +1,88 @@
+#ifndef TOPIC_TABLE_H
+#define TOPIC_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A consumer group on a topic: each message goes to one of its members.
+// A member may appear several times to get a bigger share.
+typedef struct {
+    char *name;
+    size_t name_len;
+    void **members;
+    size_t member_count;
+    size_t member_cap;
+    size_t next;  // round-robin cursor
+} ConsumerGroup;
+
+// A topic and the set of subscribers attached to it. Entries are heap
+// allocated so pointers to them (and to the interned name) stay valid while
+// the table grows.
+typedef struct {
+    char *name;
+    size_t name_len;
+    uint64_t hash;
+    void **subscribers;
+    unsigned long long *sub_from;  // per subscriber: first offset delivered to it live
+    size_t sub_count;
+    size_t sub_cap;
+    size_t *sub_index;     // once the set is big: subscriber -> position + 1, open addressing
+    size_t sub_index_cap;  // zero or a power of two
+    ConsumerGroup **groups;  // heap allocated, so pointers to them stay valid
+    size_t group_count;
+    size_t group_cap;
+    int remote_owner;  // broker holding our interest in this topic, or -1
+    int prev_owner;    // previous holder, still accepted while a rebalance drains
+} TopicEntry;
+
+// Open-addressing (linear probing) hash map from topic name to TopicEntry.
+// Not thread-safe; callers hold their own lock.
+typedef struct {
+    TopicEntry **slots;
+    size_t cap;  // always a power of two
+    size_t count;
+} TopicTable;
+
+uint64_t topic_hash(const char *name, size_t len);
+
+int topic_table_init(TopicTable *table);
+void topic_table_destroy(TopicTable *table);
+
+// Free every entry, keeping the table ready for use
+void topic_table_clear(TopicTable *table);
+
+TopicEntry *topic_table_find(TopicTable *table, const char *name, size_t len, uint64_t hash);
+
+// Find the topic or create it with no subscribers. Returns NULL on OOM.
+TopicEntry *topic_table_get_or_create(TopicTable *table, const char *name, size_t len, uint64_t hash);
+
+// Unlink and free an entry. Its subscriber set must already be empty.
+void topic_table_remove(TopicTable *table, TopicEntry *entry);
+
+// Whether an entry still has subscribers or consumer groups
+int topic_in_use(const TopicEntry *entry);
+
+// Append a subscriber; callers track their own subscriptions so the set is
+// not scanned for duplicates. Returns 0 on success and -1 on OOM.
+int topic_add_subscriber(TopicEntry *entry, void *sub);
+
+// Same, for a subscriber that already has every offset below from (it
+// caught up on the topic's history)
+int topic_add_subscriber_from(TopicEntry *entry, void *sub, unsigned long long from);
+
+// Returns 1 if removed, 0 if sub was not subscribed. Constant time: big
+// sets keep an index of where each subscriber sits, and the last one fills
+// the gap, so the order of subscribers is not kept.
+int topic_remove_subscriber(TopicEntry *entry, void *sub);
+
+ConsumerGroup *topic_find_group(TopicEntry *entry, const char *name, size_t len);
+
+// Add one membership of member to a group, creating the group if needed.
+// Returns the group or NULL on OOM.
+ConsumerGroup *topic_join_group(TopicEntry *entry, const char *name, size_t len, void *member);
+
+// Remove one membership of member; the group is freed with its last
+// member. Returns 1 if removed, 0 if member was not in the group.
+int topic_leave_group(TopicEntry *entry, ConsumerGroup *group, void *member);
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "topic_trie.h"
+
+#define CHILDREN_INITIAL_SIZE 4
+
+// One level of one or more patterns. Children are keyed by their level,
+// wildcards included, in a small open-addressing table.
+struct TrieNode {
+    char *level;
+    size_t level_len;
+    uint64_t hash;
+    TrieNode *parent;
+    TrieNode **children;
+    size_t child_cap;  // zero or a power of two
+    size_t child_count;
+    void *value;       // set if a pattern ends here
+};
+
+int topic_is_pattern(const char *topic, size_t len) {
+    return memchr(topic, '+', len) != NULL || memchr(topic, '#', len) != NULL;
+}
+
+int topic_pattern_valid(const char *pattern, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (pattern[i] != '+' && pattern[i] != '#') continue;
+        int whole_level = (i == 0 || pattern[i - 1] == '/') && (i + 1 == len || pattern[i + 1] == '/');
+        if (!whole_level || (pattern[i] == '#' && i + 1 != len)) return 0;
+    }
+    return len > 0;
+}
+
+static TrieNode *new_node(TrieNode *parent, const char *level, size_t len, uint64_t hash) {
+    TrieNode *node = calloc(1, sizeof(TrieNode));
+    if (!node) return NULL;
+    node->level = malloc(len + 1);
+    if (!node->level) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->level, level, len);
+    node->level[len] = '\0';
+    node->level_len = len;
+    node->hash = hash;
+    node->parent = parent;
+    return node;
+}
+
+static void free_node(TrieNode *node) {
+    for (size_t i = 0; i < node->child_cap; i++) {
+        if (node->children[i]) free_node(node->children[i]);
+    }
+    free(node->children);
+    free(node->level);
+    free(node);
+}
+
+static TrieNode *find_child(const TrieNode *node, const char *level, size_t len, uint64_t hash) {
+    if (node->child_count == 0) return NULL;
+    size_t mask = node->child_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        TrieNode *child = node->children[i];
+        if (!child) return NULL;
+        if (child->hash == hash && child->level_len == len && memcmp(child->level, level, len) == 0) {
+            return child;
+        }
+    }
+}
+
+static void insert_child_slot(TrieNode **slots, size_t cap, TrieNode *child) {
+    size_t mask = cap - 1;
+    size_t i = child->hash & mask;
+    while (slots[i]) i = (i + 1) & mask;
+    slots[i] = child;
+}
+
+// Rebuild the child table at cap slots, leaving out skip
+static int rehash_children(TrieNode *node, size_t cap, const TrieNode *skip) {
+    TrieNode **slots = calloc(cap, sizeof(TrieNode *));
+    if (!slots) return -1;
+    for (size_t i = 0; i < node->child_cap; i++) {
+        if (node->children[i] && node->children[i] != skip) insert_child_slot(slots, cap, node->children[i]);
+    }
+    free(node->children);
+    node->children = slots;
+    node->child_cap = cap;
+    return 0;
+}
+
+static TrieNode *get_or_create_child(TrieNode *node, const char *level, size_t len) {
+    uint64_t hash = topic_hash(level, len);
+    TrieNode *child = find_child(node, level, len, hash);
+    if (child) return child;
+
+    if ((node->child_count + 1) * 4 > node->child_cap * 3 &&
+        rehash_children(node, node->child_cap ? node->child_cap * 2 : CHILDREN_INITIAL_SIZE, NULL) < 0) {
+        return NULL;
+    }
+    child = new_node(node, level, len, hash);
+    if (!child) return NULL;
+    insert_child_slot(node->children, node->child_cap, child);
+    node->child_count++;
+    return child;
+}
+
+// Free nodes that no longer lead to any pattern, from node up
+static void prune(TrieNode *node) {
+    while (node->parent && !node->value && node->child_count == 0) {
+        TrieNode *parent = node->parent;
+        // Rebuilding at the same size cannot fail for want of room, only of memory
+        if (rehash_children(parent, parent->child_cap, node) < 0) return;
+        parent->child_count--;
+        free_node(node);
+        node = parent;
+    }
+}
+
+// The node a pattern ends at, or NULL
+static TrieNode *find_pattern(const TopicTrie *trie, const char *pattern, size_t len) {
+    TrieNode *node = trie->root;
+    for (size_t pos = 0; node; ) {
+        const char *slash = memchr(pattern + pos, '/', len - pos);
+        size_t end = slash ? (size_t)(slash - pattern) : len;
+        node = find_child(node, pattern + pos, end - pos, topic_hash(pattern + pos, end - pos));
+        if (!slash) break;
+        pos = end + 1;
+    }
+    return node;
+}
+
+int topic_trie_init(TopicTrie *trie) {
+    trie->count = 0;
+    trie->generation = 1;  // a zero-filled cache starts out stale
+    trie->root = new_node(NULL, "", 0, 0);
+    if (!trie->root) return -1;
+    memset(&trie->cache, 0, sizeof(trie->cache));
+    return 0;
+}
+
+void topic_trie_destroy(TopicTrie *trie) {
+    if (trie->root) free_node(trie->root);
+    trie->root = NULL;
+    trie_cache_destroy(&trie->cache);
+}
+
+int topic_trie_insert(TopicTrie *trie, const char *pattern, size_t len, void *value) {
+    TrieNode *node = trie->root;
+    for (size_t pos = 0; node; ) {
+        const char *slash = memchr(pattern + pos, '/', len - pos);
+        size_t end = slash ? (size_t)(slash - pattern) : len;
+        TrieNode *child = get_or_create_child(node, pattern + pos, end - pos);
+        if (!child) {
+            prune(node);
+            return -1;
+        }
+        node = child;
+        if (!slash) break;
+        pos = end + 1;
+    }
+
+    if (!node->value) trie->count++;
+    node->value = value;
+    trie->generation++;
+    return 0;
+}
+
+int topic_trie_remove(TopicTrie *trie, const char *pattern, size_t len) {
+    TrieNode *node = find_pattern(trie, pattern, len);
+    if (!node || !node->value) return 0;
+
+    node->value = NULL;
+    trie->count--;
+    prune(node);
+    trie->generation++;
+    return 1;
+}
+
+static int add_match(TrieMatches *m, void *value) {
+    if (m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 8;
+        void **values = realloc(m->values, cap * sizeof(void *));
+        if (!values) return -1;
+        m->values = values;
+        m->cap = cap;
+    }
+    m->values[m->count++] = value;
+    return 0;
+}
+
+// Collect the patterns under node matching the topic's levels from pos on
+// (none left once pos is past the end)
+static int match_levels(const TrieNode *node, const char *topic, size_t len, size_t pos, TrieMatches *m) {
+    const TrieNode *rest = find_child(node, "#", 1, topic_hash("#", 1));
+    if (rest && rest->value && add_match(m, rest->value) < 0) return -1;
+    if (pos > len) {
+        return node->value ? add_match(m, node->value) : 0;
+    }
+
+    const char *slash = memchr(topic + pos, '/', len - pos);
+    size_t end = slash ? (size_t)(slash - topic) : len;
+    const TrieNode *exact = find_child(node, topic + pos, end - pos, topic_hash(topic + pos, end - pos));
+    if (exact && match_levels(exact, topic, len, end + 1, m) < 0) return -1;
+    const TrieNode *plus = find_child(node, "+", 1, topic_hash("+", 1));
+    if (plus && match_levels(plus, topic, len, end + 1, m) < 0) return -1;
+    return 0;
+}
+
+void *const *topic_trie_match(TopicTrie *trie, const char *topic, size_t len, TrieMatches *scratch,
+                              size_t *count) {
+    return topic_trie_match_cached(trie, &trie->cache, topic, len, scratch, count);
+}
+
+void *const *topic_trie_match_cached(const TopicTrie *trie, TrieCache *cache, const char *topic, size_t len,
+                                     TrieMatches *scratch, size_t *count) {
+    if (cache->generation != trie->generation) {
+        topic_table_clear(&cache->table);
+        cache->generation = trie->generation;
+    }
+    uint64_t hash = topic_hash(topic, len);
+    TopicEntry *cached = cache->table.count ? topic_table_find(&cache->table, topic, len, hash) : NULL;
+    if (cached) {
+        *count = cached->sub_count;
+        return cached->subscribers;
+    }
+
+    *count = 0;
+    scratch->count = 0;
+    if (trie->count == 0) return NULL;
+    if (match_levels(trie->root, topic, len, 0, scratch) < 0) return NULL;
+
+    if (cache->table.count < TRIE_CACHE_TOPICS &&
+        (cache->table.slots || topic_table_init(&cache->table) == 0)) {
+        TopicEntry *entry = topic_table_get_or_create(&cache->table, topic, len, hash);
+        for (size_t i = 0; entry && i < scratch->count; i++) {
+            if (topic_add_subscriber(entry, scratch->values[i]) < 0) {
+                topic_table_remove(&cache->table, entry);
+                entry = NULL;
+            }
+        }
+        if (entry) {
+            *count = entry->sub_count;
+            return entry->subscribers;
+        }
+    }
+    *count = scratch->count;
+    return scratch->values;
+}
+
+void trie_cache_destroy(TrieCache *cache) {
+    topic_table_destroy(&cache->table);
+    cache->generation = 0;
+}
@@ -0,0 +1,75 @@
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "topic_table.h"
+
+#define TRIE_CACHE_TOPICS 4096  // topics whose matches are remembered at once
+
+// Wildcard subscriptions over '/'-separated topic levels, MQTT style: '+'
+// matches exactly one level and a final '#' matches any number of them,
+// including none ("food/#" matches "food" as well as "food/curry/veg").
+//
+// Patterns live in a trie with one node per level, so matching a topic
+// costs time proportional to its depth rather than to the number of
+// patterns. The matches of each topic are cached until the next insert or
+// remove. Not thread-safe; callers hold their own lock, and matching
+// through the trie's own cache counts as a write because it fills it.
+typedef struct TrieNode TrieNode;
+
+// Remembered matches: topic -> the values matching it, as its subscribers.
+// A cache is emptied when next used after the trie changed, so each thread
+// may keep its own and match under a shared lock. Zero-filled is empty.
+typedef struct {
+    TopicTable table;
+    uint64_t generation;  // of the trie the entries were matched in
+} TrieCache;
+
+typedef struct {
+    TrieNode *root;
+    size_t count;         // patterns
+    uint64_t generation;  // bumped by every insert and remove
+    TrieCache cache;
+} TopicTrie;
+
+// Caller-owned room for matches that do not fit in the cache
+typedef struct {
+    void **values;
+    size_t count;
+    size_t cap;
+} TrieMatches;
+
+// Whether a topic contains wildcards
+int topic_is_pattern(const char *topic, size_t len);
+
+// Whether a pattern is well formed: wildcards fill a whole level and '#'
+// only appears last
+int topic_pattern_valid(const char *pattern, size_t len);
+
+int topic_trie_init(TopicTrie *trie);
+void topic_trie_destroy(TopicTrie *trie);
+
+// Attach a non-NULL value to a pattern, replacing any value it had.
+// Returns 0 on success and -1 on OOM.
+int topic_trie_insert(TopicTrie *trie, const char *pattern, size_t len, void *value);
+
+// Returns 1 if the pattern was there, 0 if not
+int topic_trie_remove(TopicTrie *trie, const char *pattern, size_t len);
+
+// The values of every pattern matching topic, and their number in *count.
+// They come from the cache, which stays valid until the next insert or
+// remove, or from scratch when the cache is full. Nothing matches when
+// out of memory.
+void *const *topic_trie_match(TopicTrie *trie, const char *topic, size_t len, TrieMatches *scratch,
+                              size_t *count);
+
+// Same, through a cache of the caller's. Only reads the trie, so any
+// number of threads may match at once, each with its own cache and scratch.
+void *const *topic_trie_match_cached(const TopicTrie *trie, TrieCache *cache, const char *topic, size_t len,
+                                     TrieMatches *scratch, size_t *count);
+
+void trie_cache_destroy(TrieCache *cache);
+
+#endif
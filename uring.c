@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define CQ_FACTOR 8  // completions per submission slot: multishot requests post many each
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Check that the kernel does what the broker relies on: a multishot
+// receive into a provided buffer. Returns -1 with errno set if it does not.
+static int self_test(Uring *ring) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+
+    int ok = 0;
+    int done = 0;
+    int cancelled = 0;
+    if (uring_prep_recv_multishot(ring, sv[0], 1) == 0 && uring_wait(ring, 0) == 0 && write(sv[1], "x", 1) == 1) {
+        for (int tries = 0; !done && tries < 20; tries++) {
+            if (uring_wait(ring, 50) < 0) break;
+            struct io_uring_cqe *cqe;
+            while ((cqe = uring_peek(ring))) {
+                if (cqe->user_data == 1) {
+                    if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE)) ok = 1;
+                    if (cqe->flags & IORING_CQE_F_BUFFER) uring_recycle(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                    if (!(cqe->flags & IORING_CQE_F_MORE)) done = 1;
+                }
+                uring_advance(ring);
+            }
+            // Once the data is in, stop the receive
+            if (ok && !done && !cancelled) cancelled = uring_prep_cancel(ring, 1) == 0;
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    if (!ok || !done) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return 0;
+}
+
+int uring_init(Uring *ring, unsigned entries, unsigned buf_count, size_t buf_size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * CQ_FACTOR;
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd < 0) return -1;
+
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & needed) != needed) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    // The submission and completion rings share one mapping
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        ring->rings = NULL;
+        goto fail;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *base = ring->rings;
+    ring->sq_head = (unsigned *)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + p.sq_off.array);
+    ring->cq_head = (unsigned *)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    for (unsigned i = 0; i < p.sq_entries; i++) ring->sq_array[i] = i;
+    ring->sqe_tail = *ring->sq_tail;
+
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+    ring->buf_ring = mmap(NULL, buf_count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        goto fail;
+    }
+    ring->buffers = mmap(NULL, buf_count * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+    for (unsigned bid = 0; bid < buf_count; bid++) uring_recycle(ring, bid);
+
+    if (self_test(ring) < 0) goto fail;
+    return 0;
+
+fail:;
+    int err = errno;
+    uring_destroy(ring);
+    errno = err;
+    return -1;
+}
+
+void uring_destroy(Uring *ring) {
+    if (ring->buffers) munmap(ring->buffers, ring->buf_count * ring->buf_size);
+    if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_count * sizeof(struct io_uring_buf));
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->rings) munmap(ring->rings, ring->rings_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Hand the queued submissions to the kernel, optionally waiting for
+// min_complete completions for up to ts
+static int enter(Uring *ring, unsigned min_complete, struct __kernel_timespec *ts) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)ts;
+    unsigned flags = IORING_ENTER_EXT_ARG | (min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (to_submit == 0 && min_complete == 0) return 0;
+    if (sys_enter(ring->fd, to_submit, min_complete, flags, &arg, sizeof(arg)) < 0) {
+        // A timeout, a signal, or completions to reap before more fit
+        if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN) return 0;
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+        if (enter(ring, 0, NULL) < 0) return NULL;
+        if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_wait(Uring *ring, long long timeout_us) {
+    // With completions already waiting, only collect what else is ready
+    int ready = uring_peek(ring) != NULL;
+    struct __kernel_timespec ts = { 0, 0 };
+    if (timeout_us > 0 && !ready) {
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = timeout_us % 1000000 * 1000;
+    }
+    return enter(ring, 1, timeout_us < 0 && !ready ? NULL : &ts);
+}
+
+int uring_submit(Uring *ring) {
+    return enter(ring, 0, NULL);
+}
+
+struct io_uring_cqe *uring_peek(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_advance(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *uring_buffer(Uring *ring, unsigned bid) {
+    return ring->buffers + (size_t)bid * ring->buf_size;
+}
+
+void uring_recycle(Uring *ring, unsigned bid) {
+    // The ring's tail shares the first slot; only addr, len and bid are ours
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uintptr_t)uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+int uring_prep_accept_multishot(Uring *ring, int fd, int flags, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = flags;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_prep_recv_multishot(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_prep_sendmsg(Uring *ring, int fd, const struct msghdr *msg, int flags, int poll_first,
+                       uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->ioprio = poll_first ? IORING_RECVSEND_POLL_FIRST : 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_prep_poll(Uring *ring, int fd, unsigned events, int multishot, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_prep_cancel(Uring *ring, uint64_t target) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = 0;
+    return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring driver over the raw system calls, for one thread.
+// Submissions are queued with the uring_prep_* calls and all go to the
+// kernel together on the next uring_wait, which also collects completions.
+// Receives take their memory from a ring of provided buffers, handed back
+// with uring_recycle once their data has been used.
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;  // ours, published to *sq_tail on submit
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned buf_count;
+    size_t buf_size;
+    uint16_t buf_tail;
+} Uring;
+
+#define URING_BUFFER_GROUP 0
+
+// Set up a ring with entries submission slots and buf_count provided
+// buffers of buf_size bytes (buf_count a power of two). Returns -1 with
+// errno set when the kernel lacks io_uring or any feature used here:
+// provided buffer rings and multishot accept and receive (Linux 6.0).
+int uring_init(Uring *ring, unsigned entries, unsigned buf_count, size_t buf_size);
+void uring_destroy(Uring *ring);
+
+// A zeroed submission slot, or NULL when the queue is full even after
+// handing what it holds to the kernel
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+// Submit everything queued and wait up to timeout_us microseconds (-1 for
+// ever) for at least one completion. Returns 0, or -1 with errno set on
+// failure.
+int uring_wait(Uring *ring, long long timeout_us);
+
+// Submit everything queued without waiting, as before closing a socket
+// queued submissions still name
+int uring_submit(Uring *ring);
+
+// The next completion, or NULL; uring_advance consumes it
+struct io_uring_cqe *uring_peek(Uring *ring);
+void uring_advance(Uring *ring);
+
+// Data of the provided buffer a receive completed into
+char *uring_buffer(Uring *ring, unsigned bid);
+
+// Give a provided buffer back for further receives
+void uring_recycle(Uring *ring, unsigned bid);
+
+// Each returns -1 when the submission queue is full
+int uring_prep_accept_multishot(Uring *ring, int fd, int flags, uint64_t user_data);
+int uring_prep_recv_multishot(Uring *ring, int fd, uint64_t user_data);
+int uring_prep_sendmsg(Uring *ring, int fd, const struct msghdr *msg, int flags, int poll_first,
+                       uint64_t user_data);
+int uring_prep_poll(Uring *ring, int fd, unsigned events, int multishot, uint64_t user_data);
+// Cancel the request submitted with target; its completion is user_data 0
+int uring_prep_cancel(Uring *ring, uint64_t target);
+
+#endif